@@ -0,0 +1,214 @@
+-- Copyright (C) helloyi
+--
+-- The benchmark handlers of bench/nginx.conf, run by bench/run.sh.  Each
+-- result is one JSON object per line, so runs can be compared by tools.
+
+
+local ffi = require("ffi")
+local shrbtree = require("shrbtree")
+
+ffi.cdef[[
+typedef struct {
+    long  tv_sec;
+    long  tv_nsec;
+} shrbtree_bench_timespec_t;
+
+int clock_gettime(int clk_id, shrbtree_bench_timespec_t *tp);
+]]
+
+local CLOCK_MONOTONIC = 1
+local ts = ffi.new("shrbtree_bench_timespec_t")
+
+local floor = math.floor
+local random = math.random
+local format = string.format
+local sort = table.sort
+
+
+local _M = {}
+
+
+local function now()
+    ffi.C.clock_gettime(CLOCK_MONOTONIC, ts)
+    return tonumber(ts.tv_sec) * 1e9 + tonumber(ts.tv_nsec)
+end
+
+
+local function lua_cmp(a, b)
+    if a > b then
+        return 1
+    end
+
+    if a < b then
+        return -1
+    end
+
+    return 0
+end
+
+
+-- the key of the ith node, in the order of i
+local keys = {
+    number = function (i) return i end,
+    string = function (i) return format("%012d", i) end,
+    tuple = function (i) return {floor(i / 1000), i % 1000} end,
+    lua = function (i) return i end,
+}
+
+
+local strings = {
+    string16 = string.rep("v", 16),
+    string1k = string.rep("v", 1024),
+}
+
+
+local values = {
+    number = function (i) return i end,
+    string16 = function () return strings.string16 end,
+    string1k = function () return strings.string1k end,
+    table8 = function (i)
+        return {id = i, a = 1, b = 2, c = 3, d = "d", e = "e", f = true,
+                g = strings.string16}
+    end,
+}
+
+
+local function args()
+    local a = ngx.req.get_uri_args()
+
+    local key = a.key or "number"
+    local shape = a.shape or "number"
+
+    if not keys[key] or not values[shape] then
+        ngx.status = ngx.HTTP_BAD_REQUEST
+        ngx.say("bad key or shape")
+        return ngx.exit(ngx.HTTP_BAD_REQUEST)
+    end
+
+    return {
+        key = key,
+        shape = shape,
+        n = tonumber(a.n) or 1000,
+        ops = tonumber(a.ops) or 100000,
+        batch = tonumber(a.batch) or 100,
+        op = a.op or "get",
+        cmp = key == "lua" and lua_cmp or nil,
+        rbtree = shrbtree[a.zone or "bench"],
+    }
+end
+
+
+local function percentile(sorted, p)
+    return sorted[math.max(1, math.ceil(#sorted * p))]
+end
+
+
+local function report(a, op, ops, elapsed, lat)
+    sort(lat)
+
+    ngx.say(format('{"bench":"micro","key":"%s","shape":"%s","size":%d,'
+                   .. '"op":"%s","ops":%d,"ops_per_sec":%.0f,'
+                   .. '"p50_ns":%.0f,"p99_ns":%.0f,"max_ns":%.0f,'
+                   .. '"pid":%d}',
+                   a.key, a.shape, a.n, op, ops, ops / (elapsed / 1e9),
+                   percentile(lat, 0.5), percentile(lat, 0.99), lat[#lat],
+                   ngx.worker.pid()))
+end
+
+
+-- /fill?key=&shape=&n=: replaces the tree by n nodes, keys 2, 4, ... 2n
+function _M.fill()
+    local a = args()
+    local key, value = keys[a.key], values[a.shape]
+    local i = 0
+
+    local t = now()
+
+    local ok, err = a.rbtree:bulk_load(function ()
+        i = i + 1
+        if i > a.n then
+            return nil
+        end
+
+        return key(i * 2), value(i)
+    end, {cmp = a.cmp, swap = true})
+
+    ngx.say(format('{"bench":"fill","key":"%s","shape":"%s","size":%d,'
+                   .. '"ok":%s,"elapsed_ms":%.1f}',
+                   a.key, a.shape, a.n, tostring(ok),
+                   (now() - t) / 1e6))
+
+    if not ok then
+        ngx.log(ngx.ERR, "fill failed: ", err)
+    end
+end
+
+
+-- /micro?key=&shape=&n=&ops=: times get, insert and delete one by one,
+-- on a tree filled by /fill; insert and delete use the odd keys
+function _M.micro()
+    local a = args()
+    local rbtree, cmp = a.rbtree, a.cmp
+    local key, value = keys[a.key], values[a.shape]
+    local ops = math.min(a.ops, a.n)
+    local lat = {}
+    local start, t, elapsed
+
+    start = now()
+    for i = 1, ops do
+        t = now()
+        rbtree:get{key(random(a.n) * 2), cmp}
+        lat[i] = now() - t
+    end
+    elapsed = now() - start
+    report(a, "get", ops, elapsed, lat)
+
+    -- the odd keys from a random start, wrapping around
+    local first = random(a.n)
+
+    start = now()
+    for i = 1, ops do
+        local k = (first + i) % a.n * 2 + 1
+        t = now()
+        rbtree:insert{key(k), value(k), cmp}
+        lat[i] = now() - t
+    end
+    elapsed = now() - start
+    report(a, "insert", ops, elapsed, lat)
+
+    start = now()
+    for i = 1, ops do
+        local k = (first + i) % a.n * 2 + 1
+        t = now()
+        rbtree:delete{key(k), cmp}
+        lat[i] = now() - t
+    end
+    elapsed = now() - start
+    report(a, "delete", ops, elapsed, lat)
+end
+
+
+-- /load?key=&shape=&n=&op=get|set|mix&batch=: batch ops per request, for
+-- wrk with many connections and workers; mix is 90% get and 10% set
+function _M.load()
+    local a = args()
+    local rbtree, cmp = a.rbtree, a.cmp
+    local key, value = keys[a.key], values[a.shape]
+    local k
+
+    for _ = 1, a.batch do
+        k = random(a.n) * 2
+
+        if a.op == "get" or (a.op == "mix" and random(10) > 1) then
+            rbtree:get{key(k), cmp}
+
+        else
+            rbtree:set{key(k), value(k), cmp}
+        end
+    end
+
+    ngx.say("ok")
+end
+
+
+return _M
@@ -0,0 +1,104 @@
+#!/bin/sh
+
+# Copyright (C) helloyi
+#
+# Runs the benchmarks of bench/bench.lua with an nginx built with this
+# module, and writes the results as JSON lines to stdout:
+#
+#   NGINX=/path/to/nginx bench/run.sh > results.jsonl
+#
+# The knobs are environment variables, see the defaults below.  "micro"
+# times single ops in one worker; "load" drives the /load path with wrk
+# from 1 to 64 workers, for the lock contention.
+
+set -e
+
+NGINX=${NGINX:-nginx}
+WRK=${WRK:-wrk}
+PORT=${PORT:-8089}
+ZONE=${ZONE:-2g}
+KEYS=${KEYS:-"number string tuple lua"}
+SHAPES=${SHAPES:-"number string16 string1k table8"}
+SIZES=${SIZES:-"1000 10000 100000 1000000 10000000"}
+OPS=${OPS:-100000}
+WORKERS=${WORKERS:-"1 2 4 8 16 32 64"}
+LOAD_SIZE=${LOAD_SIZE:-100000}
+LOAD_OPS=${LOAD_OPS:-"get set mix"}
+DURATION=${DURATION:-10s}
+CONNECTIONS=${CONNECTIONS:-128}
+
+bench=$(cd "$(dirname "$0")" && pwd)
+prefix=$(mktemp -d)
+trap 'stop; rm -rf "$prefix"' EXIT
+
+mkdir -p "$prefix/logs" "$prefix/conf"
+
+
+# start <workers> <key>
+start() {
+    case $2 in
+    lua) params="" ;;
+    *)   params="cmp=$2" ;;
+    esac
+
+    sed -e "s|@WORKERS@|$1|" -e "s|@PORT@|$PORT|" -e "s|@ZONE@|$ZONE|" \
+        -e "s|@PARAMS@|$params|" -e "s|@BENCH@|$bench|" \
+        "$bench/nginx.conf" > "$prefix/conf/nginx.conf"
+
+    "$NGINX" -p "$prefix/" -c conf/nginx.conf
+
+    for _ in 1 2 3 4 5 6 7 8 9 10; do
+        curl -sf "http://127.0.0.1:$PORT/ping" > /dev/null && return
+        sleep 0.5
+    done
+
+    echo "nginx didn't start, see $prefix/logs/error.log" >&2
+    exit 1
+}
+
+
+stop() {
+    if [ -f "$prefix/logs/nginx.pid" ]; then
+        "$NGINX" -p "$prefix/" -c conf/nginx.conf -s quit || true
+        while [ -f "$prefix/logs/nginx.pid" ]; do sleep 0.2; done
+    fi
+}
+
+
+get() {
+    curl -sf "http://127.0.0.1:$PORT$1"
+}
+
+
+for key in $KEYS; do
+    start 1 "$key"
+
+    for shape in $SHAPES; do
+        for n in $SIZES; do
+            args="key=$key&shape=$shape&n=$n"
+            get "/fill?$args"
+            get "/micro?$args&ops=$OPS"
+        done
+    done
+
+    stop
+done
+
+
+for workers in $WORKERS; do
+    for key in $KEYS; do
+        start "$workers" "$key"
+
+        args="key=$key&shape=number&n=$LOAD_SIZE"
+        get "/fill?$args" > /dev/null
+
+        for op in $LOAD_OPS; do
+            "$WRK" -t "$workers" -c "$CONNECTIONS" -d "$DURATION" \
+                -s "$bench/wrk.lua" "http://127.0.0.1:$PORT" \
+                -- "/load?$args&op=$op" "workers=$workers,key=$key,op=$op" \
+                | grep '^{' || true
+        done
+
+        stop
+    done
+done
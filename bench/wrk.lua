@@ -0,0 +1,34 @@
+-- Copyright (C) helloyi
+--
+-- wrk -s bench/wrk.lua http://127.0.0.1:8089 -- <path> <label>
+-- requests the /load path, and prints the result as one JSON line.
+
+
+local path, label
+
+function init(args)
+    path = args[1] or "/load"
+    label = args[2] or ""
+end
+
+
+function request()
+    return wrk.format("GET", path)
+end
+
+
+function done(summary, latency, requests)
+    local seconds = summary.duration / 1e6
+
+    io.write(string.format('{"bench":"load","label":"%s","path":"%s",'
+                           .. '"requests":%d,"errors":%d,'
+                           .. '"requests_per_sec":%.1f,"p50_us":%d,'
+                           .. '"p99_us":%d,"max_us":%d}\n',
+                           label, path, summary.requests,
+                           summary.errors.status + summary.errors.timeout
+                           + summary.errors.connect + summary.errors.read
+                           + summary.errors.write,
+                           summary.requests / seconds,
+                           latency:percentile(50), latency:percentile(99),
+                           latency.max))
+end
@@ -0,0 +1,213 @@
+-- Copyright (C) helloyi
+--
+-- get, insert, set, replace and delete of a zone with cmp=number or
+-- cmp=string by LuaJIT FFI, with positional arguments, and get of a number
+-- point of a zone with cmp=interval.  The values are scalars; a table is
+-- stored and read by the table api of the zone.
+
+
+local ffi = require("ffi")
+local base = require("resty.core.base")
+
+local C = ffi.C
+local ffi_new = ffi.new
+local ffi_str = ffi.string
+local type = type
+local error = error
+local setmetatable = setmetatable
+local get_string_buf = base.get_string_buf
+local get_size_ptr = base.get_size_ptr
+
+
+ffi.cdef[[
+int ngx_http_lua_ffi_shrbtree_get(void *zone, int key_type,
+    const unsigned char *key, size_t key_len, double num_key,
+    int *value_type, unsigned char **str_value_buf, size_t *str_value_len,
+    double *num_value, char **errmsg);
+int ngx_http_lua_ffi_shrbtree_store(void *zone, int op, int key_type,
+    const unsigned char *key, size_t key_len, double num_key,
+    int value_type, const unsigned char *str_value, size_t str_value_len,
+    double num_value, double ttl, char **errmsg);
+int ngx_http_lua_ffi_shrbtree_delete(void *zone, int key_type,
+    const unsigned char *key, size_t key_len, double num_key,
+    char **errmsg);
+void free(void *ptr);
+]]
+
+
+local NGX_OK = 0
+local NGX_DECLINED = -5
+
+-- of lua.h
+local LUA_TBOOLEAN = 1
+local LUA_TNUMBER = 3
+local LUA_TSTRING = 4
+
+local INSERT = 0
+local SET = 1
+local REPLACE = 2
+
+local STR_BUF_SIZE = 4096
+
+local value_type = ffi_new("int[1]")
+local str_value_buf = ffi_new("unsigned char *[1]")
+local num_value = ffi_new("double[1]")
+local errmsg = base.get_errmsg_ptr()
+
+
+local _M = {}
+local mt = { __index = _M }
+
+
+-- rbtree is a zone of require("shrbtree")
+function _M.new(rbtree)
+    return setmetatable({ rbtree = rbtree, zone = rbtree[1] }, mt)
+end
+
+
+local function key_args(key)
+    if type(key) == "number" then
+        return LUA_TNUMBER, nil, 0, key
+    end
+
+    if type(key) == "string" then
+        return LUA_TSTRING, key, #key, 0
+    end
+
+    error("bad key, excpected number or string", 3)
+end
+
+
+function _M.get(self, key)
+    local ktype, kstr, klen, knum = key_args(key)
+
+    local buf = get_string_buf(STR_BUF_SIZE)
+    local size = get_size_ptr()
+    str_value_buf[0] = buf
+    size[0] = STR_BUF_SIZE
+
+    local rc = C.ngx_http_lua_ffi_shrbtree_get(self.zone, ktype, kstr, klen,
+                                               knum, value_type,
+                                               str_value_buf, size,
+                                               num_value, errmsg)
+
+    local p = str_value_buf[0]
+
+    if rc == NGX_DECLINED then
+        if p ~= buf then
+            C.free(p)
+        end
+
+        return nil, "no exists"
+    end
+
+    if rc ~= NGX_OK then
+        error(ffi_str(errmsg[0]), 2)
+    end
+
+    local vtype = value_type[0]
+    local value
+
+    if vtype == LUA_TSTRING then
+        value = ffi_str(p, size[0])
+
+    elseif vtype == LUA_TNUMBER then
+        value = num_value[0]
+
+    elseif vtype == LUA_TBOOLEAN then
+        value = num_value[0] ~= 0
+    end
+
+    if p ~= buf then
+        C.free(p)
+    end
+
+    if vtype ~= LUA_TSTRING and vtype ~= LUA_TNUMBER
+       and vtype ~= LUA_TBOOLEAN
+    then
+        return self.rbtree:get{key}
+    end
+
+    return value
+end
+
+
+local function store(self, op, key, value, ttl)
+    local ktype, kstr, klen, knum = key_args(key)
+    local vtype, vstr, vlen, vnum
+
+    if type(value) == "string" then
+        vtype, vstr, vlen, vnum = LUA_TSTRING, value, #value, 0
+
+    elseif type(value) == "number" then
+        vtype, vstr, vlen, vnum = LUA_TNUMBER, nil, 0, value
+
+    elseif type(value) == "boolean" then
+        vtype, vstr, vlen, vnum = LUA_TBOOLEAN, nil, 0, value and 1 or 0
+
+    else
+        local rbtree = self.rbtree
+        local args = { key, value, ttl = ttl }
+
+        if op == INSERT then
+            return rbtree:insert(args)
+        end
+
+        if op == SET then
+            return rbtree:set(args)
+        end
+
+        return rbtree:replace(args)
+    end
+
+    local rc = C.ngx_http_lua_ffi_shrbtree_store(self.zone, op, ktype, kstr,
+                                                 klen, knum, vtype, vstr,
+                                                 vlen, vnum, ttl or 0,
+                                                 errmsg)
+
+    if rc == NGX_OK then
+        return true
+    end
+
+    if rc == NGX_DECLINED then
+        return false, ffi_str(errmsg[0])
+    end
+
+    error(ffi_str(errmsg[0]), 3)
+end
+
+
+function _M.insert(self, key, value, ttl)
+    return store(self, INSERT, key, value, ttl)
+end
+
+
+function _M.set(self, key, value, ttl)
+    return store(self, SET, key, value, ttl)
+end
+
+
+function _M.replace(self, key, value, ttl)
+    return store(self, REPLACE, key, value, ttl)
+end
+
+
+function _M.delete(self, key)
+    local ktype, kstr, klen, knum = key_args(key)
+
+    local rc = C.ngx_http_lua_ffi_shrbtree_delete(self.zone, ktype, kstr,
+                                                  klen, knum, errmsg)
+
+    if rc == NGX_OK then
+        return true
+    end
+
+    if rc == NGX_DECLINED then
+        return false, ffi_str(errmsg[0])
+    end
+
+    error(ffi_str(errmsg[0]), 2)
+end
+
+
+return _M
@@ -7,15 +7,21 @@
 #include "ngx_http_lua_shrbtree_common.h"
 #include "ngx_http_lua_shrbtree_lapi.h"
 
+#include <math.h>
+
 
 typedef struct ngx_http_lua_shrbtree_ltable_s ngx_http_lua_shrbtree_ltable_t;
 typedef struct ngx_http_lua_shrbtree_node_s ngx_http_lua_shrbtree_node_t;
 typedef ngx_http_lua_shrbtree_node_t ngx_http_lua_shrbtree_lfield_t;
 
+/*
+ * the fields are nodes of rbtree by the hash of the key; the sentinel is
+ * the field_sentinel of the shard, as the ltable is built on the C stack
+ * and copied to the zone
+ */
 struct ngx_http_lua_shrbtree_ltable_s {
     ngx_rbtree_t rbtree;
-    ngx_rbtree_node_t sentinel;
-    ngx_http_lua_shrbtree_ltable_t *metatable;
+    ngx_uint_t nfields;
 };
 
 typedef union {
@@ -24,42 +30,574 @@ typedef union {
     char *s;
 } ngx_http_lua_shrbtree_lvalue_t;
 
-struct ngx_http_lua_shrbtree_node_s {
+/*
+ * a table being built by toltable: the lua table is at index, and its
+ * field in hand is converted to key and value, where a nested table is
+ * built by the next frame
+ */
+typedef struct {
+    ngx_http_lua_shrbtree_ltable_t *ltable;
+    int index;
+    ngx_uint_t state;
+    ngx_http_lua_shrbtree_lvalue_t key;
+    ngx_http_lua_shrbtree_lvalue_t value;
+    u_char *kdata;
+    u_char *vdata;
     size_t klen;
     size_t vlen;
     u_char ktype;
     u_char vtype;
-    u_char data; /* lua_Integer/lua_Number/string/ltable */
+} ngx_http_lua_shrbtree_lframe_t;
+
+#define NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT   0
+#define NGX_HTTP_LUA_SHRBTREE_LFRAME_KEY    1
+#define NGX_HTTP_LUA_SHRBTREE_LFRAME_VALUE  2
+#define NGX_HTTP_LUA_SHRBTREE_LFRAME_FIELD  3
+
+/*
+ * the header of a key and value, or a table field, is 10 bytes: a string
+ * is under 4G, and a boolean is 1 byte.  A key is stored whole: lockless
+ * readers compare it as they descend, and rotations change its neighbours,
+ * so it isn't coded against them.
+ */
+struct ngx_http_lua_shrbtree_node_s {
+    uint32_t klen;
+    uint32_t vlen;
+    u_char ktype;
+    u_char vtype;
+    u_char data; /* boolean/lua_Number/string/ltable */
 };
 
+/*
+ * a packed table is one blob: the header, the directory sorted by the hash
+ * of the field keys, then the fields laid out as lfields, where a nested
+ * table is packed in place
+ */
+typedef struct {
+    uint32_t nfields;
+    uint32_t size;
+} ngx_http_lua_shrbtree_packed_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t offset; /* of the lfield from the blob */
+} ngx_http_lua_shrbtree_pentry_t;
+
+#define NGX_HTTP_LUA_SHRBTREE_TPACKED    0x10
+
+#define NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE 16
+
+typedef struct {
+    ngx_uint_t  type;
+    int         index; /* stack index of the lua compare function */
+    int         probe; /* stack index of the key */
+    u_char     *kdata;
+    size_t      klen;
+    ngx_uint_t  nkey;
+    lua_Number  key[NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE];
+    ngx_int_t   rc;
+    ngx_uint_t  compares; /* since the last stat_read */
+} ngx_http_lua_shrbtree_cmp_t;
+
+/*
+ * with evict=clock, a node is allocated after its clock entry, then its
+ * subtree size with rank=on, and its timer if it has a ttl
+ */
+typedef struct {
+    ngx_queue_t                    queue;
+    ngx_rbtree_node_t             *node;
+    ngx_uint_t                     referenced; /* set by lockless lookups */
+} ngx_http_lua_shrbtree_clock_t;
+
+/*
+ * with index=, a node is allocated with an entry for each index after its
+ * data; an entry is linked if the value has the field as a number, string
+ * or boolean
+ */
+typedef struct {
+    ngx_rbtree_node_t               node;
+    ngx_rbtree_node_t              *primary;
+    ngx_http_lua_shrbtree_lfield_t *field; /* NULL if not linked */
+} ngx_http_lua_shrbtree_ientry_t;
+
+/* a string in the zone, which is not freed until the view is released */
+typedef struct {
+    ngx_http_lua_shrbtree_shctx_t *sh; /* NULL if released */
+    ngx_uint_t                     slot;
+    u_char                        *data;
+    size_t                         len;
+} ngx_http_lua_shrbtree_view_t;
+
+/* a key or value to store; a table is converted under the lock */
+typedef struct {
+    u_char                       *data;
+    size_t                        len;
+    u_char                        type;
+    int                           index; /* stack index of a table, or 0 */
+} ngx_http_lua_shrbtree_item_t;
+
+typedef struct {
+    ngx_http_lua_shrbtree_cmp_t   cmp;
+    u_char                       *fdata; /* field, NULL if get the value */
+    size_t                        flen;
+    int                           fields; /* stack index of the fields */
+    ngx_uint_t                    nfields;
+    ngx_http_lua_shrbtree_view_t *view;
+    int                           vindex; /* stack index of the view */
+    ngx_rbtree_t                 *tree;   /* of a snapshot, or NULL */
+    unsigned                      ttl:1;  /* the node found has a ttl */
+} ngx_http_lua_shrbtree_get_t;
+
+/*
+ * a snapshot reads the tree of the root it saw of each shard, which is intact
+ * as long as the shard wasn't written since, or only replaced by bulk_load:
+ * a held snapshot keeps the trees replaced from drain.  A get of it is a
+ * reader only while it reads, so the nodes unlinked in place are freed.
+ */
+typedef struct {
+    ngx_http_lua_shrbtree_shctx_t *sh;
+    ngx_rbtree_node_t             *root;
+    ngx_atomic_uint_t              seq;
+} ngx_http_lua_shrbtree_version_t;
+
+typedef struct {
+    ngx_queue_t                      queue; /* of the worker's snapshots */
+    ngx_msec_t                       taken;
+    ngx_uint_t                       n; /* of the shards, 0 if released */
+    unsigned                         expired:1;
+    ngx_http_lua_shrbtree_version_t  shards[1];
+} ngx_http_lua_shrbtree_versions_t;
+
+/*
+ * the l1 cache of a shard in the registry of the worker, by the shard: the
+ * entries are the decoded values with the seq of the shard when read, which
+ * are stale once it changes.  The current and former halves are swapped
+ * when the current one is full, and a hit in the former is copied back.
+ */
+#define NGX_HTTP_LUA_SHRBTREE_L1_SEQS       1
+#define NGX_HTTP_LUA_SHRBTREE_L1_VALUES     2
+#define NGX_HTTP_LUA_SHRBTREE_L1_OLD_SEQS   3
+#define NGX_HTTP_LUA_SHRBTREE_L1_OLD_VALUES 4
+#define NGX_HTTP_LUA_SHRBTREE_L1_COUNT      5
+
+typedef struct {
+    ngx_http_lua_shrbtree_cmp_t lo;
+    ngx_http_lua_shrbtree_cmp_t hi;
+    ngx_uint_t                  op;     /* how lo is bound */
+    ngx_uint_t                  limit;  /* 0 if no limit */
+    unsigned                    first:1; /* from the first node, no lo */
+    unsigned                    last:1;  /* to the last node, no hi */
+
+    int                         keys;    /* stack index of the keys */
+    int                         values;  /* stack index of the values */
+    ngx_uint_t                  n;       /* in the arrays */
+    ngx_uint_t                  count;   /* after the last read */
+    ngx_uint_t                  max;     /* set by any read */
+} ngx_http_lua_shrbtree_range_t;
+
+typedef struct {
+    ngx_http_lua_shrbtree_cmp_t cmp;
+    ngx_uint_t                  op;
+    unsigned                    edge:1; /* first or last node of a shard */
+} ngx_http_lua_shrbtree_bound_t;
+
+typedef struct {
+    ngx_http_lua_shrbtree_cmp_t cmp;
+    ngx_uint_t                  op;     /* LT or LE, the keys counted */
+    ngx_uint_t                  k;      /* of select, from 1 */
+    unsigned                    all:1;  /* all the keys of the shard */
+    ngx_uint_t                  n;      /* set by the handler */
+} ngx_http_lua_shrbtree_rank_t;
+
+typedef struct {
+    ngx_http_lua_shrbtree_cmp_t  *cmps;
+    ngx_http_lua_shrbtree_cmp_t  **order; /* probes in the key order */
+    ngx_uint_t                   *shards; /* of the probes */
+    ngx_uint_t                   n;
+    ngx_uint_t                   shard;   /* being read */
+    int                          values;  /* stack index of the values */
+} ngx_http_lua_shrbtree_mget_t;
+
+/*
+ * a snapshot file is the header, then per shard the section header and the
+ * nodes in the key order as records: the ttl left, an lfield header and
+ * data, aligned to 8 bytes.  Tables are packed, so the records have no
+ * pointers.
+ */
+typedef struct {
+    u_char    magic[8];
+    uint32_t  version;
+    uint32_t  word;    /* sizeof(size_t), the records are native */
+    uint32_t  nshards;
+    uint32_t  reserved;
+} ngx_http_lua_shrbtree_snapshot_t;
+
+typedef struct {
+    uint64_t  count;
+    uint64_t  size;    /* of the records */
+} ngx_http_lua_shrbtree_section_t;
+
+typedef struct {
+    uint64_t                      ttl;  /* msec, 0 if the node never expires */
+    ngx_http_lua_shrbtree_node_t  node;
+} ngx_http_lua_shrbtree_record_t;
 
+/*
+ * engine=btree: a static B+tree of the keys of a tree as it's loaded or
+ * swept, for the lookups of number and interval zones.  The leaves are the
+ * sorted keys (the lows of the intervals) in blocks of a cache line; a block
+ * of an upper layer has the least keys of all but the first of its B + 1
+ * children.  The nodes are in the order of the leaves.  It's allocated as a
+ * node with no key, so that it's retired and freed like one, once the tree
+ * is changed.
+ */
+#define NGX_HTTP_LUA_SHRBTREE_BTREE_B       8
+#define NGX_HTTP_LUA_SHRBTREE_BTREE_HEIGHT  24
+
+typedef struct {
+    ngx_uint_t           n;
+    ngx_uint_t           height;
+    lua_Number          *layer[NGX_HTTP_LUA_SHRBTREE_BTREE_HEIGHT];
+    ngx_uint_t           nblocks[NGX_HTTP_LUA_SHRBTREE_BTREE_HEIGHT];
+    ngx_rbtree_node_t  **nodes;
+} ngx_http_lua_shrbtree_btree_t;
+
+#define NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_MAGIC    "SHRBTREE"
+#define NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_VERSION  3
+
+typedef int (*ngx_http_lua_shrbtree_read_pt)(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+
+/* a read handler run by ngx_http_lua_shrbtree_pcall() */
+typedef struct {
+    ngx_http_lua_shrbtree_read_pt   handler;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    void                           *data;
+} ngx_http_lua_shrbtree_call_t;
+
+
+static ngx_slab_pool_t *ngx_http_lua_shrbtree_init_pool(
+    ngx_shm_zone_t *shm_zone, ngx_slab_pool_t *shpool, size_t size,
+    ngx_uint_t n);
+static ngx_uint_t ngx_http_lua_shrbtree_same_indexes(
+    ngx_http_lua_shrbtree_ctx_t *octx, ngx_http_lua_shrbtree_ctx_t *ctx);
+static ngx_uint_t ngx_http_lua_shrbtree_same_split(
+    ngx_http_lua_shrbtree_ctx_t *octx, ngx_http_lua_shrbtree_ctx_t *ctx);
+static ngx_uint_t ngx_http_lua_shrbtree_layout(
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static char *ngx_http_lua_shrbtree_changed(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_shctx_t *sh);
+static ngx_int_t ngx_http_lua_shrbtree_load(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_shrbtree_load_section(
+    ngx_http_lua_shrbtree_ctx_t *ctx, u_char *p, uint64_t count,
+    uint64_t size);
 static int ngx_http_lua_shrbtree_insert(lua_State *L);
+static int ngx_http_lua_shrbtree_set(lua_State *L);
+static int ngx_http_lua_shrbtree_replace(lua_State *L);
+static int ngx_http_lua_shrbtree_store(lua_State *L, ngx_uint_t op);
+static void ngx_http_lua_shrbtree_luaL_toitem(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int index,
+    ngx_http_lua_shrbtree_item_t *item);
+static ngx_int_t ngx_http_lua_shrbtree_store_item(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_uint_t op, ngx_http_lua_shrbtree_item_t *key,
+    ngx_http_lua_shrbtree_item_t *value, ngx_msec_t expires, char **err);
+static ngx_int_t ngx_http_lua_shrbtree_put(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_rbtree_node_t **found, ngx_rbtree_node_t *parent,
+    ngx_rbtree_node_t **position, ngx_http_lua_shrbtree_item_t *key,
+    ngx_http_lua_shrbtree_item_t *value, ngx_msec_t expires);
+static int ngx_http_lua_shrbtree_incr(lua_State *L);
 static int ngx_http_lua_shrbtree_get(lua_State *L);
+static ngx_http_lua_shrbtree_ctx_t *ngx_http_lua_shrbtree_luaL_checkget(
+    lua_State *L, ngx_http_lua_shrbtree_get_t *get, u_char *key);
+static int ngx_http_lua_shrbtree_l1_get(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_get_t *get);
+static void ngx_http_lua_shrbtree_l1_set(lua_State *L, ngx_uint_t max,
+    int cache, int key, int value, ngx_atomic_uint_t seq);
+static int ngx_http_lua_shrbtree_view(lua_State *L);
+static int ngx_http_lua_shrbtree_snapshot(lua_State *L);
+static int ngx_http_lua_shrbtree_snapshot_get(lua_State *L);
+static int ngx_http_lua_shrbtree_snapshot_release(lua_State *L);
+static void ngx_http_lua_shrbtree_release_versions(
+    ngx_http_lua_shrbtree_versions_t *versions);
+static void ngx_http_lua_shrbtree_expire_snapshots(void);
+static ngx_uint_t ngx_http_lua_shrbtree_intact(
+    ngx_http_lua_shrbtree_version_t *version);
+static void ngx_http_lua_shrbtree_freeze(ngx_http_lua_shrbtree_shctx_t *sh);
+static int ngx_http_lua_shrbtree_view_ptr(lua_State *L);
+static int ngx_http_lua_shrbtree_view_len(lua_State *L);
+static int ngx_http_lua_shrbtree_view_tostring(lua_State *L);
+static int ngx_http_lua_shrbtree_view_release(lua_State *L);
 static int ngx_http_lua_shrbtree_delete(lua_State *L);
+static ngx_int_t ngx_http_lua_shrbtree_delete_key(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp);
+static int ngx_http_lua_shrbtree_bulk_load(lua_State *L);
+static int ngx_http_lua_shrbtree_luaL_flatten(lua_State *L, int index,
+    ngx_uint_t *n);
+static int ngx_http_lua_shrbtree_apply_delta(lua_State *L);
+static ngx_int_t ngx_http_lua_shrbtree_apply_shard(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    int kv, ngx_uint_t *shards, ngx_uint_t shard, ngx_uint_t n, char **err);
+static char *ngx_http_lua_shrbtree_bulk_alloc(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int kv, ngx_rbtree_node_t **nodes,
+    ngx_uint_t *shards, ngx_uint_t shard, ngx_uint_t n);
+static void ngx_http_lua_shrbtree_bulk_free(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_uint_t *shards, ngx_uint_t shard,
+    ngx_uint_t n);
+static char *ngx_http_lua_shrbtree_bulk_swap(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_rbtree_node_t **scratch,
+    ngx_uint_t *shards, ngx_uint_t n, ngx_uint_t swap);
+static void ngx_http_lua_shrbtree_bulk_build(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_uint_t m);
+static int ngx_http_lua_shrbtree_begin_reload(lua_State *L);
+static int ngx_http_lua_shrbtree_stage(lua_State *L);
+static ngx_int_t ngx_http_lua_shrbtree_stage_item(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_http_lua_shrbtree_item_t *key, ngx_http_lua_shrbtree_item_t *value,
+    ngx_msec_t expires, char **err);
+static void ngx_http_lua_shrbtree_stage_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static int ngx_http_lua_shrbtree_commit(lua_State *L);
+static ngx_uint_t ngx_http_lua_shrbtree_commit_shard(
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static int ngx_http_lua_shrbtree_abort_reload(lua_State *L);
+static void ngx_http_lua_shrbtree_drain_tree(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *root);
+static ngx_int_t ngx_http_lua_shrbtree_drain(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_uint_t n);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_drain_first(
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static int ngx_http_lua_shrbtree_save(lua_State *L);
+static int ngx_http_lua_shrbtree_stats(lua_State *L);
+static void ngx_http_lua_shrbtree_pushstats(lua_State *L,
+    ngx_http_lua_shrbtree_stats_t *st);
+static ngx_int_t ngx_http_lua_shrbtree_save_section(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_fd_t fd, off_t *offset,
+    ngx_http_lua_shrbtree_section_t *section);
+static u_char *ngx_http_lua_shrbtree_save_batch(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_rbtree_node_t **node,
+    ngx_uint_t batch, u_char *buf, size_t *size, uint64_t *count);
+static ngx_int_t ngx_http_lua_shrbtree_write(ngx_fd_t fd, void *buf,
+    size_t size, off_t offset);
+static size_t ngx_http_lua_shrbtree_record_size(
+    ngx_http_lua_shrbtree_node_t *srbtn);
+static u_char *ngx_http_lua_shrbtree_record(u_char *p,
+    ngx_rbtree_node_t *node);
+static size_t ngx_http_lua_shrbtree_flat_size(u_char *data, u_char type,
+    size_t len);
+static size_t ngx_http_lua_shrbtree_flat_fields(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel, uint32_t *nfields);
+static ngx_int_t ngx_http_lua_shrbtree_check_flat(u_char *data, u_char type,
+    uint32_t len, ngx_uint_t depth);
+static u_char *ngx_http_lua_shrbtree_flatten(u_char *p, u_char *data,
+    u_char *type, uint32_t *len);
+static u_char *ngx_http_lua_shrbtree_flatten_fields(u_char *blob, u_char *p,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel,
+    ngx_http_lua_shrbtree_pentry_t *dir, uint32_t *i);
+static int ngx_http_lua_shrbtree_mget(lua_State *L);
+static int ngx_http_lua_shrbtree_get_by(lua_State *L);
+static int ngx_http_lua_shrbtree_range(lua_State *L);
+static int ngx_http_lua_shrbtree_floor(lua_State *L);
+static int ngx_http_lua_shrbtree_ceil(lua_State *L);
+static int ngx_http_lua_shrbtree_lower_bound(lua_State *L);
+static int ngx_http_lua_shrbtree_upper_bound(lua_State *L);
+static int ngx_http_lua_shrbtree_bound(lua_State *L, ngx_uint_t op);
+static int ngx_http_lua_shrbtree_iter(lua_State *L);
+static int ngx_http_lua_shrbtree_rank(lua_State *L);
+static int ngx_http_lua_shrbtree_select(lua_State *L);
+static int ngx_http_lua_shrbtree_count(lua_State *L);
+static ngx_uint_t ngx_http_lua_shrbtree_count_before(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_rank_t *rank);
+static void ngx_http_lua_shrbtree_luaL_checkrank(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static int ngx_http_lua_shrbtree_cursor_next(lua_State *L);
+
+static int ngx_http_lua_shrbtree_get_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static int ngx_http_lua_shrbtree_view_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static ngx_http_lua_shrbtree_lfield_t *ngx_http_lua_shrbtree_get_field(
+    ngx_http_lua_shrbtree_node_t *srbtn, u_char *fdata, size_t flen,
+    char **err);
+static int ngx_http_lua_shrbtree_mget_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static int ngx_http_lua_shrbtree_read_range(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_range_t *range);
+static int ngx_http_lua_shrbtree_range_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static int ngx_http_lua_shrbtree_bound_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static int ngx_http_lua_shrbtree_rank_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+static int ngx_http_lua_shrbtree_select_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data);
+
+static int ngx_http_lua_shrbtree_read(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_read_pt handler,
+    void *data);
+static int ngx_http_lua_shrbtree_pcall(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_read_pt handler,
+    void *data);
+static int ngx_http_lua_shrbtree_call(lua_State *L);
+static ngx_uint_t ngx_http_lua_shrbtree_read_begin(
+    ngx_http_lua_shrbtree_shctx_t *sh, ngx_atomic_uint_t *seq);
+static ngx_int_t ngx_http_lua_shrbtree_read_end(
+    ngx_http_lua_shrbtree_shctx_t *sh, ngx_uint_t slot,
+    ngx_atomic_uint_t seq);
+static ngx_int_t ngx_http_lua_shrbtree_pin(ngx_http_lua_shrbtree_shctx_t *sh);
+static void ngx_http_lua_shrbtree_unpin(ngx_http_lua_shrbtree_shctx_t *sh,
+    ngx_uint_t slot);
+static ngx_int_t ngx_http_lua_shrbtree_hold(ngx_http_lua_shrbtree_shctx_t *sh);
+static void ngx_http_lua_shrbtree_unhold(ngx_http_lua_shrbtree_shctx_t *sh);
+static void ngx_http_lua_shrbtree_lock(ngx_http_lua_shrbtree_ctx_t *ctx);
+static void ngx_http_lua_shrbtree_unlock(ngx_http_lua_shrbtree_ctx_t *ctx);
+static uint64_t ngx_http_lua_shrbtree_usec(void);
+static ngx_uint_t ngx_http_lua_shrbtree_hist(uint64_t usec);
+static void ngx_http_lua_shrbtree_stat_read(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_write_begin(
+    ngx_http_lua_shrbtree_shctx_t *sh);
+static void ngx_http_lua_shrbtree_write_end(ngx_http_lua_shrbtree_shctx_t *sh);
+static void ngx_http_lua_shrbtree_retire(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_btree_build(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_rbtree_node_t **nodes, ngx_uint_t n);
+static void ngx_http_lua_shrbtree_btree_drop(ngx_http_lua_shrbtree_ctx_t *ctx);
+static void ngx_http_lua_shrbtree_btree_rebuild(
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static ngx_http_lua_shrbtree_btree_t *ngx_http_lua_shrbtree_btree(
+    ngx_rbtree_node_t *holder);
+static ngx_int_t ngx_http_lua_shrbtree_btree_floor(
+    ngx_http_lua_shrbtree_btree_t *bt, lua_Number x);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_find(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp);
+static void ngx_http_lua_shrbtree_reclaim(ngx_http_lua_shrbtree_ctx_t *ctx);
+static void ngx_http_lua_shrbtree_unlink(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_detach(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_swap(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *old, ngx_rbtree_node_t *node);
+static ngx_int_t ngx_http_lua_shrbtree_update(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_rbtree_node_t *node,
+    ngx_http_lua_shrbtree_item_t *value, ngx_msec_t expires);
+static ngx_int_t ngx_http_lua_shrbtree_expire(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_uint_t n);
+static ngx_uint_t ngx_http_lua_shrbtree_expired(ngx_rbtree_node_t *node);
+static ngx_msec_t ngx_http_lua_shrbtree_expires(ngx_msec_t ttl);
+static void ngx_http_lua_shrbtree_sweep(ngx_event_t *ev);
+static ngx_uint_t ngx_http_lua_shrbtree_idle(ngx_http_lua_shrbtree_ctx_t *ctx);
+static void ngx_http_lua_shrbtree_free_nodes(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static void *ngx_http_lua_shrbtree_alloc(ngx_http_lua_shrbtree_ctx_t *ctx,
+    size_t size);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_alloc_node(
+    ngx_http_lua_shrbtree_ctx_t *ctx, size_t size, ngx_msec_t expires,
+    ngx_uint_t evict);
+static u_char *ngx_http_lua_shrbtree_node_head(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_http_lua_shrbtree_ientry_t *ngx_http_lua_shrbtree_ientries(
+    ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_index_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_t *indexes, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_index_unlink(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_index_init(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_t *indexes);
+static ngx_int_t ngx_http_lua_shrbtree_index_cmp(u_char type, u_char *data,
+    size_t len, ngx_http_lua_shrbtree_lfield_t *field);
+static void ngx_http_lua_shrbtree_index_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_lua_shrbtree_evict(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_uint_t n);
+static void ngx_http_lua_shrbtree_touch(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_uint_t *ngx_http_lua_shrbtree_node_size(ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_http_lua_shrbtree_size(ngx_rbtree_t *rbtree,
+    ngx_rbtree_node_t *node);
+static void ngx_http_lua_shrbtree_resize(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node);
+static ngx_uint_t ngx_http_lua_shrbtree_size_tree(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static void ngx_http_lua_shrbtree_retire_tree(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *root, ngx_rbtree_node_t *sentinel);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_build(
+    ngx_rbtree_node_t **nodes, ngx_uint_t n, ngx_rbtree_node_t *sentinel,
+    ngx_uint_t depth, ngx_uint_t red);
 
 static void ngx_http_lua_shrbtree_pushlvalue(lua_State *L, u_char *data,
     u_char type, size_t len);
 static void ngx_http_lua_shrbtree_pushltable(lua_State *L,
     ngx_http_lua_shrbtree_ltable_t *ltable);
-static void ngx_http_lua_shrbtree_pushlfield(lua_State *L,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
-static ngx_int_t ngx_http_lua_shrbtree_tolvalue(lua_State *L, int index,
-    u_char **data, u_char *type, size_t *len);
-static ngx_int_t ngx_http_lua_shrbtree_toltable(lua_State *L, int index,
+static ngx_int_t ngx_http_lua_shrbtree_tolvalue(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int index, u_char **data, u_char *type,
+    size_t *len, ngx_uint_t evict);
+static void ngx_http_lua_shrbtree_pushpacked(lua_State *L, u_char *blob);
+static int ngx_http_lua_shrbtree_luaL_pack(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int index);
+static size_t ngx_http_lua_shrbtree_packed_size(lua_State *L, int index);
+static u_char *ngx_http_lua_shrbtree_pack_ltable(lua_State *L, int index,
+    u_char *blob);
+static u_char *ngx_http_lua_shrbtree_pack_lvalue(lua_State *L, int index,
+    u_char *p, u_char *type, uint32_t *len);
+static ngx_int_t ngx_http_lua_shrbtree_cmp_pentries(const void *one,
+    const void *two);
+static ngx_int_t ngx_http_lua_shrbtree_toltable(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int index,
+    ngx_http_lua_shrbtree_ltable_t *ltable, ngx_uint_t evict);
+static void ngx_http_lua_shrbtree_init_ltable(ngx_http_lua_shrbtree_ctx_t *ctx,
     ngx_http_lua_shrbtree_ltable_t *ltable);
+static void ngx_http_lua_shrbtree_free_ltable(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_ltable_t *ltable);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_alloc_lfield(
+    ngx_http_lua_shrbtree_ctx_t *ctx, size_t size, ngx_uint_t evict);
 
 static ngx_rbtree_node_t *ngx_http_lua_shrbtree_get_node(lua_State *L,
-    ngx_rbtree_t *rbtree);
+    ngx_rbtree_t *rbtree, ngx_http_lua_shrbtree_cmp_t *cmp);
 static ngx_rbtree_node_t *ngx_http_lua_shrbtree_get_rawnode(lua_State *L,
-    ngx_rbtree_t *rbtree, ngx_rbtree_node_t **parent,
+    ngx_rbtree_t *rbtree, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_rbtree_node_t **parent, ngx_rbtree_node_t ***position);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_get_finger(lua_State *L,
+    ngx_rbtree_t *rbtree, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_rbtree_node_t *finger, ngx_rbtree_node_t **parent,
+    ngx_rbtree_node_t ***position);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_descend(lua_State *L,
+    ngx_rbtree_t *rbtree, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_rbtree_node_t **p, ngx_rbtree_node_t **parent,
     ngx_rbtree_node_t ***position);
 
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_get_bound(lua_State *L,
+    ngx_rbtree_t *rbtree, ngx_http_lua_shrbtree_cmp_t *cmp, ngx_uint_t op);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_first(ngx_rbtree_t *rbtree);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_last(ngx_rbtree_t *rbtree);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_prev(ngx_rbtree_t *rbtree,
+    ngx_rbtree_node_t *node);
+static ngx_rbtree_node_t *ngx_http_lua_shrbtree_next(ngx_rbtree_t *rbtree,
+    ngx_rbtree_node_t *node);
+
+static ngx_int_t ngx_http_lua_shrbtree_compare(lua_State *L,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t *node);
+static ngx_int_t ngx_http_lua_shrbtree_cmp_probes(const void *one,
+    const void *two);
+static ngx_int_t ngx_http_lua_shrbtree_cmp_node(
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_http_lua_shrbtree_node_t *srbtn);
+static ngx_uint_t ngx_http_lua_shrbtree_tuple(
+    ngx_http_lua_shrbtree_node_t *srbtn, lua_Number *key, ngx_uint_t n);
+
 static ngx_http_lua_shrbtree_lfield_t *ngx_http_lua_shrbtree_get_lfield(
-    ngx_http_lua_shrbtree_ltable_t *ltable, void *kdata, size_t klen);
+    u_char type, u_char *data, void *kdata, size_t klen);
+static ngx_http_lua_shrbtree_lfield_t *ngx_http_lua_shrbtree_get_pfield(
+    u_char *blob, void *kdata, size_t klen);
 
 static void ngx_http_lua_shrbtree_rdestroy_lfield(ngx_slab_pool_t *shpool,
     ngx_rbtree_node_t *root, ngx_rbtree_node_t *sentinel);
+static void ngx_http_lua_shrbtree_destroy_lvalue(
+    ngx_http_lua_shrbtree_ctx_t *ctx, u_char *data, u_char type);
 static void ngx_http_lua_shrbtree_destroy_ltable(ngx_slab_pool_t *shpool,
     ngx_http_lua_shrbtree_ltable_t *ltable);
 
@@ -67,26 +605,142 @@ static int ngx_http_lua_shrbtree_luaL_checknarg(lua_State *L, int narg);
 static ngx_shm_zone_t *ngx_http_lua_shrbtree_luaL_checkzone(lua_State *L,
     int arg);
 static ngx_cycle_t *ngx_http_lua_shrbtree_luaL_checkcycle(lua_State *L);
+static int ngx_http_lua_shrbtree_luaL_checkcmp(lua_State *L, int arg, int n,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp);
+static void ngx_http_lua_shrbtree_luaL_checkkey(lua_State *L, int index,
+    ngx_http_lua_shrbtree_cmp_t *cmp);
+static ngx_uint_t ngx_http_lua_shrbtree_cmp_tag(lua_State *L, int index);
+static ngx_http_lua_shrbtree_ctx_t *ngx_http_lua_shrbtree_luaL_route(
+    lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp);
+static void ngx_http_lua_shrbtree_luaL_checkordered(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx);
+static ngx_uint_t ngx_http_lua_shrbtree_shard(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp);
+static ngx_uint_t ngx_http_lua_shrbtree_crosses(
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp);
+static void ngx_http_lua_shrbtree_luaL_checklvalue(lua_State *L, int index,
+    ngx_uint_t depth);
 
 static void ngx_http_lua_shrbtree_insert_value(ngx_rbtree_node_t *node1,
     ngx_rbtree_node_t *node2, ngx_rbtree_node_t *sentinel);
 
 #define NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE sizeof(ngx_http_lua_shrbtree_lvalue_t)
 
+#define NGX_HTTP_LUA_SHRBTREE_READ_TRIES  4
+#define NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH   128
+#define NGX_HTTP_LUA_SHRBTREE_MAX_NESTING 32
+
+/* of the layout of a zone, see ngx_http_lua_shrbtree_layout */
+#define NGX_HTTP_LUA_SHRBTREE_LAYOUT_EVICT   0x01
+#define NGX_HTTP_LUA_SHRBTREE_LAYOUT_PACKED  0x02
+#define NGX_HTTP_LUA_SHRBTREE_LAYOUT_BTREE   0x04
+#define NGX_HTTP_LUA_SHRBTREE_LAYOUT_RANK    0x08
+
+/* of the views and snapshots held at once on a shard */
+#define NGX_HTTP_LUA_SHRBTREE_MAX_PINNED  1024
+
+/* msec a snapshot is held before it's released */
+#define NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_HOLD  5000
+
+/* seconds, so that the msec of a ttl is a timer difference */
+#define NGX_HTTP_LUA_SHRBTREE_MAX_TTL     (NGX_MAX_INT_T_VALUE / 1000)
+
+#define NGX_HTTP_LUA_SHRBTREE_GE          0
+#define NGX_HTTP_LUA_SHRBTREE_GT          1
+#define NGX_HTTP_LUA_SHRBTREE_LE          2
+#define NGX_HTTP_LUA_SHRBTREE_LT          3
+
+#define NGX_HTTP_LUA_SHRBTREE_ITER_COUNT  100
+
+#define NGX_HTTP_LUA_SHRBTREE_INSERT      0
+#define NGX_HTTP_LUA_SHRBTREE_SET         1
+#define NGX_HTTP_LUA_SHRBTREE_REPLACE     2
+
+#define NGX_HTTP_LUA_SHRBTREE_SWEEP_INTERVAL  1000
+#define NGX_HTTP_LUA_SHRBTREE_SWEEP_BATCH     100
+#define NGX_HTTP_LUA_SHRBTREE_DRAIN_BATCH     1000
+#define NGX_HTTP_LUA_SHRBTREE_DELTA_BATCH     100
+#define NGX_HTTP_LUA_SHRBTREE_SAVE_BATCH      1000
+#define NGX_HTTP_LUA_SHRBTREE_SAVE_TRIES      4
+
+#define NGX_HTTP_LUA_SHRBTREE_EVICT_TRIES     8
+#define NGX_HTTP_LUA_SHRBTREE_EVICT_BATCH     16
+#define NGX_HTTP_LUA_SHRBTREE_EVICT_SCAN      1024
+
+
+/* addresses of these are pushed as lightuserdata to name builtin compares */
+static u_char ngx_http_lua_shrbtree_cmp_tags[NGX_HTTP_LUA_SHRBTREE_CMP_MAX];
+
+static ngx_event_t ngx_http_lua_shrbtree_sweep_event;
+
+/* the snapshots taken by the worker, oldest first */
+static ngx_queue_t ngx_http_lua_shrbtree_snapshots = {
+    &ngx_http_lua_shrbtree_snapshots, &ngx_http_lua_shrbtree_snapshots
+};
+
+static char *ngx_http_lua_shrbtree_cmp_names[] = {
+    NULL,
+    "CMP_NUMBER",
+    "CMP_STRING",
+    "CMP_TUPLE",
+    "CMP_INTERVAL"
+};
+
 
 ngx_int_t
 ngx_http_lua_shrbtree_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_lua_shrbtree_ctx_t  *octx = data;
 
-    size_t                      len;
-    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    char                          *changed;
+    size_t                         len, size;
+    ngx_uint_t                     i;
+    ngx_slab_pool_t                *pool;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
     if (octx) {
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        if (octx->nshards != ctx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
+        if (!ngx_http_lua_shrbtree_same_indexes(octx, ctx)) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" changes its indexes",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        changed = ngx_http_lua_shrbtree_changed(ctx, octx->shards[0].sh);
+        if (changed) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" changes its \"%s\"",
+                          &shm_zone->shm.name, changed);
+            return NGX_ERROR;
+        }
+
+        if (!ngx_http_lua_shrbtree_same_split(octx, ctx)) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" changes its split keys",
+                          &shm_zone->shm.name);
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i].sh = octx->shards[i].sh;
+            ctx->shards[i].shpool = octx->shards[i].shpool;
+        }
+
+        /* of a sharded zone, as when it was made */
+        ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+        ctx->sh = ctx->shards[0].sh;
 
         return NGX_OK;
     }
@@ -96,19 +750,22 @@ ngx_http_lua_shrbtree_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     if (shm_zone->shm.exists) {
         ctx->sh = ctx->shpool->data;
 
-        return NGX_OK;
-    }
-
-    ctx->sh = ngx_slab_alloc(ctx->shpool,
-                             sizeof(ngx_http_lua_shrbtree_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
-    }
+        changed = ngx_http_lua_shrbtree_changed(ctx, ctx->sh);
+        if (changed) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" changes its \"%s\"",
+                          &shm_zone->shm.name, changed);
+            return NGX_ERROR;
+        }
 
-    ctx->shpool->data = ctx->sh;
+        for (i = 0; i < ctx->nshards; i++) {
+            pool = ctx->sh->pools ? ctx->sh->pools[i] : ctx->shpool;
+            ctx->shards[i].shpool = pool;
+            ctx->shards[i].sh = pool->data;
+        }
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_lua_shrbtree_insert_value);
+        return NGX_OK;
+    }
 
     len = sizeof(" in lua_shared_rbtree_zone \"\"") + shm_zone->shm.name.len;
 
@@ -124,441 +781,7604 @@ ngx_http_lua_shrbtree_init_zone(ngx_shm_zone_t *shm_zone, void *data)
     ctx->shpool->log_nomem = 0;
 #endif
 
-    return NGX_OK;
-}
-
-
-int
-ngx_http_lua_shrbtree_preload(lua_State *L)
-{
-    ngx_http_lua_shrbtree_main_conf_t *lsmcf;
-    ngx_cycle_t *cycle;
-
-    ngx_http_lua_shrbtree_ctx_t  *ctx;
-    ngx_uint_t                   i;
-    ngx_shm_zone_t               **zone;
+    /* the first shard is the zone's pool, the others are carved from it */
+    size = (shm_zone->shm.size / ctx->nshards) & ~(ngx_pagesize - 1);
 
-    cycle = ngx_http_lua_shrbtree_luaL_checkcycle(L);
-    lsmcf = ngx_http_lua_shrbtree_get_main_conf(cycle);
+    for (i = 0; i < ctx->nshards; i++) {
 
-    if (lsmcf->shm_zones != NULL) {
-        lua_createtable(L, 0, lsmcf->shm_zones->nelts /* nrec */);
+        if (i == 0) {
+            pool = ctx->shpool;
 
-        lua_createtable(L, 0 /* narr */, 2 /* nrec */); /* shared mt */
+        } else {
+            pool = ngx_http_lua_shrbtree_init_pool(shm_zone, ctx->shpool, size,
+                                                   i);
+            if (pool == NULL) {
+                return NGX_ERROR;
+            }
+        }
 
-        lua_pushcfunction(L, ngx_http_lua_shrbtree_insert);
-        lua_setfield(L, -2, "insert");
+        sh = ngx_slab_alloc(pool, sizeof(ngx_http_lua_shrbtree_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
 
-        lua_pushcfunction(L, ngx_http_lua_shrbtree_get);
-        lua_setfield(L, -2, "get");
+        ngx_memzero(sh, sizeof(ngx_http_lua_shrbtree_shctx_t));
+        pool->data = sh;
 
-        lua_pushcfunction(L, ngx_http_lua_shrbtree_delete);
-        lua_setfield(L, -2, "delete");
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_http_lua_shrbtree_insert_value);
+        ngx_rbtree_init(&sh->expiry, &sh->expiry_sentinel,
+                        ngx_rbtree_insert_timer_value);
+        ngx_rbtree_sentinel_init(&sh->field_sentinel);
+        ngx_queue_init(&sh->clock);
 
-        lua_pushvalue(L, -1); /* shared mt mt */
-        lua_setfield(L, -2, "__index"); /* shared mt */
+        ctx->shards[i].shpool = pool;
+        ctx->shards[i].sh = sh;
 
-        zone = lsmcf->shm_zones->elts;
+        ngx_http_lua_shrbtree_index_init(&ctx->shards[i], sh->indexes);
+    }
 
-        for (i = 0; i < lsmcf->shm_zones->nelts; i++) {
-            ctx = zone[i]->data;
+    ctx->sh = ctx->shards[0].sh;
+    ctx->sh->nshards = ctx->nshards;
+    ctx->sh->layout = ngx_http_lua_shrbtree_layout(ctx);
+    ctx->sh->cmp = ctx->cmp;
 
-            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
-            /* shared mt key */
+    if (ctx->nshards > 1) {
+        size = ctx->nshards * sizeof(ngx_slab_pool_t *);
 
-            lua_createtable(L, 1 /* narr */, 0 /* nrec */);
-            lua_pushlightuserdata(L, zone[i]); /* shared mt key ud */
-            lua_rawseti(L, -2, 1); /* {zone[i]} */
-            lua_pushvalue(L, -3); /* shared mt key ud mt */
-            lua_setmetatable(L, -2); /* shared mt key ud */
-            lua_rawset(L, -4); /* shared mt */
+        ctx->sh->pools = ngx_slab_alloc(ctx->shpool, size);
+        if (ctx->sh->pools == NULL) {
+            return NGX_ERROR;
         }
 
-        lua_pop(L, 1);
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->sh->pools[i] = ctx->shards[i].shpool;
+        }
+    }
 
-    } else {
-        lua_newtable(L);
+    if (ctx->snapshot.len) {
+        return ngx_http_lua_shrbtree_load(shm_zone, ctx);
     }
 
-    return 1;
+    return NGX_OK;
 }
 
 
-static ngx_cycle_t *
-ngx_http_lua_shrbtree_luaL_checkcycle(lua_State *L)
+/*
+ * the flags of a zone which shape its nodes: a reload which changes them
+ * would read the nodes of a reused zone with another layout
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_layout(ngx_http_lua_shrbtree_ctx_t *ctx)
 {
-    ngx_cycle_t *cycle;
+    ngx_uint_t  layout;
 
-    lua_getglobal(L, "__ngx_cycle");
-    cycle = lua_touserdata(L, -1);
-    if (cycle == NULL) {
-        luaL_error(L, "attempt to use a 'ngx.null' value "
-                   "(global '__ngx_cycle')");
+    layout = 0;
+
+    if (ctx->evict) {
+        layout |= NGX_HTTP_LUA_SHRBTREE_LAYOUT_EVICT;
     }
 
-    lua_pop(L, 1);
+    if (ctx->packed) {
+        layout |= NGX_HTTP_LUA_SHRBTREE_LAYOUT_PACKED;
+    }
 
-    return cycle;
+    if (ctx->btree) {
+        layout |= NGX_HTTP_LUA_SHRBTREE_LAYOUT_BTREE;
+    }
+
+    /* and the sizes of the subtrees aren't kept without it */
+    if (ctx->rank) {
+        layout |= NGX_HTTP_LUA_SHRBTREE_LAYOUT_RANK;
+    }
+
+    return layout;
 }
 
 
-static int
-ngx_http_lua_shrbtree_luaL_checknarg(lua_State *L, int narg)
+/*
+ * the parameter of a reused zone which its configuration changes, against
+ * the first shard as it was made, or NULL
+ */
+static char *
+ngx_http_lua_shrbtree_changed(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_shctx_t *sh)
 {
-    if (narg == lua_gettop(L)) {return 0;}
+    ngx_uint_t  changed;
 
-    lua_Debug ar;
-    if (!lua_getstack(L, 0, &ar)) { /* no stack frame? */
-        return luaL_error(L, "excpected %d %s", narg,
-                          1 == narg ? "argument" : "arguments");
+    changed = ngx_http_lua_shrbtree_layout(ctx) ^ sh->layout;
+
+    if (changed & NGX_HTTP_LUA_SHRBTREE_LAYOUT_EVICT) {
+        return "evict=";
     }
-    lua_getinfo(L, "n", &ar);
-    if (ar.name == NULL) {
-        ar.name = "?";
+
+    if (changed & NGX_HTTP_LUA_SHRBTREE_LAYOUT_PACKED) {
+        return "encoding=";
     }
-    return luaL_error(L, "excpected %d %s to '%s'",
-                      narg,
-                      1 == narg ? "argument" : "arguments",
-                      ar.name);
-}
 
+    if (changed & NGX_HTTP_LUA_SHRBTREE_LAYOUT_BTREE) {
+        return "engine=";
+    }
 
-static ngx_shm_zone_t*
-ngx_http_lua_shrbtree_luaL_checkzone(lua_State *L, int arg)
-{
-    ngx_shm_zone_t *zone;
+    if (changed & NGX_HTTP_LUA_SHRBTREE_LAYOUT_RANK) {
+        return "rank=";
+    }
 
-    lua_rawgeti(L, arg, 1);
-    zone = lua_touserdata(L, -1);
-    lua_pop(L, 1);
-    if (zone == NULL) {
-        luaL_argerror(L, arg, "excpected \"zone\"");
+    /* the nodes are ordered by it */
+    if (ctx->cmp != sh->cmp) {
+        return "cmp=";
     }
 
-    return zone;
+    return NULL;
 }
 
 
-static int
-ngx_http_lua_shrbtree_get(lua_State *L)
+/* the nodes of a reused zone are laid out for the indexes they were built */
+static ngx_uint_t
+ngx_http_lua_shrbtree_same_indexes(ngx_http_lua_shrbtree_ctx_t *octx,
+    ngx_http_lua_shrbtree_ctx_t *ctx)
 {
-    ngx_int_t                      rc, n;
-    ngx_http_lua_shrbtree_ctx_t    *ctx;
-    ngx_rbtree_node_t              *node;
-    ngx_http_lua_shrbtree_node_t   *srbtn;
-    ngx_http_lua_shrbtree_ltable_t *ltable;
-    ngx_http_lua_shrbtree_lfield_t *lfield;
-    ngx_shm_zone_t                 *zone;
+    ngx_uint_t   i;
+    ngx_str_t   *one, *two;
 
-    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
-    u_char *kdata = &key[0];
-    u_char ktype;
-    size_t klen;
+    if (NULL == octx->indexes || NULL == ctx->indexes) {
+        return octx->indexes == ctx->indexes;
+    }
 
-    ngx_int_t is_getlfield = 0;
+    if (octx->indexes->nelts != ctx->indexes->nelts) {
+        return 0;
+    }
 
-    /* [{zone}, {key, [field, cmpf}]*/
-    ngx_http_lua_shrbtree_luaL_checknarg(L, 2 /* narg */);
-    luaL_checktype(L, 1, LUA_TTABLE);
-    luaL_checktype(L, 2, LUA_TTABLE);
-    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+    one = octx->indexes->elts;
+    two = ctx->indexes->elts;
 
-    n = lua_objlen(L, 2);
-    luaL_argcheck(L, 2 == n || 3 == n, 2, "expected 2 or 3 elements");
-    if (3 == n) {is_getlfield = 1;}
+    for (i = 0; i < ctx->indexes->nelts; i++) {
+        if (one[i].len != two[i].len
+            || ngx_memcmp(one[i].data, two[i].data, one[i].len) != 0)
+        {
+            return 0;
+        }
+    }
 
-    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
-    ctx = zone->data;
+    return 1;
+}
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-    node = ngx_http_lua_shrbtree_get_node(L, &ctx->sh->rbtree);
-    if (NULL == node) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnil(L);
-        lua_pushliteral(L, "no exists");
-        return 2;
-    }
 
-    srbtn = (ngx_http_lua_shrbtree_node_t*)&node->data;
-    if (!is_getlfield) {
-        ngx_http_lua_shrbtree_pushlvalue(L, (&srbtn->data) + srbtn->klen,
-                                         srbtn->vtype, srbtn->vlen);
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        return 1;
+/*
+ * the nodes of a reused zone are in the shards of the keys they were split
+ * by, of the same cmp as checked before
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_same_split(ngx_http_lua_shrbtree_ctx_t *octx,
+    ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_uint_t    i;
+    ngx_str_t    *one, *two;
+    lua_Number   *num, *other;
+
+    if (NULL == octx->split || NULL == ctx->split) {
+        return octx->split == ctx->split;
     }
 
-/* getfield */
-    if (LUA_TTABLE != srbtn->vtype) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnil(L);
-        lua_pushliteral(L, "the value type isn't a table");
-        return 2;
+    if (octx->split->nelts != ctx->split->nelts) {
+        return 0;
     }
 
-    /* field */
-    lua_rawgeti(L, 2, 2);
-    rc = ngx_http_lua_shrbtree_tolvalue(L, -1, &kdata, &ktype, &klen);
-    if (0 != rc) {return rc;}
+    if (ctx->cmp == NGX_HTTP_LUA_SHRBTREE_CMP_STRING) {
+        one = octx->split->elts;
+        two = ctx->split->elts;
 
-    ltable = (ngx_http_lua_shrbtree_ltable_t *)((&srbtn->data) + srbtn->klen);
-    lfield =  ngx_http_lua_shrbtree_get_lfield(ltable, kdata, klen);
+        for (i = 0; i < ctx->split->nelts; i++) {
+            if (one[i].len != two[i].len
+                || ngx_memcmp(one[i].data, two[i].data, one[i].len) != 0)
+            {
+                return 0;
+            }
+        }
 
-    if (NULL == lfield) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushnil(L);
-        lua_pushliteral(L, "no exists this field");
-        return 2;
+        return 1;
+    }
+
+    num = octx->split->elts;
+    other = ctx->split->elts;
+
+    for (i = 0; i < ctx->split->nelts; i++) {
+        if (num[i] != other[i]) {
+            return 0;
+        }
     }
 
-    ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
-                                     lfield->vtype, lfield->vlen);
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
     return 1;
 }
 
 
-static int
-ngx_http_lua_shrbtree_insert(lua_State *L)
+/* a slab pool of its own for a shard, in the pages of the zone's pool */
+static ngx_slab_pool_t *
+ngx_http_lua_shrbtree_init_pool(ngx_shm_zone_t *shm_zone,
+    ngx_slab_pool_t *shpool, size_t size, ngx_uint_t n)
 {
-    ngx_int_t                    n, rc;
-    ngx_shm_zone_t               *zone;
-    ngx_http_lua_shrbtree_ctx_t  *ctx;
-    ngx_rbtree_node_t            *node;
-    ngx_http_lua_shrbtree_node_t *srbtn;
+    u_char           *file;
+    ngx_slab_pool_t  *pool;
+
+    pool = ngx_slab_alloc(shpool, size);
+    if (pool == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "lua_shared_rbtree \"%V\" is too small for shards",
+                      &shm_zone->shm.name);
+        return NULL;
+    }
 
-    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
-    u_char value[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
-    u_char *kdata = &key[0];
-    u_char *vdata = &value[0];
-    size_t klen, vlen;
-    u_char ktype, vtype;
+    pool->end = (u_char *) pool + size;
+    pool->min_shift = 3;
+    pool->addr = pool;
 
-    void *p;
+#if (NGX_HAVE_ATOMIC_OPS)
 
-    ngx_rbtree_node_t *sentinel;
-    ngx_rbtree_node_t *parent;
-    ngx_rbtree_node_t **position;
+    file = NULL;
 
-    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
-    luaL_checktype(L, 1, LUA_TTABLE);
-    luaL_checktype(L, 2, LUA_TTABLE);
-    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
-    luaL_argcheck(L, 3 == lua_objlen(L, 2), 2, "expected 3 elements");
+#else
 
-    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    file = ngx_pnalloc(ngx_cycle->pool, ngx_cycle->lock_file.len
+                                        + shm_zone->shm.name.len
+                                        + NGX_INT_T_LEN + 2);
+    if (file == NULL) {
+        return NULL;
+    }
 
-    ctx = zone->data;
+    (void) ngx_sprintf(file, "%V%V.%ui%Z", &ngx_cycle->lock_file,
+                       &shm_zone->shm.name, n);
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-    node = ngx_http_lua_shrbtree_get_rawnode(L, &ctx->sh->rbtree,
-                                             &parent, &position);
-    if (NULL != node) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "the node exists");
-        return 2;
+#endif
+
+    if (ngx_shmtx_create(&pool->mutex, &pool->lock, file) != NGX_OK) {
+        return NULL;
     }
 
-    /* {key, value, cmpf} */
-    lua_rawgeti(L, 2, 1); /* key */
-    rc = ngx_http_lua_shrbtree_tolvalue(L, -1, &kdata, &ktype, &klen);
-    if (0 != rc) {return rc;}
+    ngx_slab_init(pool);
 
-    lua_rawgeti(L, 2, 2); /* value */
-    rc = ngx_http_lua_shrbtree_tolvalue(L, -1, &vdata, &vtype, &vlen);
-    if (0 != rc) {return rc;}
+    pool->log_ctx = shpool->log_ctx;
+#if defined(nginx_version) && nginx_version >= 1005013
+    pool->log_nomem = 0;
+#endif
 
-    n = offsetof(ngx_rbtree_node_t, data)
-      + offsetof(ngx_http_lua_shrbtree_node_t, data)
-      + klen
-      + vlen;
+    return pool;
+}
 
-    node = ngx_slab_alloc_locked(ctx->shpool, n);
 
-    if (node == NULL) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+/* loads the snapshot into a new zone, there's no snapshot at the first run */
+static ngx_int_t
+ngx_http_lua_shrbtree_load(ngx_shm_zone_t *shm_zone,
+    ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    u_char                            *addr, *p, *last;
+    size_t                             size;
+    uint64_t                           count;
+    ngx_fd_t                           fd;
+    ngx_int_t                          rc;
+    ngx_err_t                          err;
+    ngx_uint_t                         i;
+    ngx_file_info_t                    fi;
+    ngx_http_lua_shrbtree_ctx_t       *shard;
+    ngx_http_lua_shrbtree_snapshot_t  *snapshot;
+    ngx_http_lua_shrbtree_section_t   *section;
+
+    fd = ngx_open_file(ctx->snapshot.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" has no snapshot \"%s\" "
+                          "yet", &shm_zone->shm.name, ctx->snapshot.data);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, err,
+                      ngx_open_file_n " \"%s\" failed", ctx->snapshot.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", ctx->snapshot.data);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    size = (size_t) ngx_file_size(&fi);
+
+    if (size < sizeof(ngx_http_lua_shrbtree_snapshot_t)) {
+        ngx_close_file(fd);
+        goto invalid;
+    }
+
+    /* the records are copied to the slab as they are, without parsing */
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    err = ngx_errno;
+
+    ngx_close_file(fd);
+
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, err,
+                      "mmap(\"%s\") failed", ctx->snapshot.data);
+        return NGX_ERROR;
+    }
+
+    snapshot = (ngx_http_lua_shrbtree_snapshot_t *) addr;
+    last = addr + size;
+
+    if (ngx_memcmp(snapshot->magic, NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_MAGIC, 8)
+        || snapshot->version != NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_VERSION
+        || snapshot->word != sizeof(size_t))
+    {
+        munmap(addr, size);
+        goto invalid;
+    }
+
+    if (snapshot->nshards != ctx->nshards) {
+        ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                      "lua_shared_rbtree \"%V\" uses %ui shards while "
+                      "the snapshot \"%s\" has %uD shards",
+                      &shm_zone->shm.name, ctx->nshards, ctx->snapshot.data,
+                      snapshot->nshards);
+        munmap(addr, size);
+        return NGX_ERROR;
+    }
+
+    p = (u_char *) &snapshot[1];
+    count = 0;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        section = (ngx_http_lua_shrbtree_section_t *) p;
+        p = (u_char *) &section[1];
+
+        if (p > last || section->size > (uint64_t) (last - p)) {
+            rc = NGX_DECLINED;
+
+        } else {
+            shard = &ctx->shards[i];
+
+            ngx_http_lua_shrbtree_lock(shard);
+            rc = ngx_http_lua_shrbtree_load_section(shard, p, section->count,
+                                                    section->size);
+            ngx_http_lua_shrbtree_unlock(shard);
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "lua_shared_rbtree \"%V\" is too small for the "
+                          "snapshot \"%s\"",
+                          &shm_zone->shm.name, ctx->snapshot.data);
+            munmap(addr, size);
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_DECLINED) {
+            munmap(addr, size);
+            goto invalid;
+        }
+
+        p += section->size;
+        count += section->count;
+    }
+
+    munmap(addr, size);
+
+    ngx_log_error(NGX_LOG_NOTICE, shm_zone->shm.log, 0,
+                  "lua_shared_rbtree \"%V\" loaded %uL nodes from \"%s\"",
+                  &shm_zone->shm.name, count, ctx->snapshot.data);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                  "\"%s\" is not a valid snapshot of lua_shared_rbtree",
+                  ctx->snapshot.data);
+    return NGX_ERROR;
+}
+
+
+/*
+ * copies the records of a section to the shard's tree, returns NGX_DECLINED
+ * if the section is broken, NGX_ERROR if there's no memory
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_load_section(ngx_http_lua_shrbtree_ctx_t *ctx,
+    u_char *p, uint64_t count, uint64_t size)
+{
+    u_char                          *last;
+    size_t                           len, rest;
+    ngx_uint_t                       i, h;
+    ngx_msec_t                       expires;
+    ngx_rbtree_node_t               *node, *root, *sentinel;
+    ngx_rbtree_node_t              **nodes;
+    ngx_http_lua_shrbtree_record_t  *record;
+
+    if (count == 0) {
+        return size == 0 ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (count > size / offsetof(ngx_http_lua_shrbtree_record_t, node.data)) {
+        return NGX_DECLINED;
+    }
+
+    nodes = ngx_alloc((size_t) count * sizeof(ngx_rbtree_node_t *),
+                      ngx_cycle->log);
+    if (nodes == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = p + size;
+
+    for (i = 0; i < count; i++) {
+        rest = last - p;
+        record = (ngx_http_lua_shrbtree_record_t *) p;
+
+        if (rest < offsetof(ngx_http_lua_shrbtree_record_t, node.data)
+            || record->node.klen > rest
+            || record->node.vlen > rest
+            || record->ttl > (uint64_t) NGX_HTTP_LUA_SHRBTREE_MAX_TTL * 1000)
+        {
+            goto declined;
+        }
+
+        len = offsetof(ngx_http_lua_shrbtree_node_t, data)
+              + record->node.klen + record->node.vlen;
+
+        if (ngx_align(offsetof(ngx_http_lua_shrbtree_record_t, node) + len, 8)
+            > rest)
+        {
+            goto declined;
+        }
+
+        /* the values are read as their types say, so they're checked */
+        if (ngx_http_lua_shrbtree_check_flat(&record->node.data,
+                                             record->node.ktype,
+                                             record->node.klen, 0)
+            != NGX_OK
+            || ngx_http_lua_shrbtree_check_flat(&record->node.data
+                                                + record->node.klen,
+                                                record->node.vtype,
+                                                record->node.vlen, 0)
+               != NGX_OK)
+        {
+            goto declined;
+        }
+
+        expires = record->ttl ? ngx_http_lua_shrbtree_expires(record->ttl) : 0;
+
+        node = ngx_http_lua_shrbtree_alloc_node(ctx, len, expires, 0);
+        if (node == NULL) {
+            ngx_free(nodes);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(&node->data, &record->node, len);
+        nodes[i] = node;
+
+        p += ngx_align(offsetof(ngx_http_lua_shrbtree_record_t, node) + len,
+                       8);
+    }
+
+    if (p != last) {
+        goto declined;
+    }
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    /* the deepest level is red, unless it's the root */
+    for (h = 0, i = count; i > 1; i >>= 1) {
+        h++;
+    }
+
+    root = ngx_http_lua_shrbtree_build(nodes, count, sentinel, 0, h);
+    root->parent = NULL;
+
+    if (ctx->rank) {
+        (void) ngx_http_lua_shrbtree_size_tree(root, sentinel);
+    }
+
+    ctx->sh->rbtree.root = root;
+    ctx->sh->btree = ngx_http_lua_shrbtree_btree_build(ctx, nodes, count);
+    ctx->sh->counters.nodes = count;
+
+    for (i = 0; i < count; i++) {
+        ngx_http_lua_shrbtree_link(ctx, nodes[i]);
+    }
+
+    ngx_free(nodes);
+
+    return NGX_OK;
+
+declined:
+
+    /* the zone isn't used, as nginx doesn't start */
+    ngx_free(nodes);
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_lua_shrbtree_init_process(ngx_cycle_t *cycle)
+{
+    ngx_event_t  *ev;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    ev = &ngx_http_lua_shrbtree_sweep_event;
+
+    ev->handler = ngx_http_lua_shrbtree_sweep;
+    ev->data = cycle;
+    ev->log = cycle->log;
+    ev->cancelable = 1;
+
+    ngx_add_timer(ev, NGX_HTTP_LUA_SHRBTREE_SWEEP_INTERVAL);
+
+    return NGX_OK;
+}
+
+
+/*
+ * every worker sweeps the expired nodes of all zones in batches, and comes
+ * back soon while there are more
+ */
+static void
+ngx_http_lua_shrbtree_sweep(ngx_event_t *ev)
+{
+    ngx_int_t                           rc;
+    ngx_msec_t                          timer;
+    ngx_uint_t                          i, n;
+    ngx_shm_zone_t                    **zone;
+    ngx_http_lua_shrbtree_ctx_t        *ctx, *shard;
+    ngx_http_lua_shrbtree_main_conf_t  *lsmcf;
+
+    ngx_http_lua_shrbtree_expire_snapshots();
+
+    if (ngx_exiting || ngx_quit) {
+        return;
+    }
+
+    lsmcf = ngx_http_lua_shrbtree_get_main_conf(ev->data);
+
+    if (lsmcf->shm_zones == NULL) {
+        return;
+    }
+
+    timer = NGX_HTTP_LUA_SHRBTREE_SWEEP_INTERVAL;
+    zone = lsmcf->shm_zones->elts;
+
+    for (i = 0; i < lsmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        for (n = 0; n < ctx->nshards; n++) {
+            shard = &ctx->shards[n];
+
+            if (ngx_http_lua_shrbtree_idle(shard)) {
+                continue;
+            }
+
+            ngx_http_lua_shrbtree_lock(shard);
+
+            rc = ngx_http_lua_shrbtree_expire(shard,
+                                         NGX_HTTP_LUA_SHRBTREE_SWEEP_BATCH);
+
+            if (NGX_AGAIN == ngx_http_lua_shrbtree_drain(shard,
+                                         NGX_HTTP_LUA_SHRBTREE_DRAIN_BATCH))
+            {
+                rc = NGX_AGAIN;
+            }
+
+            ngx_http_lua_shrbtree_reclaim(shard);
+            ngx_http_lua_shrbtree_btree_rebuild(shard);
+
+            ngx_http_lua_shrbtree_unlock(shard);
+
+            if (rc == NGX_AGAIN) {
+                timer = 1;
+            }
+        }
+    }
+
+    ngx_add_timer(ev, timer);
+}
+
+
+/*
+ * a shard with nothing to sweep, as seen without the lock: the sweep of a
+ * zone of many quiet shards doesn't take their locks in every worker
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_idle(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+
+    sh = ctx->sh;
+
+    if (sh->expiry.root != sh->expiry.sentinel
+        || sh->drain || sh->draining || sh->retired || sh->reclaim)
+    {
+        return 0;
+    }
+
+    /* the btree to build again, see btree_rebuild */
+    if (ctx->btree && NULL == sh->btree && sh->seq != sh->btree_tried) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+int
+ngx_http_lua_shrbtree_preload(lua_State *L)
+{
+    ngx_http_lua_shrbtree_main_conf_t *lsmcf;
+    ngx_cycle_t *cycle;
+
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_uint_t                   i;
+    ngx_shm_zone_t               **zone;
+    ngx_uint_t                   type;
+
+    cycle = ngx_http_lua_shrbtree_luaL_checkcycle(L);
+    lsmcf = ngx_http_lua_shrbtree_get_main_conf(cycle);
+
+    if (lsmcf->shm_zones != NULL) {
+        lua_createtable(L, 0, lsmcf->shm_zones->nelts /* nrec */);
+
+        lua_createtable(L, 0 /* narr */, 27 + NGX_HTTP_LUA_SHRBTREE_CMP_MAX
+                        /* nrec */); /* shared mt */
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_insert);
+        lua_setfield(L, -2, "insert");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_set);
+        lua_setfield(L, -2, "set");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_replace);
+        lua_setfield(L, -2, "replace");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_incr);
+        lua_setfield(L, -2, "incr");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_get);
+        lua_setfield(L, -2, "get");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_delete);
+        lua_setfield(L, -2, "delete");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_bulk_load);
+        lua_setfield(L, -2, "bulk_load");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_apply_delta);
+        lua_setfield(L, -2, "apply_delta");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_begin_reload);
+        lua_setfield(L, -2, "begin_reload");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_stage);
+        lua_setfield(L, -2, "stage");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_commit);
+        lua_setfield(L, -2, "commit");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_abort_reload);
+        lua_setfield(L, -2, "abort_reload");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_mget);
+        lua_setfield(L, -2, "mget");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_save);
+        lua_setfield(L, -2, "save");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_range);
+        lua_setfield(L, -2, "range");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_get_by);
+        lua_setfield(L, -2, "get_by");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_floor);
+        lua_setfield(L, -2, "floor");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_ceil);
+        lua_setfield(L, -2, "ceil");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_lower_bound);
+        lua_setfield(L, -2, "lower_bound");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_upper_bound);
+        lua_setfield(L, -2, "upper_bound");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_rank);
+        lua_setfield(L, -2, "rank");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_select);
+        lua_setfield(L, -2, "select");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_count);
+        lua_setfield(L, -2, "count");
+
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_stats);
+        lua_setfield(L, -2, "stats");
+
+        lua_createtable(L, 0 /* narr */, 2 /* nrec */); /* cursor mt */
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_cursor_next);
+        lua_setfield(L, -2, "next");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushcclosure(L, ngx_http_lua_shrbtree_iter, 1);
+        lua_setfield(L, -2, "iter");
+
+        lua_createtable(L, 0 /* narr */, 7 /* nrec */); /* view mt */
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_ptr);
+        lua_setfield(L, -2, "ptr");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_len);
+        lua_setfield(L, -2, "len");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_release);
+        lua_setfield(L, -2, "release");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_release);
+        lua_setfield(L, -2, "__gc");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_len);
+        lua_setfield(L, -2, "__len");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_view_tostring);
+        lua_setfield(L, -2, "__tostring");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_pushcclosure(L, ngx_http_lua_shrbtree_view, 1);
+        lua_setfield(L, -2, "view");
+
+        lua_createtable(L, 0 /* narr */, 3 /* nrec */); /* snapshot mt */
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_snapshot_get);
+        lua_setfield(L, -2, "get");
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_snapshot_release);
+        lua_setfield(L, -2, "release");
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+        lua_createtable(L, 0 /* narr */, 1 /* nrec */); /* versions mt */
+        lua_pushcfunction(L, ngx_http_lua_shrbtree_snapshot_release);
+        lua_setfield(L, -2, "__gc");
+        lua_pushcclosure(L, ngx_http_lua_shrbtree_snapshot, 2);
+        lua_setfield(L, -2, "snapshot");
+
+        for (type = 1; type < NGX_HTTP_LUA_SHRBTREE_CMP_MAX; type++) {
+            lua_pushlightuserdata(L, &ngx_http_lua_shrbtree_cmp_tags[type]);
+            lua_setfield(L, -2, ngx_http_lua_shrbtree_cmp_names[type]);
+        }
+
+        lua_pushvalue(L, -1); /* shared mt mt */
+        lua_setfield(L, -2, "__index"); /* shared mt */
+
+        zone = lsmcf->shm_zones->elts;
+
+        for (i = 0; i < lsmcf->shm_zones->nelts; i++) {
+            ctx = zone[i]->data;
+
+            lua_pushlstring(L, (char *) ctx->name.data, ctx->name.len);
+            /* shared mt key */
+
+            lua_createtable(L, 1 /* narr */, 0 /* nrec */);
+            lua_pushlightuserdata(L, zone[i]); /* shared mt key ud */
+            lua_rawseti(L, -2, 1); /* {zone[i]} */
+            lua_pushvalue(L, -3); /* shared mt key ud mt */
+            lua_setmetatable(L, -2); /* shared mt key ud */
+            lua_rawset(L, -4); /* shared mt */
+        }
+
+        lua_pop(L, 1);
+
+    } else {
+        lua_newtable(L);
+    }
+
+    return 1;
+}
+
+
+static ngx_cycle_t *
+ngx_http_lua_shrbtree_luaL_checkcycle(lua_State *L)
+{
+    ngx_cycle_t *cycle;
+
+    lua_getglobal(L, "__ngx_cycle");
+    cycle = lua_touserdata(L, -1);
+    if (cycle == NULL) {
+        luaL_error(L, "attempt to use a 'ngx.null' value "
+                   "(global '__ngx_cycle')");
+    }
+
+    lua_pop(L, 1);
+
+    return cycle;
+}
+
+
+static int
+ngx_http_lua_shrbtree_luaL_checknarg(lua_State *L, int narg)
+{
+    if (narg == lua_gettop(L)) {return 0;}
+
+    lua_Debug ar;
+    if (!lua_getstack(L, 0, &ar)) { /* no stack frame? */
+        return luaL_error(L, "excpected %d %s", narg,
+                          1 == narg ? "argument" : "arguments");
+    }
+    lua_getinfo(L, "n", &ar);
+    if (ar.name == NULL) {
+        ar.name = "?";
+    }
+    return luaL_error(L, "excpected %d %s to '%s'",
+                      narg,
+                      1 == narg ? "argument" : "arguments",
+                      ar.name);
+}
+
+
+static ngx_shm_zone_t*
+ngx_http_lua_shrbtree_luaL_checkzone(lua_State *L, int arg)
+{
+    ngx_shm_zone_t *zone;
+
+    lua_rawgeti(L, arg, 1);
+    zone = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (zone == NULL) {
+        luaL_argerror(L, arg, "excpected \"zone\"");
+    }
+
+    return zone;
+}
+
+
+static int
+ngx_http_lua_shrbtree_luaL_checkcmp(lua_State *L, int arg, int n,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    cmp->type = ctx->cmp;
+    cmp->index = 0;
+    cmp->rc = NGX_OK;
+    cmp->compares = 0;
+
+    /* the compare function is the last element, or the zone default */
+    if (n > 0) {
+        lua_rawgeti(L, arg, n);
+
+        if (lua_isfunction(L, -1)) {
+            /* it's left on the stack */
+            cmp->type = NGX_HTTP_LUA_SHRBTREE_CMP_LUA;
+            cmp->index = lua_gettop(L);
+            return n - 1;
+
+        } else if (lua_islightuserdata(L, -1)) {
+            cmp->type = ngx_http_lua_shrbtree_cmp_tag(L, -1);
+            if (NGX_HTTP_LUA_SHRBTREE_CMP_MAX == cmp->type) {
+                return luaL_argerror(L, arg, "bad builtin compare");
+            }
+
+            n--;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_LUA == cmp->type && 0 == cmp->index) {
+        return luaL_argerror(L, arg, "excpected compare function");
+    }
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_shrbtree_cmp_tag(lua_State *L, int index)
+{
+    u_char *tag;
+
+    tag = lua_touserdata(L, index);
+    if (tag <= &ngx_http_lua_shrbtree_cmp_tags[0]
+        || tag >= &ngx_http_lua_shrbtree_cmp_tags[
+                       NGX_HTTP_LUA_SHRBTREE_CMP_MAX])
+    {
+        return NGX_HTTP_LUA_SHRBTREE_CMP_MAX;
+    }
+
+    return tag - &ngx_http_lua_shrbtree_cmp_tags[0];
+}
+
+
+/* check a key or value before the zone is locked */
+static void
+ngx_http_lua_shrbtree_luaL_checklvalue(lua_State *L, int index,
+    ngx_uint_t depth)
+{
+    switch (lua_type(L, index)) {
+    case LUA_TBOOLEAN:
+    case LUA_TNUMBER:
+        return;
+
+    case LUA_TSTRING:
+        if (lua_objlen(L, index) > NGX_MAX_UINT32_VALUE) {
+            luaL_error(L, "string too long");
+        }
+
+        return;
+
+    case LUA_TTABLE:
+        if (NGX_HTTP_LUA_SHRBTREE_MAX_NESTING == depth
+            || !lua_checkstack(L, 3))
+        {
+            luaL_error(L, "table nested too deep");
+        }
+
+        if (index < 0) {
+            index = lua_gettop(L) + index + 1;
+        }
+
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            ngx_http_lua_shrbtree_luaL_checklvalue(L, -2, depth + 1);
+            ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, depth + 1);
+            lua_pop(L, 1);
+        }
+
+        return;
+
+    default:
+        luaL_error(L, "bad type value");
+    }
+}
+
+
+static void
+ngx_http_lua_shrbtree_luaL_checkkey(lua_State *L, int index,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    size_t i, n;
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    cmp->probe = index;
+
+    switch (cmp->type) {
+    case NGX_HTTP_LUA_SHRBTREE_CMP_LUA:
+        return;
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_STRING:
+        if (LUA_TSTRING != lua_type(L, index)) {
+            luaL_error(L, "bad key, excpected string");
+        }
+
+        cmp->kdata = (u_char *)lua_tolstring(L, index, &cmp->klen);
+        return;
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER:
+        if (LUA_TNUMBER != lua_type(L, index)) {
+            luaL_error(L, "bad key, excpected number");
+        }
+
+        cmp->key[0] = lua_tonumber(L, index);
+        cmp->nkey = 1;
+
+        /* NaN compares equal to any key, so it would match any node */
+        if (cmp->key[0] != cmp->key[0]) {
+            luaL_error(L, "bad key, NaN");
+        }
+
+        return;
+
+    default: /* tuple, interval */
+        if (LUA_TNUMBER == lua_type(L, index)) {
+            cmp->key[0] = lua_tonumber(L, index);
+            cmp->nkey = 1;
+
+            if (cmp->key[0] != cmp->key[0]) {
+                luaL_error(L, "bad key, NaN");
+            }
+
+            return;
+        }
+
+        if (LUA_TTABLE != lua_type(L, index)) {
+            luaL_error(L, "bad key, excpected number or table");
+        }
+
+        n = lua_objlen(L, index);
+        if (0 == n || NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE < n
+            || (NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL == cmp->type && 2 < n))
+        {
+            luaL_error(L, "bad key, too many or no elements");
+        }
+
+        for (i = 0; i < n; i++) {
+            lua_rawgeti(L, index, i + 1);
+            if (LUA_TNUMBER != lua_type(L, -1)) {
+                luaL_error(L, "bad key, excpected number elements");
+            }
+
+            cmp->key[i] = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+
+            if (cmp->key[i] != cmp->key[i]) {
+                luaL_error(L, "bad key, NaN");
+            }
+        }
+
+        cmp->nkey = n;
+        return;
+    }
+}
+
+
+/* the shard of the probe */
+static ngx_http_lua_shrbtree_ctx_t *
+ngx_http_lua_shrbtree_luaL_route(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    if (1 == ctx->nshards) {
+        return ctx;
+    }
+
+    if (cmp->type != ctx->cmp) {
+        luaL_error(L, "a sharded zone takes its own compare only");
+    }
+
+    return &ctx->shards[ngx_http_lua_shrbtree_shard(ctx, cmp)];
+}
+
+
+static void
+ngx_http_lua_shrbtree_luaL_checkordered(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    if (1 != ctx->nshards && NULL == ctx->split) {
+        luaL_error(L, "ordered lookups need the zone split by keys");
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_lua_shrbtree_shard(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    uint32_t    hash;
+    ngx_uint_t  i, lo, hi, mid;
+    ngx_str_t   *str;
+    lua_Number  *num, key;
+
+    if (1 == ctx->nshards) {
+        return 0;
+    }
+
+    if (NULL == ctx->split) {
+        if (NGX_HTTP_LUA_SHRBTREE_CMP_STRING == cmp->type) {
+            hash = ngx_crc32_short(cmp->kdata, cmp->klen);
+
+        } else {
+            ngx_crc32_init(hash);
+
+            for (i = 0; i < cmp->nkey; i++) {
+                /* -0 is 0 */
+                key = (0 == cmp->key[i]) ? 0 : cmp->key[i];
+                ngx_crc32_update(&hash, (u_char *) &key, sizeof(lua_Number));
+            }
+
+            ngx_crc32_final(hash);
+        }
+
+        return hash % ctx->nshards;
+    }
+
+    /* the number of split keys not after the key */
+    lo = 0;
+    hi = ctx->split->nelts;
+    str = ctx->split->elts;
+    num = ctx->split->elts;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (NGX_HTTP_LUA_SHRBTREE_CMP_STRING == cmp->type
+            ? 0 >= ngx_memn2cmp(str[mid].data, cmp->kdata, str[mid].len,
+                                cmp->klen)
+            : num[mid] <= cmp->key[0])
+        {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+
+/* an interval key whose end goes to another shard than its start */
+static ngx_uint_t
+ngx_http_lua_shrbtree_crosses(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    ngx_http_lua_shrbtree_cmp_t  end;
+
+    if (NULL == ctx->split || NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL != cmp->type
+        || 2 != cmp->nkey)
+    {
+        return 0;
+    }
+
+    end = *cmp;
+    end.key[0] = cmp->key[1];
+
+    return ngx_http_lua_shrbtree_shard(ctx, cmp)
+           != ngx_http_lua_shrbtree_shard(ctx, &end);
+}
+
+
+static int
+ngx_http_lua_shrbtree_get(lua_State *L)
+{
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_get_t    get;
+
+    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    ctx = ngx_http_lua_shrbtree_luaL_checkget(L, &get, &key[0]);
+
+    /*
+     * whole values by the keys which are equal as lua table keys: strings,
+     * and numbers, which are the points of interval and tuple zones too.
+     * An entry is of the zone's compare, another one may find another node.
+     */
+    if (ctx->l1 && NULL == get.fdata && 0 == get.fields
+        && get.cmp.type == ctx->cmp
+        && (NGX_HTTP_LUA_SHRBTREE_CMP_STRING == get.cmp.type
+            || (NGX_HTTP_LUA_SHRBTREE_CMP_LUA != get.cmp.type
+                && LUA_TNUMBER == lua_type(L, get.cmp.probe)
+                && lua_tonumber(L, get.cmp.probe)
+                   == lua_tonumber(L, get.cmp.probe))))
+    {
+        return ngx_http_lua_shrbtree_l1_get(L, ctx, &get);
+    }
+
+    return ngx_http_lua_shrbtree_read(L, ctx, ngx_http_lua_shrbtree_get_handler,
+                                      &get);
+}
+
+
+static int
+ngx_http_lua_shrbtree_l1_get(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_get_t *get)
+{
+    int                cache, top, n;
+    ngx_atomic_uint_t  seq;
+
+    lua_pushlightuserdata(L, ctx);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+
+        lua_createtable(L, 5 /* narr */, 0 /* nrec */);
+        lua_newtable(L);
+        lua_rawseti(L, -2, NGX_HTTP_LUA_SHRBTREE_L1_SEQS);
+        lua_newtable(L);
+        lua_rawseti(L, -2, NGX_HTTP_LUA_SHRBTREE_L1_VALUES);
+        lua_newtable(L);
+        lua_rawseti(L, -2, NGX_HTTP_LUA_SHRBTREE_L1_OLD_SEQS);
+        lua_newtable(L);
+        lua_rawseti(L, -2, NGX_HTTP_LUA_SHRBTREE_L1_OLD_VALUES);
+        lua_pushnumber(L, 0);
+        lua_rawseti(L, -2, NGX_HTTP_LUA_SHRBTREE_L1_COUNT);
+
+        lua_pushlightuserdata(L, ctx);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+
+    cache = lua_gettop(L);
+
+    /* taken before the read, a write during it leaves the entry stale */
+    seq = ctx->sh->seq;
+    ngx_memory_barrier();
+
+    lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_SEQS);
+    lua_pushvalue(L, get->cmp.probe);
+    lua_rawget(L, -2);
+
+    if (lua_tonumber(L, -1) == (lua_Number) seq && !(seq & 1)) {
+        lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_VALUES);
+        lua_pushvalue(L, get->cmp.probe);
+        lua_rawget(L, -2);
+        return 1;
+    }
+
+    lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_OLD_SEQS);
+    lua_pushvalue(L, get->cmp.probe);
+    lua_rawget(L, -2);
+
+    if (lua_tonumber(L, -1) == (lua_Number) seq && !(seq & 1)) {
+        lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_OLD_VALUES);
+        lua_pushvalue(L, get->cmp.probe);
+        lua_rawget(L, -2);
+
+        ngx_http_lua_shrbtree_l1_set(L, ctx->l1, cache, get->cmp.probe,
+                                     lua_gettop(L), seq);
+        return 1;
+    }
+
+    lua_settop(L, cache);
+
+    n = ngx_http_lua_shrbtree_read(L, ctx, ngx_http_lua_shrbtree_get_handler,
+                                   get);
+
+    top = lua_gettop(L);
+
+    /* the nodes with a ttl expire without a write */
+    if (1 == n && !get->ttl && !(seq & 1)) {
+        ngx_http_lua_shrbtree_l1_set(L, ctx->l1, cache, get->cmp.probe, top,
+                                     seq);
+    }
+
+    return n;
+}
+
+
+static void
+ngx_http_lua_shrbtree_l1_set(lua_State *L, ngx_uint_t max, int cache, int key,
+    int value, ngx_atomic_uint_t seq)
+{
+    lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_COUNT);
+
+    if ((ngx_uint_t) lua_tonumber(L, -1) >= max) {
+        lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_SEQS);
+        lua_rawseti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_OLD_SEQS);
+        lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_VALUES);
+        lua_rawseti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_OLD_VALUES);
+
+        lua_createtable(L, 0 /* narr */, max /* nrec */);
+        lua_rawseti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_SEQS);
+        lua_createtable(L, 0 /* narr */, max /* nrec */);
+        lua_rawseti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_VALUES);
+
+        lua_pop(L, 1);
+        lua_pushnumber(L, 0);
+    }
+
+    lua_pushnumber(L, lua_tonumber(L, -1) + 1);
+    lua_rawseti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_COUNT);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_SEQS);
+    lua_pushvalue(L, key);
+    lua_pushnumber(L, (lua_Number) seq);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, cache, NGX_HTTP_LUA_SHRBTREE_L1_VALUES);
+    lua_pushvalue(L, key);
+    lua_pushvalue(L, value);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+
+/*
+ * [{zone}, {key, [field | {field1, field2, ...}], [cmpf]}], key is the
+ * buffer of a number field
+ */
+static ngx_http_lua_shrbtree_ctx_t *
+ngx_http_lua_shrbtree_luaL_checkget(lua_State *L,
+    ngx_http_lua_shrbtree_get_t *get, u_char *key)
+{
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+
+    u_char ktype;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2 /* narg */);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &get->cmp);
+    luaL_argcheck(L, 1 == n || 2 == n, 2, "expected key and optional field");
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &get->cmp);
+    ctx = ngx_http_lua_shrbtree_luaL_route(L, ctx, &get->cmp);
+
+    get->fdata = NULL;
+    get->fields = 0;
+    get->nfields = 0;
+    get->view = NULL;
+    get->tree = NULL;
+    get->ttl = 0;
+
+    if (1 == n) {
+        return ctx;
+    }
+
+    lua_rawgeti(L, 2, 2);
+
+    if (LUA_TTABLE == lua_type(L, -1)) {
+        /* fields, which are converted by the handler */
+        get->fields = lua_gettop(L);
+        get->nfields = lua_objlen(L, -1);
+        luaL_checkstack(L, get->nfields + LUA_MINSTACK, "too many fields");
+
+        for (i = 0; i < get->nfields; i++) {
+            lua_rawgeti(L, get->fields, i + 1);
+            n = lua_type(L, -1);
+            luaL_argcheck(L, LUA_TSTRING == n || LUA_TNUMBER == n
+                          || LUA_TBOOLEAN == n, 2, "bad field");
+            lua_pop(L, 1);
+        }
+
+        return ctx;
+    }
+
+    /* field, a string stays referenced by the arguments table */
+    get->fdata = key;
+    ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &get->fdata, &ktype, &get->flen,
+                                   0);
+    lua_pop(L, 1);
+
+    return ctx;
+}
+
+
+static int
+ngx_http_lua_shrbtree_get_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_get_t    *get = data;
+
+    char                           *err;
+    ngx_uint_t                     i;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char *kdata, ktype;
+    size_t klen;
+
+    if (NULL != get->tree) {
+        node = ngx_http_lua_shrbtree_get_node(L, get->tree, &get->cmp);
+
+    } else {
+        node = ngx_http_lua_shrbtree_find(L, ctx, &get->cmp);
+    }
+
+    if (NGX_OK != get->cmp.rc) {
+        return NGX_ERROR;
+    }
+
+    if (NULL != node && ngx_http_lua_shrbtree_expired(node)) {
+        node = NULL;
+    }
+
+    ngx_http_lua_shrbtree_stat_read(ctx, &get->cmp, node);
+
+    if (NULL == node) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no exists");
+        return 2;
+    }
+
+    ngx_http_lua_shrbtree_touch(ctx, node);
+
+    get->ttl = (0 != node->key);
+
+    srbtn = (ngx_http_lua_shrbtree_node_t*)&node->data;
+
+    if (0 == get->fields) {
+        lfield = ngx_http_lua_shrbtree_get_field(srbtn, get->fdata, get->flen,
+                                                 &err);
+        if (NULL == lfield) {
+            lua_pushnil(L);
+            lua_pushstring(L, err);
+            return 2;
+        }
+
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
+                                         lfield->vtype, lfield->vlen);
+        return 1;
+    }
+
+/* projection, a missing field is nil */
+    if (LUA_TTABLE != srbtn->vtype
+        && NGX_HTTP_LUA_SHRBTREE_TPACKED != srbtn->vtype)
+    {
+        lua_pushnil(L);
+        lua_pushliteral(L, "the value type isn't a table");
+        return 2;
+    }
+
+    for (i = 0; i < get->nfields; i++) {
+        kdata = &key[0];
+
+        lua_rawgeti(L, get->fields, i + 1);
+        ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &kdata, &ktype, &klen, 0);
+        lua_pop(L, 1);
+
+        lfield = ngx_http_lua_shrbtree_get_field(srbtn, kdata, klen, &err);
+        if (NULL == lfield) {
+            lua_pushnil(L);
+            continue;
+        }
+
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
+                                         lfield->vtype, lfield->vlen);
+    }
+
+    return get->nfields;
+}
+
+
+/*
+ * the field of the value, or the node itself if no field; both have the
+ * value at &data + klen
+ */
+static ngx_http_lua_shrbtree_lfield_t *
+ngx_http_lua_shrbtree_get_field(ngx_http_lua_shrbtree_node_t *srbtn,
+    u_char *fdata, size_t flen, char **err)
+{
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    if (NULL == fdata) {
+        return srbtn;
+    }
+
+    if (LUA_TTABLE != srbtn->vtype
+        && NGX_HTTP_LUA_SHRBTREE_TPACKED != srbtn->vtype)
+    {
+        *err = "the value type isn't a table";
+        return NULL;
+    }
+
+    lfield = ngx_http_lua_shrbtree_get_lfield(srbtn->vtype,
+                                              (&srbtn->data) + srbtn->klen,
+                                              fdata, flen);
+    if (NULL == lfield) {
+        *err = "no exists this field";
+    }
+
+    return lfield;
+}
+
+
+/*
+ * view{key, [field], [cmpf]} returns a view of a string value or field
+ * in the zone, without copying it.  Deleted nodes aren't freed while a
+ * view is held, so it should be released soon, and a shard holds at most
+ * NGX_HTTP_LUA_SHRBTREE_MAX_PINNED views and snapshots.
+ */
+static int
+ngx_http_lua_shrbtree_view(lua_State *L)
+{
+    int                            n;
+    ngx_atomic_uint_t              seq;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_get_t    get;
+    ngx_http_lua_shrbtree_view_t   *view;
+
+    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    ctx = ngx_http_lua_shrbtree_luaL_checkget(L, &get, &key[0]);
+    luaL_argcheck(L, 0 == get.fields, 2, "bad field");
+
+    if (NGX_OK != ngx_http_lua_shrbtree_pin(ctx->sh)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "too many views held");
+        return 2;
+    }
+
+    view = lua_newuserdata(L, sizeof(ngx_http_lua_shrbtree_view_t));
+    view->sh = NULL;
+    view->data = NULL;
+    view->len = 0;
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+
+    /* pinned before the lookup, so the found node outlives it */
+    view->slot = ngx_http_lua_shrbtree_read_begin(ctx->sh, &seq);
+    view->sh = ctx->sh;
+
+    get.view = view;
+    get.vindex = lua_gettop(L);
+
+    n = ngx_http_lua_shrbtree_read(L, ctx, ngx_http_lua_shrbtree_view_handler,
+                                   &get);
+    if (1 != n) {
+        ngx_http_lua_shrbtree_unpin(view->sh, view->slot);
+        view->sh = NULL;
+    }
+
+    return n;
+}
+
+
+static int
+ngx_http_lua_shrbtree_view_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_get_t    *get = data;
+
+    char                           *err;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    node = ngx_http_lua_shrbtree_find(L, ctx, &get->cmp);
+    if (NGX_OK != get->cmp.rc) {
+        return NGX_ERROR;
+    }
+
+    if (NULL != node && ngx_http_lua_shrbtree_expired(node)) {
+        node = NULL;
+    }
+
+    ngx_http_lua_shrbtree_stat_read(ctx, &get->cmp, node);
+
+    if (NULL == node) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no exists");
+        return 2;
+    }
+
+    ngx_http_lua_shrbtree_touch(ctx, node);
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    lfield = ngx_http_lua_shrbtree_get_field(srbtn, get->fdata, get->flen,
+                                             &err);
+    if (NULL == lfield) {
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (LUA_TSTRING != lfield->vtype) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "the value type isn't a string");
+        return 2;
+    }
+
+    get->view->data = &lfield->data + lfield->klen;
+    get->view->len = lfield->vlen;
+
+    lua_pushvalue(L, get->vindex);
+    return 1;
+}
+
+
+/* the address of the string, e.g. for ffi.cast("const char *", ptr) */
+static int
+ngx_http_lua_shrbtree_view_ptr(lua_State *L)
+{
+    ngx_http_lua_shrbtree_view_t *view;
+
+    view = lua_touserdata(L, 1);
+    luaL_argcheck(L, NULL != view, 1, "excpected view");
+
+    if (NULL == view->sh) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_pushlightuserdata(L, view->data);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shrbtree_view_len(lua_State *L)
+{
+    ngx_http_lua_shrbtree_view_t *view;
+
+    view = lua_touserdata(L, 1);
+    luaL_argcheck(L, NULL != view, 1, "excpected view");
+
+    lua_pushnumber(L, (lua_Number) (view->sh ? view->len : 0));
+    return 1;
+}
+
+
+/* copies the string */
+static int
+ngx_http_lua_shrbtree_view_tostring(lua_State *L)
+{
+    ngx_http_lua_shrbtree_view_t *view;
+
+    view = lua_touserdata(L, 1);
+    luaL_argcheck(L, NULL != view, 1, "excpected view");
+
+    if (NULL == view->sh) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+
+    lua_pushlstring(L, (char *) view->data, view->len);
+    return 1;
+}
+
+
+/* also the __gc, so a forgotten view is released by the collector */
+static int
+ngx_http_lua_shrbtree_view_release(lua_State *L)
+{
+    ngx_http_lua_shrbtree_view_t *view;
+
+    view = lua_touserdata(L, 1);
+    luaL_argcheck(L, NULL != view, 1, "excpected view");
+
+    if (NULL != view->sh) {
+        ngx_http_lua_shrbtree_unpin(view->sh, view->slot);
+        view->sh = NULL;
+        view->data = NULL;
+    }
+
+    return 0;
+}
+
+
+/*
+ * snapshot() returns a handle whose get reads the zone as it was when the
+ * handle was taken, without the lock.  A get fails with "stale snapshot"
+ * once a shard is written other than by bulk_load.  The trees replaced are
+ * not freed while the handle is held, at most
+ * NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_HOLD msec; at most
+ * NGX_HTTP_LUA_SHRBTREE_MAX_PINNED views and snapshots are held per shard.
+ */
+static int
+ngx_http_lua_shrbtree_snapshot(lua_State *L)
+{
+    ngx_uint_t                         i, tries;
+    ngx_shm_zone_t                    *zone;
+    ngx_http_lua_shrbtree_ctx_t       *ctx;
+    ngx_http_lua_shrbtree_shctx_t     *sh;
+    ngx_http_lua_shrbtree_version_t   *version;
+    ngx_http_lua_shrbtree_versions_t  *versions;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    lua_createtable(L, 1 /* narr */, 1 /* nrec */);
+    lua_pushlightuserdata(L, zone);
+    lua_rawseti(L, -2, 1);
+
+    versions = lua_newuserdata(L,
+                   offsetof(ngx_http_lua_shrbtree_versions_t, shards)
+                   + ctx->nshards * sizeof(ngx_http_lua_shrbtree_version_t));
+    versions->n = 0;
+    versions->expired = 0;
+
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "versions");
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sh = ctx->shards[i].sh;
+        version = &versions->shards[i];
+
+        if (NGX_OK != ngx_http_lua_shrbtree_hold(sh)) {
+            while (versions->n) {
+                version = &versions->shards[--versions->n];
+                ngx_http_lua_shrbtree_unhold(version->sh);
+            }
+
+            lua_pushnil(L);
+            lua_pushliteral(L, "too many snapshots held");
+            return 2;
+        }
+
+        /* held before the root is read, so its tree isn't drained */
+        version->sh = sh;
+        versions->n++;
+
+        version->seq = sh->seq;
+        ngx_memory_barrier();
+
+        for (tries = 0; /* void */ ; tries++) {
+            version->root = sh->rbtree.root;
+            ngx_memory_barrier();
+
+            if (!(version->seq & 1) && sh->seq == version->seq) {
+                break;
+            }
+
+            if (NGX_HTTP_LUA_SHRBTREE_READ_TRIES == tries) {
+                ngx_http_lua_shrbtree_lock(&ctx->shards[i]);
+                version->seq = sh->seq;
+                version->root = sh->rbtree.root;
+                ngx_http_lua_shrbtree_unlock(&ctx->shards[i]);
+                break;
+            }
+
+            ngx_cpu_pause();
+            version->seq = sh->seq;
+            ngx_memory_barrier();
+        }
+    }
+
+    versions->taken = ngx_current_msec;
+    ngx_queue_insert_tail(&ngx_http_lua_shrbtree_snapshots, &versions->queue);
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+/* get{key, [field | {field1, field2, ...}], [cmpf]} of a snapshot */
+static int
+ngx_http_lua_shrbtree_snapshot_get(lua_State *L)
+{
+    int                                n, top;
+    ngx_uint_t                         slot, stale;
+    ngx_rbtree_t                       tree;
+    ngx_shm_zone_t                    *zone;
+    ngx_atomic_uint_t                  seq;
+    ngx_http_lua_shrbtree_ctx_t       *ctx;
+    ngx_http_lua_shrbtree_get_t        get;
+    ngx_http_lua_shrbtree_version_t   *version;
+    ngx_http_lua_shrbtree_versions_t  *versions;
+
+    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    ctx = ngx_http_lua_shrbtree_luaL_checkget(L, &get, &key[0]);
+
+    lua_getfield(L, 1, "versions");
+    versions = lua_touserdata(L, -1);
+    luaL_argcheck(L, NULL != versions, 1, "excpected snapshot");
+    lua_pop(L, 1);
+
+    if (0 != versions->n
+        && ngx_current_msec - versions->taken
+           >= NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_HOLD)
+    {
+        ngx_http_lua_shrbtree_release_versions(versions);
+        versions->expired = 1;
+    }
+
+    if (0 == versions->n) {
+        lua_pushnil(L);
+
+        if (versions->expired) {
+            lua_pushliteral(L, "expired snapshot");
+
+        } else {
+            lua_pushliteral(L, "released snapshot");
+        }
+
+        return 2;
+    }
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    version = &versions->shards[ctx - ((ngx_http_lua_shrbtree_ctx_t *)
+                                       zone->data)->shards];
+
+    top = lua_gettop(L);
+
+    /* for the arguments of pcall */
+    luaL_checkstack(L, top + 2, "too many arguments");
+
+    slot = ngx_http_lua_shrbtree_read_begin(version->sh, &seq);
+
+    /* the nodes unlinked in place before the read may be freed already */
+    stale = !ngx_http_lua_shrbtree_intact(version);
+    n = 0;
+
+    if (!stale) {
+        /* the btree may be of a later tree, so the tree is descended */
+        tree.root = version->root;
+        tree.sentinel = ctx->sh->rbtree.sentinel;
+        tree.insert = ctx->sh->rbtree.insert;
+        get.tree = &tree;
+
+        n = ngx_http_lua_shrbtree_pcall(L, ctx,
+                                        ngx_http_lua_shrbtree_get_handler,
+                                        &get);
+
+        ngx_memory_barrier();
+
+        /* a tree written since may have been read torn */
+        stale = !ngx_http_lua_shrbtree_intact(version);
+    }
+
+    (void) ngx_http_lua_shrbtree_read_end(version->sh, slot, seq);
+
+    if (stale) {
+        lua_settop(L, top);
+        lua_pushnil(L);
+        lua_pushliteral(L, "stale snapshot");
+        return 2;
+    }
+
+    if (NGX_ERROR == n) {
+        return lua_error(L);
+    }
+
+    return n;
+}
+
+
+/*
+ * the tree of the version is intact if the shard wasn't written since, or
+ * its first write since replaced the tree, see freeze
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_intact(ngx_http_lua_shrbtree_version_t *version)
+{
+    ngx_uint_t                      i;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+
+    sh = version->sh;
+
+    if (sh->seq == version->seq) {
+        return 1;
+    }
+
+    ngx_memory_barrier();
+
+    for (i = 0; i < NGX_HTTP_LUA_SHRBTREE_FROZEN; i++) {
+        if (sh->frozen[i].root == version->root
+            && sh->frozen[i].seq == version->seq)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * records the tree of the locked shard as it's about to be replaced whole,
+ * before the write is begun
+ */
+static void
+ngx_http_lua_shrbtree_freeze(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    ngx_http_lua_shrbtree_frozen_t  *frozen;
+
+    frozen = &sh->frozen[sh->nfrozen++ % NGX_HTTP_LUA_SHRBTREE_FROZEN];
+
+    frozen->root = NULL;
+    ngx_memory_barrier();
+    frozen->seq = sh->seq;
+    ngx_memory_barrier();
+    frozen->root = sh->rbtree.root;
+}
+
+
+static int
+ngx_http_lua_shrbtree_snapshot_release(lua_State *L)
+{
+    ngx_http_lua_shrbtree_versions_t  *versions;
+
+    if (LUA_TTABLE == lua_type(L, 1)) {
+        lua_getfield(L, 1, "versions");
+        lua_replace(L, 1);
+    }
+
+    versions = lua_touserdata(L, 1);
+    luaL_argcheck(L, NULL != versions, 1, "excpected snapshot");
+
+    ngx_http_lua_shrbtree_release_versions(versions);
+
+    return 0;
+}
+
+
+static void
+ngx_http_lua_shrbtree_release_versions(
+    ngx_http_lua_shrbtree_versions_t *versions)
+{
+    ngx_uint_t  i;
+
+    if (0 == versions->n) {
+        return;
+    }
+
+    for (i = 0; i < versions->n; i++) {
+        ngx_http_lua_shrbtree_unhold(versions->shards[i].sh);
+    }
+
+    versions->n = 0;
+    ngx_queue_remove(&versions->queue);
+}
+
+
+/*
+ * releases the snapshots held past NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_HOLD, so
+ * that a handle kept, e.g. by a long running timer, doesn't keep the trees
+ * replaced for long
+ */
+static void
+ngx_http_lua_shrbtree_expire_snapshots(void)
+{
+    ngx_queue_t                       *q;
+    ngx_http_lua_shrbtree_versions_t  *versions;
+
+    while (!ngx_queue_empty(&ngx_http_lua_shrbtree_snapshots)) {
+        q = ngx_queue_head(&ngx_http_lua_shrbtree_snapshots);
+        versions = ngx_queue_data(q, ngx_http_lua_shrbtree_versions_t, queue);
+
+        if (ngx_current_msec - versions->taken
+            < NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_HOLD)
+        {
+            return;
+        }
+
+        ngx_http_lua_shrbtree_release_versions(versions);
+        versions->expired = 1;
+    }
+}
+
+
+/*
+ * mget{{key1, key2, ...}, [cmpf]} returns the values array of the keys,
+ * with nil for the missing ones, read in one go.  With a builtin compare
+ * the keys are looked up in ascending order, so that the descents go
+ * through the same upper nodes.
+ */
+static int
+ngx_http_lua_shrbtree_mget(lua_State *L)
+{
+    int                            keys;
+    size_t                         size;
+    ngx_int_t                      n;
+    ngx_uint_t                     i;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_cmp_t    cmp;
+    ngx_http_lua_shrbtree_mget_t   mget;
+
+    u_char used[NGX_HTTP_LUA_SHRBTREE_MAX_SHARDS];
+
+    /* [{zone}, {{keys}, [cmpf]}] */
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2 /* narg */);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &cmp);
+    luaL_argcheck(L, 1 == n, 2, "expected keys");
+
+    lua_rawgeti(L, 2, 1);
+    luaL_argcheck(L, LUA_TTABLE == lua_type(L, -1), 2, "expected keys");
+
+    keys = lua_gettop(L);
+    mget.n = lua_objlen(L, keys);
+    luaL_checkstack(L, mget.n + LUA_MINSTACK, "too many keys");
+
+    size = sizeof(ngx_http_lua_shrbtree_cmp_t)
+           + sizeof(ngx_http_lua_shrbtree_cmp_t *) + sizeof(ngx_uint_t);
+    mget.cmps = lua_newuserdata(L, mget.n * size);
+    mget.order = (ngx_http_lua_shrbtree_cmp_t **) &mget.cmps[mget.n];
+    mget.shards = (ngx_uint_t *) &mget.order[mget.n];
+
+    ngx_memzero(used, sizeof(used));
+
+    /* each probe key stays on the stack for a lua compare */
+    for (i = 0; i < mget.n; i++) {
+        mget.cmps[i] = cmp;
+        mget.order[i] = &mget.cmps[i];
+
+        lua_rawgeti(L, keys, i + 1);
+        ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &mget.cmps[i]);
+
+        mget.shards[i] = ngx_http_lua_shrbtree_luaL_route(L, ctx,
+                                                          &mget.cmps[i])
+                         - ctx->shards;
+        used[mget.shards[i]] = 1;
+    }
+
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_LUA != cmp.type) {
+        ngx_sort(mget.order, mget.n, sizeof(ngx_http_lua_shrbtree_cmp_t *),
+                 ngx_http_lua_shrbtree_cmp_probes);
+    }
+
+    lua_createtable(L, mget.n /* narr */, 0 /* nrec */);
+    mget.values = lua_gettop(L);
+
+    /* one read per shard */
+    for (mget.shard = 0; mget.shard < ctx->nshards; mget.shard++) {
+        if (used[mget.shard]) {
+            ngx_http_lua_shrbtree_read(L, &ctx->shards[mget.shard],
+                                       ngx_http_lua_shrbtree_mget_handler,
+                                       &mget);
+        }
+    }
+
+    lua_pushvalue(L, mget.values);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shrbtree_mget_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_mget_t   *mget = data;
+
+    ngx_uint_t                     i;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_cmp_t    *cmp;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+
+    for (i = 0; i < mget->n; i++) {
+        cmp = mget->order[i];
+
+        if (mget->shards[cmp - mget->cmps] != mget->shard) {
+            continue;
+        }
+
+        node = ngx_http_lua_shrbtree_find(L, ctx, cmp);
+        if (NGX_OK != cmp->rc) {
+            return NGX_ERROR;
+        }
+
+        if (NULL != node && ngx_http_lua_shrbtree_expired(node)) {
+            node = NULL;
+        }
+
+        ngx_http_lua_shrbtree_stat_read(ctx, cmp, node);
+
+        /* nil too, a failed read may have set it */
+        if (NULL == node) {
+            lua_pushnil(L);
+
+        } else {
+            ngx_http_lua_shrbtree_touch(ctx, node);
+
+            srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+            ngx_http_lua_shrbtree_pushlvalue(L, (&srbtn->data) + srbtn->klen,
+                                             srbtn->vtype, srbtn->vlen);
+        }
+
+        lua_rawseti(L, mget->values, cmp - mget->cmps + 1);
+    }
+
+    return 0;
+}
+
+
+/* floor{key, [cmpf]}: the greatest key not after the key */
+static int
+ngx_http_lua_shrbtree_floor(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_bound(L, NGX_HTTP_LUA_SHRBTREE_LE);
+}
+
+
+/* ceil{key, [cmpf]}: the least key not before the key */
+static int
+ngx_http_lua_shrbtree_ceil(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_bound(L, NGX_HTTP_LUA_SHRBTREE_GE);
+}
+
+
+/* lower_bound{key, [cmpf]}: same as ceil */
+static int
+ngx_http_lua_shrbtree_lower_bound(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_bound(L, NGX_HTTP_LUA_SHRBTREE_GE);
+}
+
+
+/* upper_bound{key, [cmpf]}: the least key after the key */
+static int
+ngx_http_lua_shrbtree_upper_bound(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_bound(L, NGX_HTTP_LUA_SHRBTREE_GT);
+}
+
+
+static int
+ngx_http_lua_shrbtree_bound(lua_State *L, ngx_uint_t op)
+{
+    ngx_int_t                      n;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx, *shard;
+    ngx_http_lua_shrbtree_bound_t  bound;
+
+    /* [{zone}, {key, [cmpf]}] */
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2 /* narg */);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &bound.cmp);
+    luaL_argcheck(L, 1 == n, 2, "expected key");
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &bound.cmp);
+
+    ngx_http_lua_shrbtree_luaL_checkordered(L, ctx);
+    shard = ngx_http_lua_shrbtree_luaL_route(L, ctx, &bound.cmp);
+
+    bound.op = op;
+    bound.edge = 0;
+
+    /* if the key's shard has none, the nearest node of the next shards */
+    for ( ;; ) {
+        n = ngx_http_lua_shrbtree_read(L, shard,
+                                       ngx_http_lua_shrbtree_bound_handler,
+                                       &bound);
+        if (!lua_isnil(L, -n)) {
+            return n;
+        }
+
+        if (NGX_HTTP_LUA_SHRBTREE_LE == op || NGX_HTTP_LUA_SHRBTREE_LT == op) {
+            if (shard == &ctx->shards[0]) {
+                return n;
+            }
+
+            shard--;
+
+        } else {
+            if (shard == &ctx->shards[ctx->nshards - 1]) {
+                return n;
+            }
+
+            shard++;
+        }
+
+        lua_pop(L, n);
+        bound.edge = 1;
+    }
+}
+
+
+/* pushes the key and value of the bound node */
+static int
+ngx_http_lua_shrbtree_bound_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_bound_t  *bound = data;
+
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+
+    if (bound->edge) {
+        node = (NGX_HTTP_LUA_SHRBTREE_LE == bound->op
+                || NGX_HTTP_LUA_SHRBTREE_LT == bound->op)
+               ? ngx_http_lua_shrbtree_last(&ctx->sh->rbtree)
+               : ngx_http_lua_shrbtree_first(&ctx->sh->rbtree);
+
+    } else {
+        node = ngx_http_lua_shrbtree_get_bound(L, &ctx->sh->rbtree,
+                                               &bound->cmp, bound->op);
+        if (NGX_OK != bound->cmp.rc) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* expired nodes are skipped until they're swept */
+    while (NULL != node && ngx_http_lua_shrbtree_expired(node)) {
+        node = (NGX_HTTP_LUA_SHRBTREE_LE == bound->op
+                || NGX_HTTP_LUA_SHRBTREE_LT == bound->op)
+               ? ngx_http_lua_shrbtree_prev(&ctx->sh->rbtree, node)
+               : ngx_http_lua_shrbtree_next(&ctx->sh->rbtree, node);
+    }
+
+    if (NULL == node) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "no exists");
+        return 2;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
+                                     srbtn->klen);
+    ngx_http_lua_shrbtree_pushlvalue(L, (&srbtn->data) + srbtn->klen,
+                                     srbtn->vtype, srbtn->vlen);
+    return 2;
+}
+
+
+/* rank{key, [cmpf]}: the number of keys before the key */
+static int
+ngx_http_lua_shrbtree_rank(lua_State *L)
+{
+    ngx_int_t                      n;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_rank_t   rank;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &rank.cmp);
+    luaL_argcheck(L, 1 == n, 2, "expected key");
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &rank.cmp);
+
+    ngx_http_lua_shrbtree_luaL_checkrank(L, ctx);
+
+    rank.op = NGX_HTTP_LUA_SHRBTREE_LT;
+
+    lua_pushnumber(L, (lua_Number)
+                   ngx_http_lua_shrbtree_count_before(L, ctx, &rank));
+    return 1;
+}
+
+
+/* count{lo, hi, [cmpf]}: the number of keys from lo to hi */
+static int
+ngx_http_lua_shrbtree_count(lua_State *L)
+{
+    ngx_int_t                      n;
+    ngx_uint_t                     lo, hi;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_rank_t   rank;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &rank.cmp);
+    luaL_argcheck(L, 2 == n, 2, "expected lo and hi keys");
+
+    ngx_http_lua_shrbtree_luaL_checkrank(L, ctx);
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &rank.cmp);
+
+    rank.op = NGX_HTTP_LUA_SHRBTREE_LT;
+    lo = ngx_http_lua_shrbtree_count_before(L, ctx, &rank);
+
+    lua_rawgeti(L, 2, 2);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &rank.cmp);
+
+    rank.op = NGX_HTTP_LUA_SHRBTREE_LE;
+    hi = ngx_http_lua_shrbtree_count_before(L, ctx, &rank);
+
+    lua_pushnumber(L, (lua_Number) (hi > lo ? hi - lo : 0));
+    return 1;
+}
+
+
+/* select{k}: the key and value of the kth key, from 1 */
+static int
+ngx_http_lua_shrbtree_select(lua_State *L)
+{
+    lua_Number                     k;
+    ngx_uint_t                     i;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_rank_t   rank;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+    luaL_argcheck(L, 1 == lua_objlen(L, 2), 2, "expected k");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    lua_rawgeti(L, 2, 1);
+    k = lua_tonumber(L, -1);
+    luaL_argcheck(L, lua_isnumber(L, -1) && 1 <= k, 2, "bad k");
+    lua_pop(L, 1);
+
+    ngx_http_lua_shrbtree_luaL_checkrank(L, ctx);
+
+    rank.k = (ngx_uint_t) k;
+
+    /* the shards in order, each not atomically with the others */
+    for (i = 0; i < ctx->nshards; i++) {
+        rank.all = 1;
+        (void) ngx_http_lua_shrbtree_read(L, &ctx->shards[i],
+                                          ngx_http_lua_shrbtree_rank_handler,
+                                          &rank);
+
+        if (rank.k > rank.n) {
+            rank.k -= rank.n;
+            continue;
+        }
+
+        return ngx_http_lua_shrbtree_read(L, &ctx->shards[i],
+                                          ngx_http_lua_shrbtree_select_handler,
+                                          &rank);
+    }
+
+    lua_pushnil(L);
+    lua_pushliteral(L, "no exists");
+    return 2;
+}
+
+
+/* the keys before the probe, or up to it with LE, in all the shards */
+static ngx_uint_t
+ngx_http_lua_shrbtree_count_before(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_rank_t *rank)
+{
+    ngx_uint_t                     n;
+    ngx_http_lua_shrbtree_ctx_t    *shard, *last;
+
+    last = ngx_http_lua_shrbtree_luaL_route(L, ctx, &rank->cmp);
+    n = 0;
+
+    rank->all = 1;
+
+    for (shard = &ctx->shards[0]; shard != last; shard++) {
+        (void) ngx_http_lua_shrbtree_read(L, shard,
+                                          ngx_http_lua_shrbtree_rank_handler,
+                                          rank);
+        n += rank->n;
+    }
+
+    rank->all = 0;
+
+    (void) ngx_http_lua_shrbtree_read(L, last,
+                                      ngx_http_lua_shrbtree_rank_handler,
+                                      rank);
+
+    return n + rank->n;
+}
+
+
+static void
+ngx_http_lua_shrbtree_luaL_checkrank(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_http_lua_shrbtree_luaL_checkordered(L, ctx);
+
+    if (!ctx->rank) {
+        luaL_error(L, "rank lookups need the zone with rank=on");
+    }
+}
+
+
+/* counts the keys of the shard before the probe, or up to it */
+static int
+ngx_http_lua_shrbtree_rank_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_rank_t   *rank = data;
+
+    ngx_int_t                      rc;
+    ngx_uint_t                     depth;
+    ngx_rbtree_t                   *rbtree;
+    ngx_rbtree_node_t              *node, *sentinel;
+
+    rbtree = &ctx->sh->rbtree;
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    rank->n = 0;
+
+    if (rank->all) {
+        rank->n = ngx_http_lua_shrbtree_size(rbtree, node);
+        return 0;
+    }
+
+    for (depth = 0; node != sentinel; depth++) {
+
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            return 0;
+        }
+
+        rc = ngx_http_lua_shrbtree_compare(L, &rank->cmp, node);
+        if (NGX_OK != rank->cmp.rc) {
+            return NGX_ERROR;
+        }
+
+        if (0 < rc || (0 == rc && NGX_HTTP_LUA_SHRBTREE_LE == rank->op)) {
+            rank->n += ngx_http_lua_shrbtree_size(rbtree, node->left) + 1;
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+    }
+
+    return 0;
+}
+
+
+/* pushes the key and value of the kth node of the shard */
+static int
+ngx_http_lua_shrbtree_select_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_rank_t   *rank = data;
+
+    ngx_uint_t                     k, n, depth;
+    ngx_rbtree_t                   *rbtree;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+
+    rbtree = &ctx->sh->rbtree;
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+    k = rank->k;
+
+    for (depth = 0; node != sentinel; depth++) {
+
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            break;
+        }
+
+        n = ngx_http_lua_shrbtree_size(rbtree, node->left);
+
+        if (k <= n) {
+            node = node->left;
+            continue;
+        }
+
+        if (k == n + 1) {
+            srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+            ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
+                                             srbtn->klen);
+            ngx_http_lua_shrbtree_pushlvalue(L, (&srbtn->data) + srbtn->klen,
+                                             srbtn->vtype, srbtn->vlen);
+            return 2;
+        }
+
+        k -= n + 1;
+        node = node->right;
+    }
+
+    lua_pushnil(L);
+    lua_pushliteral(L, "no exists");
+    return 2;
+}
+
+
+/*
+ * get_by{index, value, [limit]} returns the keys and values arrays of the
+ * nodes whose values have the field of the index equal to value, in no
+ * particular order.  The indexes are read under the lock of each shard.
+ */
+static int
+ngx_http_lua_shrbtree_get_by(lua_State *L)
+{
+    int                              keys, values;
+    size_t                           len, vlen;
+    ngx_int_t                        n;
+    ngx_str_t                       *name;
+    ngx_uint_t                       i, count, limit;
+    lua_Number                       num;
+    const char                      *index;
+    ngx_shm_zone_t                  *zone;
+    ngx_rbtree_t                    *rbtree;
+    ngx_rbtree_node_t               *node, *found, *sentinel;
+    ngx_http_lua_shrbtree_ctx_t     *ctx, *shard;
+    ngx_http_lua_shrbtree_node_t    *srbtn;
+    ngx_http_lua_shrbtree_ientry_t  *entry;
+
+    u_char value[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char *vdata, vtype;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = lua_objlen(L, 2);
+    luaL_argcheck(L, 2 == n || 3 == n, 2,
+                  "expected index, value and optional limit");
+
+    limit = 0;
+
+    if (3 == n) {
+        lua_rawgeti(L, 2, 3);
+        num = lua_tonumber(L, -1);
+        luaL_argcheck(L, lua_isnumber(L, -1) && 1 <= num, 2, "bad limit");
+        limit = (ngx_uint_t) num;
+        lua_pop(L, 1);
+    }
+
+    lua_rawgeti(L, 2, 1);
+    index = lua_tolstring(L, -1, &len);
+    luaL_argcheck(L, LUA_TSTRING == lua_type(L, -1), 2, "bad index");
+
+    name = ctx->indexes ? ctx->indexes->elts : NULL;
+
+    for (i = 0; NULL != name && i < ctx->indexes->nelts; i++) {
+        if (name[i].len == len && ngx_memcmp(name[i].data, index, len) == 0) {
+            break;
+        }
+    }
+
+    if (NULL == name || i == ctx->indexes->nelts) {
+        return luaL_argerror(L, 2, "no such index");
+    }
+
+    lua_rawgeti(L, 2, 2);
+    n = lua_type(L, -1);
+    luaL_argcheck(L, LUA_TSTRING == n || LUA_TNUMBER == n
+                  || LUA_TBOOLEAN == n, 2, "bad value");
+
+    /* a string stays referenced by the arguments table */
+    vdata = &value[0];
+    ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &vdata, &vtype, &vlen, 0);
+
+    lua_newtable(L);
+    keys = lua_gettop(L);
+    lua_newtable(L);
+    values = lua_gettop(L);
+
+    count = 0;
+
+    for (n = 0;
+         (ngx_uint_t) n < ctx->nshards && (0 == limit || count < limit);
+         n++)
+    {
+        shard = &ctx->shards[n];
+
+        ngx_http_lua_shrbtree_lock(shard);
+
+        rbtree = &shard->sh->indexes[i];
+        sentinel = rbtree->sentinel;
+
+        /* the first entry of the value */
+        found = NULL;
+
+        for (node = rbtree->root; node != sentinel; /* void */ ) {
+            entry = (ngx_http_lua_shrbtree_ientry_t *) node;
+
+            if (0 < ngx_http_lua_shrbtree_index_cmp(vtype, vdata, vlen,
+                                                    entry->field))
+            {
+                node = node->right;
+                continue;
+            }
+
+            found = node;
+            node = node->left;
+        }
+
+        for (node = found; NULL != node && (0 == limit || count < limit);
+             node = ngx_http_lua_shrbtree_next(rbtree, node))
+        {
+            entry = (ngx_http_lua_shrbtree_ientry_t *) node;
+
+            if (0 != ngx_http_lua_shrbtree_index_cmp(vtype, vdata, vlen,
+                                                     entry->field))
+            {
+                break;
+            }
+
+            if (ngx_http_lua_shrbtree_expired(entry->primary)) {
+                continue;
+            }
+
+            srbtn = (ngx_http_lua_shrbtree_node_t *) &entry->primary->data;
+
+            ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
+                                             srbtn->klen);
+            lua_rawseti(L, keys, ++count);
+            ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data + srbtn->klen,
+                                             srbtn->vtype, srbtn->vlen);
+            lua_rawseti(L, values, count);
+        }
+
+        ngx_http_lua_shrbtree_unlock(shard);
+    }
+
+    return 2;
+}
+
+
+/* range{lo, hi, [cmpf], [limit]} */
+static int
+ngx_http_lua_shrbtree_range(lua_State *L)
+{
+    int                            n;
+    lua_Number                     limit;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_range_t  range;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = lua_objlen(L, 2);
+    range.limit = 0;
+
+    if (3 <= n) {
+        lua_rawgeti(L, 2, n);
+        if (LUA_TNUMBER == lua_type(L, -1)) {
+            limit = lua_tonumber(L, -1);
+            luaL_argcheck(L, 1 <= limit, 2, "bad limit");
+            range.limit = (ngx_uint_t) limit;
+            n--;
+        }
+
+        lua_pop(L, 1);
+    }
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, n, ctx, &range.lo);
+    luaL_argcheck(L, 2 == n, 2, "expected lo and hi keys");
+
+    range.hi = range.lo;
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &range.lo);
+    lua_rawgeti(L, 2, 2);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &range.hi);
+
+    range.op = NGX_HTTP_LUA_SHRBTREE_GE;
+    range.first = 0;
+    range.last = 0;
+
+    ngx_http_lua_shrbtree_luaL_checkordered(L, ctx);
+
+    return ngx_http_lua_shrbtree_read_range(L, ctx, &range);
+}
+
+
+/* pushes the keys and values arrays of the range, read shard by shard */
+static int
+ngx_http_lua_shrbtree_read_range(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_range_t *range)
+{
+    ngx_uint_t                   i;
+    ngx_http_lua_shrbtree_ctx_t  *shard, *last;
+
+    shard = range->first ? &ctx->shards[0]
+                         : ngx_http_lua_shrbtree_luaL_route(L, ctx, &range->lo);
+    last = range->last ? &ctx->shards[ctx->nshards - 1]
+                       : ngx_http_lua_shrbtree_luaL_route(L, ctx, &range->hi);
+
+    lua_newtable(L);
+    range->keys = lua_gettop(L);
+    lua_newtable(L);
+    range->values = lua_gettop(L);
+
+    range->n = 0;
+    range->max = 0;
+
+    for ( /* void */ ; shard <= last
+                        && (0 == range->limit || range->n < range->limit);
+         shard++)
+    {
+        ngx_http_lua_shrbtree_read(L, shard,
+                                   ngx_http_lua_shrbtree_range_handler, range);
+
+        range->n = range->count;
+        range->first = 1; /* the next shards from their first nodes */
+    }
+
+    /* set by failed reads */
+    for (i = range->n; i < range->max; i++) {
+        lua_pushnil(L);
+        lua_rawseti(L, range->keys, i + 1);
+        lua_pushnil(L);
+        lua_rawseti(L, range->values, i + 1);
+    }
+
+    return 2;
+}
+
+
+/* appends the nodes of the shard to the keys and values arrays */
+static int
+ngx_http_lua_shrbtree_range_handler(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, void *data)
+{
+    ngx_http_lua_shrbtree_range_t  *range = data;
+
+    ngx_int_t                      rc;
+    ngx_uint_t                     n;
+    ngx_rbtree_t                   *rbtree;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+
+    rbtree = &ctx->sh->rbtree;
+
+    if (range->first) {
+        node = ngx_http_lua_shrbtree_first(rbtree);
+
+    } else {
+        node = ngx_http_lua_shrbtree_get_bound(L, rbtree, &range->lo,
+                                               range->op);
+        if (NGX_OK != range->lo.rc) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = range->n;
+
+    while (NULL != node && (0 == range->limit || n < range->limit)) {
+
+        if (!range->last) {
+            rc = ngx_http_lua_shrbtree_compare(L, &range->hi, node);
+            if (NGX_OK != range->hi.rc) {
+                return NGX_ERROR;
+            }
+
+            if (0 > rc) {
+                break;
+            }
+        }
+
+        /* expired nodes are skipped until they're swept */
+        if (!ngx_http_lua_shrbtree_expired(node)) {
+            srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+            n++;
+            ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
+                                             srbtn->klen);
+            lua_rawseti(L, range->keys, n);
+            ngx_http_lua_shrbtree_pushlvalue(L, (&srbtn->data) + srbtn->klen,
+                                             srbtn->vtype, srbtn->vlen);
+            lua_rawseti(L, range->values, n);
+        }
+
+        node = ngx_http_lua_shrbtree_next(rbtree, node);
+    }
+
+    range->count = n;
+    range->max = ngx_max(range->max, n);
+
+    return 0;
+}
+
+
+/*
+ * iter{[start_key], [cmpf]} returns a cursor, whose next([count]) returns
+ * the keys and values arrays of the following count nodes, or nil at the
+ * end.  The cursor resumes after the last returned key, so it's not upset
+ * by writers between the batches.
+ */
+static int
+ngx_http_lua_shrbtree_iter(lua_State *L)
+{
+    int                          n, nargs;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_http_lua_shrbtree_cmp_t  cmp;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    nargs = lua_objlen(L, 2);
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, nargs, ctx, &cmp);
+    luaL_argcheck(L, 0 == n || 1 == n, 2, "expected optional start key");
+
+    lua_createtable(L, 0 /* narr */, 5 /* nrec */); /* cursor */
+
+    lua_pushlightuserdata(L, zone);
+    lua_setfield(L, -2, "zone");
+
+    if (n != nargs) {
+        lua_rawgeti(L, 2, nargs);
+        lua_setfield(L, -2, "cmp");
+    }
+
+    if (1 == n) {
+        lua_rawgeti(L, 2, 1);
+        ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &cmp);
+        lua_setfield(L, -2, "key");
+    }
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shrbtree_cursor_next(lua_State *L)
+{
+    int                            n;
+    lua_Number                     count;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_range_t  range;
+
+    n = lua_gettop(L);
+    luaL_argcheck(L, 1 == n || 2 == n, n, "expected 0 or 1 argument");
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    count = luaL_optnumber(L, 2, NGX_HTTP_LUA_SHRBTREE_ITER_COUNT);
+    luaL_argcheck(L, 1 <= count, 2, "bad count");
+
+    lua_settop(L, 1);
+
+    lua_getfield(L, 1, "done");
+    if (lua_toboolean(L, -1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_getfield(L, 1, "zone");
+    zone = lua_touserdata(L, -1);
+    if (zone == NULL) {
+        return luaL_argerror(L, 1, "excpected cursor");
+    }
+
+    ctx = zone->data;
+
+    range.lo.type = ctx->cmp;
+    range.lo.index = 0;
+    range.lo.rc = NGX_OK;
+
+    lua_getfield(L, 1, "cmp");
+    if (lua_isfunction(L, -1)) {
+        range.lo.type = NGX_HTTP_LUA_SHRBTREE_CMP_LUA;
+        range.lo.index = lua_gettop(L);
+
+    } else if (lua_islightuserdata(L, -1)) {
+        range.lo.type = ngx_http_lua_shrbtree_cmp_tag(L, -1);
+    }
+
+    lua_getfield(L, 1, "started");
+    range.op = lua_toboolean(L, -1) ? NGX_HTTP_LUA_SHRBTREE_GT
+                                    : NGX_HTTP_LUA_SHRBTREE_GE;
+
+    lua_getfield(L, 1, "key");
+    range.first = lua_isnil(L, -1);
+    if (!range.first) {
+        ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &range.lo);
+    }
+
+    range.last = 1;
+    range.limit = (ngx_uint_t) count;
+
+    ngx_http_lua_shrbtree_luaL_checkordered(L, ctx);
+    ngx_http_lua_shrbtree_read_range(L, ctx, &range);
+
+    n = range.n;
+
+    if ((ngx_uint_t) n < range.limit) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, 1, "done");
+    }
+
+    if (0 == n) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_rawgeti(L, -2, n);
+    lua_setfield(L, 1, "key");
+    lua_pushboolean(L, 1);
+    lua_setfield(L, 1, "started");
+
+    return 2;
+}
+
+
+/*
+ * runs the handler without the zone lock: the handler only reads the tree
+ * and pushes its results, which are dropped and redone if a writer changed
+ * the tree meanwhile.  Nodes unlinked by writers are freed only after such
+ * readers are done, see ngx_http_lua_shrbtree_reclaim().  After some retries
+ * the handler is run with the lock held.  An error raised by the handler is
+ * raised again once the read is ended or the lock released.
+ */
+static int
+ngx_http_lua_shrbtree_read(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_read_pt handler, void *data)
+{
+    int                            n, top;
+    ngx_uint_t                     tries, slot;
+    ngx_atomic_uint_t              seq;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+
+    sh = ctx->sh;
+    top = lua_gettop(L);
+
+    /* for the arguments of pcall */
+    luaL_checkstack(L, top + 2, "too many arguments");
+
+    for (tries = 0; tries < NGX_HTTP_LUA_SHRBTREE_READ_TRIES; tries++) {
+        slot = ngx_http_lua_shrbtree_read_begin(sh, &seq);
+
+        n = (seq & 1) ? 0 : ngx_http_lua_shrbtree_pcall(L, ctx, handler, data);
+
+        if (NGX_OK == ngx_http_lua_shrbtree_read_end(sh, slot, seq)) {
+            if (NGX_ERROR == n) {
+                return lua_error(L);
+            }
+
+            return n;
+        }
+
+        lua_settop(L, top);
+        ngx_cpu_pause();
+    }
+
+    ngx_http_lua_shrbtree_lock(ctx);
+    n = ngx_http_lua_shrbtree_pcall(L, ctx, handler, data);
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    if (NGX_ERROR == n) {
+        return lua_error(L);
+    }
+
+    return n;
+}
+
+
+/*
+ * runs the handler in a protected call.  The stack is passed as the
+ * arguments, so that the handler finds its values at the same indexes, and
+ * the results are left above it.  Returns the number of the results, or
+ * NGX_ERROR with the error at the top.
+ */
+static int
+ngx_http_lua_shrbtree_pcall(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_read_pt handler, void *data)
+{
+    int                            i, top;
+    ngx_http_lua_shrbtree_call_t   call;
+
+    top = lua_gettop(L);
+
+    call.handler = handler;
+    call.ctx = ctx;
+    call.data = data;
+
+    lua_pushcfunction(L, ngx_http_lua_shrbtree_call);
+
+    for (i = 1; i <= top; i++) {
+        lua_pushvalue(L, i);
+    }
+
+    lua_pushlightuserdata(L, &call);
+
+    if (0 != lua_pcall(L, top + 1, LUA_MULTRET, 0)) {
+        return NGX_ERROR;
+    }
+
+    return lua_gettop(L) - top;
+}
+
+
+static int
+ngx_http_lua_shrbtree_call(lua_State *L)
+{
+    int                            n;
+    ngx_http_lua_shrbtree_call_t  *call;
+
+    call = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    n = call->handler(L, call->ctx, call->data);
+    if (NGX_ERROR == n) {
+        return lua_error(L);
+    }
+
+    return n;
+}
+
+
+/*
+ * the reader is counted in the slot of the epoch it saw, unless the epoch
+ * flipped meanwhile: reclaim may have checked that slot already
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_read_begin(ngx_http_lua_shrbtree_shctx_t *sh,
+    ngx_atomic_uint_t *seq)
+{
+    ngx_uint_t         slot;
+    ngx_atomic_uint_t  epoch;
+
+    for ( ;; ) {
+        epoch = sh->epoch;
+        slot = epoch & 1;
+
+        ngx_atomic_fetch_add(&sh->readers[slot], 1);
+        ngx_memory_barrier();
+
+        if (sh->epoch == epoch) {
+            break;
+        }
+
+        ngx_atomic_fetch_add(&sh->readers[slot], -1);
+    }
+
+    *seq = sh->seq;
+    ngx_memory_barrier();
+
+    return slot;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shrbtree_read_end(ngx_http_lua_shrbtree_shctx_t *sh,
+    ngx_uint_t slot, ngx_atomic_uint_t seq)
+{
+    ngx_int_t rc;
+
+    ngx_memory_barrier();
+    rc = (sh->seq == seq && !(seq & 1)) ? NGX_OK : NGX_AGAIN;
+
+    ngx_atomic_fetch_add(&sh->readers[slot], -1);
+
+    return rc;
+}
+
+
+/*
+ * counts a view or snapshot that is to hold a reader slot past the call,
+ * which blocks the reclaim of the shard until unpin
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_pin(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    if (ngx_atomic_fetch_add(&sh->pinned, 1)
+        >= NGX_HTTP_LUA_SHRBTREE_MAX_PINNED)
+    {
+        ngx_atomic_fetch_add(&sh->pinned, -1);
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_shrbtree_unpin(ngx_http_lua_shrbtree_shctx_t *sh,
+    ngx_uint_t slot)
+{
+    ngx_atomic_fetch_add(&sh->readers[slot], -1);
+    ngx_atomic_fetch_add(&sh->pinned, -1);
+}
+
+
+/* counts a snapshot, which keeps the trees replaced since from drain */
+static ngx_int_t
+ngx_http_lua_shrbtree_hold(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    if (NGX_OK != ngx_http_lua_shrbtree_pin(sh)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_atomic_fetch_add(&sh->snapshots, 1);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_shrbtree_unhold(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    ngx_atomic_fetch_add(&sh->snapshots, -1);
+    ngx_atomic_fetch_add(&sh->pinned, -1);
+}
+
+
+/* with stats=on, the wait for the lock and its hold are timed */
+static void
+ngx_http_lua_shrbtree_lock(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    uint64_t                           start, now;
+    ngx_http_lua_shrbtree_counters_t  *c;
+
+    if (!ctx->stats) {
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+        return;
+    }
+
+    start = ngx_http_lua_shrbtree_usec();
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+    now = ngx_http_lua_shrbtree_usec();
+
+    c = &ctx->sh->counters;
+    c->lock_wait[ngx_http_lua_shrbtree_hist(now - start)]++;
+    c->locked = now;
+}
+
+
+static void
+ngx_http_lua_shrbtree_unlock(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_http_lua_shrbtree_counters_t  *c;
+
+    if (ctx->stats) {
+        c = &ctx->sh->counters;
+        c->lock_hold[ngx_http_lua_shrbtree_hist(ngx_http_lua_shrbtree_usec()
+                                                - c->locked)]++;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static uint64_t
+ngx_http_lua_shrbtree_usec(void)
+{
+#if (NGX_HAVE_CLOCK_MONOTONIC)
+    struct timespec  ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+
+/* the bucket of the time, 0 for under 1 microsecond */
+static ngx_uint_t
+ngx_http_lua_shrbtree_hist(uint64_t usec)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; usec && i < NGX_HTTP_LUA_SHRBTREE_HIST - 1; i++) {
+        usec >>= 1;
+    }
+
+    return i;
+}
+
+
+/* counts a lookup of a read handler, a retried one again */
+static void
+ngx_http_lua_shrbtree_stat_read(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t *node)
+{
+    ngx_atomic_uint_t                  max;
+    ngx_http_lua_shrbtree_counters_t  *c;
+
+    if (!ctx->stats) {
+        return;
+    }
+
+    c = &ctx->sh->counters;
+
+    (void) ngx_atomic_fetch_add(&c->reads, 1);
+    (void) ngx_atomic_fetch_add(&c->compares, cmp->compares);
+
+    if (NULL == node) {
+        (void) ngx_atomic_fetch_add(&c->read_misses, 1);
+    }
+
+    for ( ;; ) {
+        max = c->max_compares;
+
+        if (cmp->compares <= max
+            || ngx_atomic_cmp_set(&c->max_compares, max, cmp->compares))
+        {
+            break;
+        }
+    }
+
+    cmp->compares = 0;
+}
+
+
+/* writers hold the zone lock, and mark the changes of tree for readers */
+static void
+ngx_http_lua_shrbtree_write_begin(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    ngx_atomic_fetch_add(&sh->seq, 1);
+}
+
+
+static void
+ngx_http_lua_shrbtree_write_end(ngx_http_lua_shrbtree_shctx_t *sh)
+{
+    ngx_atomic_fetch_add(&sh->seq, 1);
+}
+
+
+/* the node is already unlinked from the tree */
+static void
+ngx_http_lua_shrbtree_retire(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    node->parent = ctx->sh->retired;
+    ctx->sh->retired = node;
+}
+
+
+/*
+ * builds the btree of the sorted nodes of an engine=btree zone, in the
+ * locked shard; NULL if the keys aren't ascending numbers or there's no
+ * memory, then lookups descend the tree
+ */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_btree_build(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_uint_t n)
+{
+    u_char                         *p;
+    size_t                          size;
+    ngx_uint_t                      i, j, k, t, c, height, span;
+    ngx_uint_t                      nblocks[NGX_HTTP_LUA_SHRBTREE_BTREE_HEIGHT];
+    lua_Number                     *keys;
+    lua_Number                      key[NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE];
+    ngx_rbtree_node_t              *holder;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+    ngx_http_lua_shrbtree_btree_t  *bt;
+
+    const ngx_uint_t  B = NGX_HTTP_LUA_SHRBTREE_BTREE_B;
+
+    if (!ctx->btree || 0 == n) {
+        return NULL;
+    }
+
+    nblocks[0] = (n + B - 1) / B;
+    size = nblocks[0] * B * sizeof(lua_Number);
+
+    for (height = 1; nblocks[height - 1] > 1; height++) {
+        if (NGX_HTTP_LUA_SHRBTREE_BTREE_HEIGHT == height) {
+            return NULL;
+        }
+
+        nblocks[height] = (nblocks[height - 1] + B) / (B + 1);
+        size += nblocks[height] * B * sizeof(lua_Number);
+    }
+
+    size += offsetof(ngx_http_lua_shrbtree_node_t, data) + ngx_cacheline_size
+            + ngx_align(sizeof(ngx_http_lua_shrbtree_btree_t),
+                        ngx_cacheline_size)
+            + n * sizeof(ngx_rbtree_node_t *);
+
+    holder = ngx_http_lua_shrbtree_alloc_node(ctx, size, 0, 0);
+    if (NULL == holder) {
+        return NULL;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *) &holder->data;
+    srbtn->ktype = LUA_TNIL;
+    srbtn->vtype = LUA_TNIL;
+    srbtn->klen = 0;
+    srbtn->vlen = 0;
+
+    bt = ngx_http_lua_shrbtree_btree(holder);
+    p = (u_char *) bt + ngx_align(sizeof(ngx_http_lua_shrbtree_btree_t),
+                                  ngx_cacheline_size);
+
+    bt->n = n;
+    bt->height = height;
+
+    for (k = 0; k < height; k++) {
+        bt->layer[k] = (lua_Number *) p;
+        bt->nblocks[k] = nblocks[k];
+        p += nblocks[k] * B * sizeof(lua_Number);
+    }
+
+    bt->nodes = (ngx_rbtree_node_t **) p;
+
+    keys = bt->layer[0];
+
+    for (i = 0; i < nblocks[0] * B; i++) {
+        if (i >= n) {
+            keys[i] = HUGE_VAL;
+            continue;
+        }
+
+        srbtn = (ngx_http_lua_shrbtree_node_t *) &nodes[i]->data;
+
+        /* loaded by a lua compare, or overlapping intervals */
+        if (0 == ngx_http_lua_shrbtree_tuple(srbtn, key, 1)
+            || (i > 0 && key[0] <= keys[i - 1]))
+        {
+            ngx_slab_free_locked(ctx->shpool,
+                                 ngx_http_lua_shrbtree_node_head(ctx, holder));
+            return NULL;
+        }
+
+        keys[i] = key[0];
+        bt->nodes[i] = nodes[i];
+    }
+
+    /* span is of the leaf blocks under a block of the layer below */
+    for (k = 1, span = 1; k < height; k++, span *= B + 1) {
+        for (j = 0; j < nblocks[k]; j++) {
+            for (t = 0; t < B; t++) {
+                c = j * (B + 1) + t + 1;
+
+                bt->layer[k][j * B + t] = (c < nblocks[k - 1])
+                                          ? keys[c * span * B] : HUGE_VAL;
+            }
+        }
+    }
+
+    return holder;
+}
+
+
+/* the tree changes, and the btree isn't of it anymore */
+static void
+ngx_http_lua_shrbtree_btree_drop(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    if (NULL != ctx->sh->btree) {
+        ngx_http_lua_shrbtree_retire(ctx, ctx->sh->btree);
+        ctx->sh->btree = NULL;
+    }
+}
+
+
+/*
+ * builds the btree dropped by writes again, in the locked shard, once it
+ * wasn't written for a sweep interval.  It's tried once per version of the
+ * tree, as the keys may not be ascending numbers.  The btree is published
+ * without a write: the lookups by it and by the tree find the same nodes.
+ */
+static void
+ngx_http_lua_shrbtree_btree_rebuild(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_uint_t                      n, i;
+    ngx_rbtree_node_t              *node, *btree, **nodes;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+
+    sh = ctx->sh;
+
+    if (!ctx->btree || NULL != sh->btree || sh->seq == sh->btree_tried) {
+        return;
+    }
+
+    if (sh->seq != sh->btree_seen) {
+        sh->btree_seen = sh->seq;
+        return;
+    }
+
+    sh->btree_tried = sh->seq;
+
+    n = sh->counters.nodes;
+    if (0 == n) {
+        return;
+    }
+
+    nodes = ngx_alloc(n * sizeof(ngx_rbtree_node_t *), ngx_cycle->log);
+    if (NULL == nodes) {
+        return;
+    }
+
+    i = 0;
+
+    for (node = ngx_http_lua_shrbtree_first(&sh->rbtree);
+         NULL != node && i < n;
+         node = ngx_http_lua_shrbtree_next(&sh->rbtree, node))
+    {
+        nodes[i++] = node;
+    }
+
+    /* the count is off, the btree must have all the nodes */
+    btree = (NULL == node) ? ngx_http_lua_shrbtree_btree_build(ctx, nodes, i)
+                           : NULL;
+
+    ngx_free(nodes);
+
+    if (NULL != btree) {
+        ngx_memory_barrier();
+        sh->btree = btree;
+    }
+}
+
+
+static ngx_http_lua_shrbtree_btree_t *
+ngx_http_lua_shrbtree_btree(ngx_rbtree_node_t *holder)
+{
+    return (ngx_http_lua_shrbtree_btree_t *)
+           ngx_align_ptr(&((ngx_http_lua_shrbtree_node_t *) &holder->data)
+                         ->data, ngx_cacheline_size);
+}
+
+
+/* the index of the greatest key not after x, -1 if none */
+static ngx_int_t
+ngx_http_lua_shrbtree_btree_floor(ngx_http_lua_shrbtree_btree_t *bt,
+    lua_Number x)
+{
+    ngx_uint_t   k, t, c, blk, i;
+    lua_Number  *keys;
+
+    const ngx_uint_t  B = NGX_HTTP_LUA_SHRBTREE_BTREE_B;
+
+    blk = 0;
+
+    for (k = bt->height - 1; k > 0; k--) {
+        keys = bt->layer[k] + blk * B;
+
+        for (c = 0, t = 0; t < B; t++) {
+            c += (keys[t] <= x);
+        }
+
+        blk = blk * (B + 1) + c;
+
+        /* x is infinite */
+        if (blk >= bt->nblocks[k - 1]) {
+            blk = bt->nblocks[k - 1] - 1;
+        }
+    }
+
+    keys = bt->layer[0] + blk * B;
+
+    for (c = 0, t = 0; t < B; t++) {
+        c += (keys[t] <= x);
+    }
+
+    i = ngx_min(blk * B + c, bt->n);
+
+    return (ngx_int_t) i - 1;
+}
+
+
+/*
+ * the node of the key, by the btree if the zone has one and the key is of
+ * its builtin compare.  A point is in the interval of the floor; a range may
+ * overlap the interval after it instead.
+ */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_find(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    ngx_int_t                       i, rc;
+    ngx_uint_t                      tries;
+    ngx_rbtree_node_t              *holder;
+    ngx_http_lua_shrbtree_btree_t  *bt;
+
+    holder = ctx->sh->btree;
+
+    if (NULL == holder || cmp->type != ctx->cmp) {
+        return ngx_http_lua_shrbtree_get_node(L, &ctx->sh->rbtree, cmp);
+    }
+
+    bt = ngx_http_lua_shrbtree_btree(holder);
+
+    i = ngx_max(ngx_http_lua_shrbtree_btree_floor(bt, cmp->key[0]), 0);
+
+    for (tries = 0; tries < 2 && (ngx_uint_t) i < bt->n; tries++, i++) {
+        rc = ngx_http_lua_shrbtree_compare(L, cmp, bt->nodes[i]);
+
+        if (0 == rc) {
+            return bt->nodes[i];
+        }
+
+        if (0 > rc) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* unlinks the node and its timer, lockless readers may still read it */
+static void
+ngx_http_lua_shrbtree_unlink(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_key_t    expires;
+    ngx_rbtree_node_t  *subst, *sentinel, *lowest;
+
+    expires = node->key;
+
+    ngx_http_lua_shrbtree_detach(ctx, node);
+
+    /* the lowest node whose subtree loses a node */
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    if (node->left == sentinel || node->right == sentinel) {
+        lowest = node->parent;
+
+    } else {
+        subst = ngx_rbtree_min(node->right, sentinel);
+        lowest = (subst->parent == node) ? subst : subst->parent;
+    }
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+    ngx_http_lua_shrbtree_btree_drop(ctx);
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    ngx_http_lua_shrbtree_resize(ctx, lowest);
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    ctx->sh->counters.nodes--;
+
+    /* ngx_rbtree_delete() clears it, it tells free_nodes of the timer */
+    node->key = expires;
+
+    ngx_http_lua_shrbtree_retire(ctx, node);
+}
+
+
+/* unlinks the timer, the clock entry and the index entries, see link */
+static void
+ngx_http_lua_shrbtree_detach(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_http_lua_shrbtree_index_unlink(ctx, node);
+
+    if (node->key) {
+        ngx_rbtree_delete(&ctx->sh->expiry, node - 1);
+    }
+
+    if (ctx->evict) {
+        ngx_queue_remove(
+            &((ngx_http_lua_shrbtree_clock_t *)
+              ngx_http_lua_shrbtree_node_head(ctx, node))->queue);
+    }
+}
+
+
+/*
+ * the new node takes the place and the color of the old one, which is
+ * retired; the new node is linked by link
+ */
+static void
+ngx_http_lua_shrbtree_swap(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *old, ngx_rbtree_node_t *node)
+{
+    ngx_rbtree_node_t  *sentinel;
+
+    ngx_http_lua_shrbtree_detach(ctx, old);
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    node->left = old->left;
+    node->right = old->right;
+    node->parent = old->parent;
+    ngx_rbt_copy_color(node, old);
+
+    if (ctx->rank) {
+        *ngx_http_lua_shrbtree_node_size(node) =
+            *ngx_http_lua_shrbtree_node_size(old);
+    }
+
+    /* lockless readers must see the node filled before it's linked */
+    ngx_memory_barrier();
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+    ngx_http_lua_shrbtree_btree_drop(ctx);
+
+    if (old == ctx->sh->rbtree.root) {
+        ctx->sh->rbtree.root = node;
+
+    } else if (old == old->parent->left) {
+        old->parent->left = node;
+
+    } else {
+        old->parent->right = node;
+    }
+
+    if (node->left != sentinel) {
+        node->left->parent = node;
+    }
+
+    if (node->right != sentinel) {
+        node->right->parent = node;
+    }
+
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    ngx_http_lua_shrbtree_retire(ctx, old);
+}
+
+
+/*
+ * overwrites a number or boolean value with one of the same type, when the
+ * node keeps its layout, i.e. it has a timer if and only if it expires
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_update(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node, ngx_http_lua_shrbtree_item_t *value,
+    ngx_msec_t expires)
+{
+    u_char                        type, *p;
+    ngx_rbtree_node_t            *timer;
+    ngx_http_lua_shrbtree_node_t *srbtn;
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+    type = value->type;
+
+    if (type != srbtn->vtype
+        || (LUA_TNUMBER != type && LUA_TBOOLEAN != type)
+        || (0 == node->key) != (0 == expires))
+    {
+        return NGX_DECLINED;
+    }
+
+    p = &srbtn->data + srbtn->klen;
+
+    if (expires) {
+        timer = node - 1;
+        ngx_rbtree_delete(&ctx->sh->expiry, timer);
+        timer->key = expires;
+        ngx_rbtree_insert(&ctx->sh->expiry, timer);
+    }
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+
+    ngx_memcpy(p, value->data, value->len);
+
+    node->key = expires;
+
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    return NGX_OK;
+}
+
+
+/* unlinks at most n expired nodes, NGX_AGAIN if there may be more */
+static ngx_int_t
+ngx_http_lua_shrbtree_expire(ngx_http_lua_shrbtree_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_rbtree_node_t  *timer, *sentinel;
+
+    sentinel = ctx->sh->expiry.sentinel;
+
+    while (n--) {
+        if (ctx->sh->expiry.root == sentinel) {
+            return NGX_OK;
+        }
+
+        timer = ngx_rbtree_min(ctx->sh->expiry.root, sentinel);
+
+        if ((ngx_msec_int_t) (timer->key - ngx_current_msec) > 0) {
+            return NGX_OK;
+        }
+
+        ngx_http_lua_shrbtree_unlink(ctx, timer + 1);
+        ctx->sh->counters.expired++;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_shrbtree_expired(ngx_rbtree_node_t *node)
+{
+    return node->key
+           && (ngx_msec_int_t) (node->key - ngx_current_msec) <= 0;
+}
+
+
+/* 0 means no ttl, so a time which wraps to 0 is a msec later */
+static ngx_msec_t
+ngx_http_lua_shrbtree_expires(ngx_msec_t ttl)
+{
+    ngx_msec_t  expires;
+
+    expires = ngx_current_msec + ttl;
+
+    return expires ? expires : 1;
+}
+
+
+/*
+ * the tree is already unlinked, its nodes are chained by the parent links,
+ * which lockless readers don't follow
+ */
+static void
+ngx_http_lua_shrbtree_retire_tree(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *root, ngx_rbtree_node_t *sentinel)
+{
+    ngx_uint_t         n;
+    ngx_rbtree_node_t *node;
+    ngx_rbtree_node_t *stack[NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH];
+
+    if (root == sentinel) {
+        return;
+    }
+
+    n = 0;
+    stack[n++] = root;
+
+    while (n) {
+        node = stack[--n];
+
+        if (node->left != sentinel) {
+            stack[n++] = node->left;
+        }
+
+        if (node->right != sentinel) {
+            stack[n++] = node->right;
+        }
+
+        ngx_http_lua_shrbtree_retire(ctx, node);
+    }
+}
+
+
+/*
+ * retired nodes are freed two epochs later: the retired list is moved to
+ * the reclaim list when the epoch flips, and it's freed when the readers
+ * which began in the former epoch are gone.  Readers which begin after the
+ * flip can't reach the unlinked nodes.
+ */
+static void
+ngx_http_lua_shrbtree_reclaim(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_http_lua_shrbtree_shctx_t *sh = ctx->sh;
+
+    if (NULL != sh->reclaim) {
+        if (0 != sh->readers[(sh->epoch - 1) & 1]) {
+            return;
+        }
+
+        ngx_http_lua_shrbtree_free_nodes(ctx, sh->reclaim);
+        sh->reclaim = NULL;
+    }
+
+    if (NULL == sh->retired) {
+        return;
+    }
+
+    sh->reclaim = sh->retired;
+    sh->retired = NULL;
+    ngx_atomic_fetch_add(&sh->epoch, 1);
+
+    if (0 == sh->readers[(sh->epoch - 1) & 1]) {
+        ngx_http_lua_shrbtree_free_nodes(ctx, sh->reclaim);
+        sh->reclaim = NULL;
+    }
+}
+
+
+static void
+ngx_http_lua_shrbtree_free_nodes(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_slab_pool_t              *shpool = ctx->shpool;
+    ngx_rbtree_node_t            *next;
+    ngx_http_lua_shrbtree_node_t *srbtn;
+    ngx_http_lua_shrbtree_ltable_t *ltable;
+
+    for ( /* void */ ; node; node = next) {
+        next = node->parent;
+
+        /* first free table rbtree, if the key/value is a table */
+        srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+        if (LUA_TTABLE ==  srbtn->ktype) {
+            ltable = (ngx_http_lua_shrbtree_ltable_t *)&srbtn->data;
+            ngx_http_lua_shrbtree_destroy_ltable(shpool, ltable);
+        }
+        if (LUA_TTABLE ==  srbtn->vtype) {
+            ltable = (ngx_http_lua_shrbtree_ltable_t *)((&srbtn->data)
+                                                        + srbtn->klen);
+            ngx_http_lua_shrbtree_destroy_ltable(shpool, ltable);
+        }
+
+        ngx_slab_free_locked(shpool,
+                             ngx_http_lua_shrbtree_node_head(ctx, node));
+    }
+}
+
+
+/*
+ * allocates in the locked shard.  If the zone evicts, the expired nodes and
+ * then the cold ones are unlinked for a failed allocation, and freed unless
+ * lockless readers may still read them.
+ */
+static void *
+ngx_http_lua_shrbtree_alloc(ngx_http_lua_shrbtree_ctx_t *ctx, size_t size)
+{
+    void        *p;
+    ngx_uint_t   tries;
+
+    for (tries = 0; /* void */ ; tries++) {
+        p = ngx_slab_alloc_locked(ctx->shpool, size);
+
+        if (NULL != p || !ctx->evict
+            || NGX_HTTP_LUA_SHRBTREE_EVICT_TRIES == tries
+            || ngx_queue_empty(&ctx->sh->clock))
+        {
+            return p;
+        }
+
+        if (NGX_AGAIN != ngx_http_lua_shrbtree_expire(ctx,
+                                           NGX_HTTP_LUA_SHRBTREE_EVICT_BATCH))
+        {
+            ngx_http_lua_shrbtree_evict(ctx, NGX_HTTP_LUA_SHRBTREE_EVICT_BATCH);
+        }
+
+        ngx_http_lua_shrbtree_reclaim(ctx);
+    }
+}
+
+
+/*
+ * allocates a node whose data is size bytes, with its clock entry and its
+ * timer before it, and its index entries after it; they're linked by link,
+ * after the node
+ */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_alloc_node(ngx_http_lua_shrbtree_ctx_t *ctx, size_t size,
+    ngx_msec_t expires, ngx_uint_t evict)
+{
+    u_char                         *p;
+    ngx_rbtree_node_t              *node, *timer;
+    ngx_http_lua_shrbtree_clock_t  *clock;
+
+    size += offsetof(ngx_rbtree_node_t, data);
+
+    if (ctx->indexes) {
+        size = ngx_align(size, NGX_ALIGNMENT)
+               + ctx->indexes->nelts * sizeof(ngx_http_lua_shrbtree_ientry_t);
+    }
+
+    if (expires) {
+        size += sizeof(ngx_rbtree_node_t);
+    }
+
+    if (ctx->rank) {
+        size += sizeof(ngx_uint_t);
+    }
+
+    if (ctx->evict) {
+        size += sizeof(ngx_http_lua_shrbtree_clock_t);
+    }
+
+    p = evict ? ngx_http_lua_shrbtree_alloc(ctx, size)
+              : ngx_slab_alloc_locked(ctx->shpool, size);
+    if (NULL == p) {
+        return NULL;
+    }
+
+    clock = NULL;
+
+    if (ctx->evict) {
+        clock = (ngx_http_lua_shrbtree_clock_t *) p;
+        p += sizeof(ngx_http_lua_shrbtree_clock_t);
+    }
+
+    if (ctx->rank) {
+        *(ngx_uint_t *) p = 1;
+        p += sizeof(ngx_uint_t);
+    }
+
+    if (expires) {
+        timer = (ngx_rbtree_node_t *) p;
+        timer->key = expires;
+        p += sizeof(ngx_rbtree_node_t);
+    }
+
+    node = (ngx_rbtree_node_t *) p;
+    node->key = expires;
+
+    if (NULL != clock) {
+        clock->node = node;
+        clock->referenced = 0;
+    }
+
+    return node;
+}
+
+
+static u_char *
+ngx_http_lua_shrbtree_node_head(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    u_char  *p;
+
+    p = (u_char *) node;
+
+    if (node->key) {
+        p -= sizeof(ngx_rbtree_node_t);
+    }
+
+    if (ctx->rank) {
+        p -= sizeof(ngx_uint_t);
+    }
+
+    if (ctx->evict) {
+        p -= sizeof(ngx_http_lua_shrbtree_clock_t);
+    }
+
+    return p;
+}
+
+
+/*
+ * links the timer, the clock entry and the index entries of a node linked
+ * to the tree
+ */
+static void
+ngx_http_lua_shrbtree_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_http_lua_shrbtree_clock_t  *clock;
+
+    if (node->key) {
+        ngx_rbtree_insert(&ctx->sh->expiry, node - 1);
+    }
+
+    if (ctx->evict) {
+        clock = (ngx_http_lua_shrbtree_clock_t *)
+                ngx_http_lua_shrbtree_node_head(ctx, node);
+        ngx_queue_insert_tail(&ctx->sh->clock, &clock->queue);
+    }
+
+    ngx_http_lua_shrbtree_index_link(ctx, ctx->sh->indexes, node);
+}
+
+
+static ngx_http_lua_shrbtree_ientry_t *
+ngx_http_lua_shrbtree_ientries(ngx_rbtree_node_t *node)
+{
+    ngx_http_lua_shrbtree_node_t  *srbtn;
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *) &node->data;
+
+    return (ngx_http_lua_shrbtree_ientry_t *)
+           ngx_align_ptr(&srbtn->data + srbtn->klen + srbtn->vlen,
+                         NGX_ALIGNMENT);
+}
+
+
+/*
+ * links the index entries of the node by the fields of its value, to the
+ * indexes of the shard or of its stage
+ */
+static void
+ngx_http_lua_shrbtree_index_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_t *indexes, ngx_rbtree_node_t *node)
+{
+    char                            *err;
+    u_char                          *p;
+    ngx_str_t                       *name;
+    ngx_uint_t                       i;
+    ngx_http_lua_shrbtree_node_t    *srbtn;
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
+    ngx_http_lua_shrbtree_ientry_t  *entry;
+
+    if (NULL == ctx->indexes) {
+        return;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *) &node->data;
+    entry = ngx_http_lua_shrbtree_ientries(node);
+    name = ctx->indexes->elts;
+
+    for (i = 0; i < ctx->indexes->nelts; i++, entry++) {
+        entry->primary = node;
+        entry->field = NULL;
+
+        lfield = ngx_http_lua_shrbtree_get_field(srbtn, name[i].data,
+                                                 name[i].len, &err);
+        if (NULL == lfield) {
+            continue;
+        }
+
+        p = &lfield->data + lfield->klen;
+
+        /* NaN isn't ordered */
+        if ((LUA_TNUMBER == lfield->vtype
+             && *(lua_Number *) p == *(lua_Number *) p)
+            || LUA_TSTRING == lfield->vtype
+            || LUA_TBOOLEAN == lfield->vtype)
+        {
+            entry->field = lfield;
+            ngx_rbtree_insert(&indexes[i], &entry->node);
+        }
+    }
+}
+
+
+static void
+ngx_http_lua_shrbtree_index_unlink(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t                       i;
+    ngx_http_lua_shrbtree_ientry_t  *entry;
+
+    if (NULL == ctx->indexes) {
+        return;
+    }
+
+    entry = ngx_http_lua_shrbtree_ientries(node);
+
+    for (i = 0; i < ctx->indexes->nelts; i++, entry++) {
+        if (NULL != entry->field) {
+            ngx_rbtree_delete(&ctx->sh->indexes[i], &entry->node);
+            entry->field = NULL;
+        }
+    }
+}
+
+
+/*
+ * empties the indexes of the shard or of its stage, whose entries go with
+ * their nodes
+ */
+static void
+ngx_http_lua_shrbtree_index_init(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_t *indexes)
+{
+    ngx_uint_t  i;
+
+    if (NULL == ctx->indexes) {
+        return;
+    }
+
+    ngx_rbtree_sentinel_init(&ctx->sh->index_sentinel);
+
+    for (i = 0; i < ctx->indexes->nelts; i++) {
+        ngx_rbtree_init(&indexes[i], &ctx->sh->index_sentinel,
+                        ngx_http_lua_shrbtree_index_insert_value);
+    }
+}
+
+
+/* compares a value of the field to the field of an index entry */
+static ngx_int_t
+ngx_http_lua_shrbtree_index_cmp(u_char type, u_char *data, size_t len,
+    ngx_http_lua_shrbtree_lfield_t *field)
+{
+    u_char      *p;
+    lua_Number   one, two;
+
+    if (type != field->vtype) {
+        return type < field->vtype ? -1 : 1;
+    }
+
+    p = &field->data + field->klen;
+
+    switch (type) {
+    case LUA_TNUMBER:
+        one = *(lua_Number *) data;
+        two = *(lua_Number *) p;
+        return one < two ? -1 : (one > two);
+
+    case LUA_TSTRING:
+        return ngx_memn2cmp(data, p, len, field->vlen);
+
+    default: /* boolean */
+        return (ngx_int_t) *data - *p;
+    }
+}
+
+
+/* entries of equal values are ordered by their nodes' addresses */
+static void
+ngx_http_lua_shrbtree_index_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_int_t                        rc;
+    ngx_rbtree_node_t              **p;
+    ngx_http_lua_shrbtree_lfield_t  *field;
+    ngx_http_lua_shrbtree_ientry_t  *entry, *e;
+
+    entry = (ngx_http_lua_shrbtree_ientry_t *) node;
+    field = entry->field;
+
+    for ( ;; ) {
+        e = (ngx_http_lua_shrbtree_ientry_t *) temp;
+
+        rc = ngx_http_lua_shrbtree_index_cmp(field->vtype,
+                                             &field->data + field->klen,
+                                             field->vlen, e->field);
+        if (0 == rc) {
+            rc = (entry->primary < e->primary) ? -1 : 1;
+        }
+
+        p = (rc < 0) ? &temp->left : &temp->right;
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * unlinks n cold nodes at the clock hand; a node referenced since the hand
+ * passed it is passed again, unless the hand has gone around too long
+ */
+static void
+ngx_http_lua_shrbtree_evict(ngx_http_lua_shrbtree_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_uint_t                      scan;
+    ngx_queue_t                    *q;
+    ngx_http_lua_shrbtree_clock_t  *clock;
+
+    for (scan = 0; n && !ngx_queue_empty(&ctx->sh->clock); scan++) {
+        q = ngx_queue_head(&ctx->sh->clock);
+        clock = ngx_queue_data(q, ngx_http_lua_shrbtree_clock_t, queue);
+
+        if (clock->referenced && NGX_HTTP_LUA_SHRBTREE_EVICT_SCAN > scan) {
+            clock->referenced = 0;
+            ngx_queue_remove(q);
+            ngx_queue_insert_tail(&ctx->sh->clock, q);
+            continue;
+        }
+
+        ngx_http_lua_shrbtree_unlink(ctx, clock->node);
+        ctx->sh->counters.evicted++;
+        n--;
+    }
+}
+
+
+/* lookups mark the nodes they find, without the lock */
+static void
+ngx_http_lua_shrbtree_touch(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_http_lua_shrbtree_clock_t  *clock;
+
+    if (ctx->evict) {
+        clock = (ngx_http_lua_shrbtree_clock_t *)
+                ngx_http_lua_shrbtree_node_head(ctx, node);
+
+        if (!clock->referenced) {
+            clock->referenced = 1;
+        }
+    }
+}
+
+
+/* the subtree size of a node of a rank=on zone */
+static ngx_uint_t *
+ngx_http_lua_shrbtree_node_size(ngx_rbtree_node_t *node)
+{
+    u_char  *p;
+
+    p = (u_char *) node;
+
+    if (node->key) {
+        p -= sizeof(ngx_rbtree_node_t);
+    }
+
+    return (ngx_uint_t *) p - 1;
+}
+
+
+static ngx_uint_t
+ngx_http_lua_shrbtree_size(ngx_rbtree_t *rbtree, ngx_rbtree_node_t *node)
+{
+    if (node == rbtree->sentinel) {
+        return 0;
+    }
+
+    return *ngx_http_lua_shrbtree_node_size(node);
+}
+
+
+/*
+ * after an insert or delete from node up, the rotations of the rebalance
+ * change only the sizes of the nodes up from node and of their children
+ */
+static void
+ngx_http_lua_shrbtree_resize(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_t       *rbtree;
+    ngx_rbtree_node_t  *child[2];
+
+    if (!ctx->rank) {
+        return;
+    }
+
+    rbtree = &ctx->sh->rbtree;
+
+    for ( /* void */ ; NULL != node; node = node->parent) {
+        child[0] = node->left;
+        child[1] = node->right;
+
+        for (i = 0; i < 2; i++) {
+            if (child[i] != rbtree->sentinel) {
+                *ngx_http_lua_shrbtree_node_size(child[i]) =
+                    ngx_http_lua_shrbtree_size(rbtree, child[i]->left)
+                    + ngx_http_lua_shrbtree_size(rbtree, child[i]->right)
+                    + 1;
+            }
+        }
+
+        *ngx_http_lua_shrbtree_node_size(node) =
+            ngx_http_lua_shrbtree_size(rbtree, node->left)
+            + ngx_http_lua_shrbtree_size(rbtree, node->right) + 1;
+    }
+}
+
+
+/* sets the sizes of a tree made by build */
+static ngx_uint_t
+ngx_http_lua_shrbtree_size_tree(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    ngx_uint_t  size;
+
+    if (node == sentinel) {
+        return 0;
+    }
+
+    size = ngx_http_lua_shrbtree_size_tree(node->left, sentinel)
+           + ngx_http_lua_shrbtree_size_tree(node->right, sentinel) + 1;
+
+    *ngx_http_lua_shrbtree_node_size(node) = size;
+
+    return size;
+}
+
+
+/* insert{key, value, [cmpf], [ttl = seconds]}: fails if the key exists */
+static int
+ngx_http_lua_shrbtree_insert(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_store(L, NGX_HTTP_LUA_SHRBTREE_INSERT);
+}
+
+
+/* set{key, value, [cmpf], [ttl = seconds]}: inserts or replaces */
+static int
+ngx_http_lua_shrbtree_set(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_store(L, NGX_HTTP_LUA_SHRBTREE_SET);
+}
+
+
+/* replace{key, value, [cmpf], [ttl = seconds]}: fails if no the key */
+static int
+ngx_http_lua_shrbtree_replace(lua_State *L)
+{
+    return ngx_http_lua_shrbtree_store(L, NGX_HTTP_LUA_SHRBTREE_REPLACE);
+}
+
+
+/*
+ * an existing node is updated in one lock hold: a number or boolean value
+ * is overwritten in place, any other is copied to a new node, which takes
+ * the place of the old one in the tree without a rebalance
+ */
+static int
+ngx_http_lua_shrbtree_store(lua_State *L, ngx_uint_t op)
+{
+    int                           kindex, vindex;
+    char                         *err;
+    ngx_int_t                     n, rc;
+    ngx_msec_t                    expires;
+    lua_Number                    ttl;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_http_lua_shrbtree_cmp_t   cmp;
+    ngx_http_lua_shrbtree_item_t  key, value;
+
+    u_char kbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char vbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &cmp);
+    luaL_argcheck(L, 2 == n, 2, "expected key and value");
+
+    expires = 0;
+
+    lua_getfield(L, 2, "ttl");
+    if (!lua_isnil(L, -1)) {
+        ttl = lua_tonumber(L, -1);
+        luaL_argcheck(L, lua_isnumber(L, -1) && ttl >= 0
+                         && ttl <= NGX_HTTP_LUA_SHRBTREE_MAX_TTL, 2,
+                      "bad ttl");
+
+        if (ttl > 0) {
+            expires = ngx_http_lua_shrbtree_expires((ngx_msec_t) (ttl * 1000));
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &cmp);
+    ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+    lua_rawgeti(L, 2, 2);
+    ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+
+    if (ngx_http_lua_shrbtree_crosses(ctx, &cmp)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "the interval crosses shards");
+        return 2;
+    }
+
+    ctx = ngx_http_lua_shrbtree_luaL_route(L, ctx, &cmp);
+
+    kindex = ngx_http_lua_shrbtree_luaL_pack(L, ctx, cmp.probe);
+    vindex = ngx_http_lua_shrbtree_luaL_pack(L, ctx, cmp.probe + 1);
+
+    key.data = &kbuf[0];
+    value.data = &vbuf[0];
+
+    ngx_http_lua_shrbtree_luaL_toitem(L, ctx, kindex, &key);
+    ngx_http_lua_shrbtree_luaL_toitem(L, ctx, vindex, &value);
+
+    rc = ngx_http_lua_shrbtree_store_item(L, ctx, &cmp, op, &key, &value,
+                                          expires, &err);
+    if (NGX_ERROR == rc) {
+        return lua_error(L);
+    }
+
+    if (NGX_DECLINED == rc) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/* scalars are converted at once, tables by store_item under the lock */
+static void
+ngx_http_lua_shrbtree_luaL_toitem(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, int index,
+    ngx_http_lua_shrbtree_item_t *item)
+{
+    if (LUA_TTABLE == lua_type(L, index)) {
+        item->type = LUA_TTABLE;
+        item->index = index;
+        return;
+    }
+
+    item->index = 0;
+    (void) ngx_http_lua_shrbtree_tolvalue(L, ctx, index, &item->data,
+                                          &item->type, &item->len, 0);
+}
+
+
+/*
+ * stores the key and value in the routed shard, L is only used by a lua
+ * compare and for tables.  Returns NGX_DECLINED with err if the node exists
+ * or not by op or there's no memory, NGX_ERROR if the lua compare failed.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_store_item(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_uint_t op, ngx_http_lua_shrbtree_item_t *key,
+    ngx_http_lua_shrbtree_item_t *value, ngx_msec_t expires, char **err)
+{
+    ngx_int_t                     rc;
+    ngx_rbtree_node_t            *old, *parent;
+    ngx_rbtree_node_t           **position;
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    ctx->sh->counters.writes++;
+
+    /* writers sweep a little as they go, besides the timer */
+    (void) ngx_http_lua_shrbtree_expire(ctx, 1);
+
+    old = ngx_http_lua_shrbtree_get_rawnode(L, &ctx->sh->rbtree, cmp,
+                                            &parent, &position);
+
+    if (NGX_OK == cmp->rc && NULL != old
+        && ngx_http_lua_shrbtree_expired(old))
+    {
+        ngx_http_lua_shrbtree_unlink(ctx, old);
+        old = ngx_http_lua_shrbtree_get_rawnode(L, &ctx->sh->rbtree, cmp,
+                                                &parent, &position);
+    }
+
+    if (NGX_OK != cmp->rc) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return NGX_ERROR;
+    }
+
+    if (NULL != old && NGX_HTTP_LUA_SHRBTREE_INSERT == op) {
+        ctx->sh->counters.write_misses++;
+        ngx_http_lua_shrbtree_unlock(ctx);
+        *err = "the node exists";
+        return NGX_DECLINED;
+    }
+
+    if (NULL == old && NGX_HTTP_LUA_SHRBTREE_REPLACE == op) {
+        ctx->sh->counters.write_misses++;
+        ngx_http_lua_shrbtree_unlock(ctx);
+        *err = "no exists";
+        return NGX_DECLINED;
+    }
+
+    if (NULL == old
+        || NGX_OK != ngx_http_lua_shrbtree_update(ctx, old, value, expires))
+    {
+        rc = ngx_http_lua_shrbtree_put(L, ctx, cmp, &old, parent, position,
+                                       key, value, expires);
+        if (NGX_ERROR == rc) {
+            ngx_http_lua_shrbtree_unlock(ctx);
+            return NGX_ERROR;
+        }
+
+        if (NGX_DECLINED == rc) {
+            ctx->sh->counters.nomem++;
+            ngx_http_lua_shrbtree_unlock(ctx);
+            *err = "no memory";
+            return NGX_DECLINED;
+        }
+    }
+
+    ngx_http_lua_shrbtree_reclaim(ctx);
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    return NGX_OK;
+}
+
+
+/*
+ * links a new node of the key and value in the locked shard, in place of
+ * *found if it's not NULL, or at the place found for it; *found is the new
+ * node then.  Returns NGX_DECLINED if there's no memory, NGX_ERROR if the lua
+ * compare failed.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_put(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t **found,
+    ngx_rbtree_node_t *parent, ngx_rbtree_node_t **position,
+    ngx_http_lua_shrbtree_item_t *key, ngx_http_lua_shrbtree_item_t *value,
+    ngx_msec_t expires)
+{
+    size_t                        size;
+    ngx_int_t                     rc;
+    ngx_rbtree_node_t            *node, *old, *sentinel;
+    ngx_http_lua_shrbtree_node_t *srbtn;
+
+    void *p;
+
+    old = *found;
+
+    if (key->index) {
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, key->index, &key->data,
+                                            &key->type, &key->len, 1);
+        if (NGX_OK != rc) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (value->index) {
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, value->index,
+                                            &value->data, &value->type,
+                                            &value->len, 1);
+        if (NGX_OK != rc) {
+            ngx_http_lua_shrbtree_destroy_lvalue(ctx, key->data, key->type);
+            return NGX_DECLINED;
+        }
+    }
+
+    size = offsetof(ngx_http_lua_shrbtree_node_t, data) + key->len
+           + value->len;
+
+    node = ngx_http_lua_shrbtree_alloc_node(ctx, size, expires, 1);
+
+    if (node == NULL) {
+        ngx_http_lua_shrbtree_destroy_lvalue(ctx, key->data, key->type);
+        ngx_http_lua_shrbtree_destroy_lvalue(ctx, value->data, value->type);
+        return NGX_DECLINED;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    srbtn->ktype = key->type;
+    srbtn->vtype = value->type;
+    srbtn->klen = key->len;
+    srbtn->vlen = value->len;
+    p = ngx_copy(&srbtn->data, key->data, key->len);
+    ngx_memcpy(p, value->data, value->len);
+
+    /* an eviction reshapes the tree, so the place is looked up again */
+    if (ctx->evict) {
+        old = ngx_http_lua_shrbtree_get_rawnode(L, &ctx->sh->rbtree, cmp,
+                                                &parent, &position);
+        if (NGX_OK != cmp->rc) {
+            node->parent = NULL;
+            ngx_http_lua_shrbtree_free_nodes(ctx, node);
+            return NGX_ERROR;
+        }
+    }
+
+    *found = node;
+
+    if (NULL != old) {
+        ngx_http_lua_shrbtree_swap(ctx, old, node);
+        goto done;
+    }
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    node->left = sentinel;
+    node->right = sentinel;
+
+    /* lockless readers must see the node filled before it's linked */
+    ngx_memory_barrier();
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+    ngx_http_lua_shrbtree_btree_drop(ctx);
+
+    if (NULL != parent) {
+        node->parent = parent;
+        ngx_rbt_red(node);
+        *position = node;
+    }
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+    ngx_http_lua_shrbtree_resize(ctx, node);
+
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    ctx->sh->counters.nodes++;
+
+done:
+
+    ngx_http_lua_shrbtree_link(ctx, node);
+
+    return NGX_OK;
+}
+
+
+/*
+ * incr{key, delta, [field], [cmpf]} adds delta to the number value, or to
+ * the number field of the table value, in place; returns the new number
+ */
+static int
+ngx_http_lua_shrbtree_incr(lua_State *L)
+{
+    char                           *err;
+    ngx_int_t                      n;
+    lua_Number                     delta, *value;
+    ngx_shm_zone_t                 *zone;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_cmp_t    cmp;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    u_char field[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char *fdata, ftype;
+    size_t flen;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &cmp);
+    luaL_argcheck(L, 2 == n || 3 == n, 2,
+                  "expected key, delta and optional field");
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &cmp);
+
+    lua_rawgeti(L, 2, 2);
+    luaL_argcheck(L, LUA_TNUMBER == lua_type(L, -1), 2, "bad delta");
+    delta = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    ctx = ngx_http_lua_shrbtree_luaL_route(L, ctx, &cmp);
+
+    fdata = NULL;
+    flen = 0;
+
+    if (3 == n) {
+        /* a string field stays referenced by the arguments table */
+        lua_rawgeti(L, 2, 3);
+        ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+        luaL_argcheck(L, LUA_TTABLE != lua_type(L, -1), 2, "bad field");
+
+        fdata = &field[0];
+        ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &fdata, &ftype, &flen, 0);
+        lua_pop(L, 1);
+    }
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    ctx->sh->counters.writes++;
+
+    node = ngx_http_lua_shrbtree_get_node(L, &ctx->sh->rbtree, &cmp);
+    if (NGX_OK != cmp.rc) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return lua_error(L);
+    }
+
+    if (NULL == node || ngx_http_lua_shrbtree_expired(node)) {
+        ctx->sh->counters.write_misses++;
+        ngx_http_lua_shrbtree_unlock(ctx);
+        lua_pushnil(L);
+        lua_pushliteral(L, "no exists");
+        return 2;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    lfield = ngx_http_lua_shrbtree_get_field(srbtn, fdata, flen, &err);
+    if (NULL == lfield) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        lua_pushnil(L);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    if (LUA_TNUMBER != lfield->vtype) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        lua_pushnil(L);
+        lua_pushliteral(L, "the value type isn't a number");
+        return 2;
+    }
+
+    value = (lua_Number *)(&lfield->data + lfield->klen);
+
+    /* the field may be indexed */
+    ngx_http_lua_shrbtree_index_unlink(ctx, node);
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+    *value += delta;
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    ngx_http_lua_shrbtree_index_link(ctx, ctx->sh->indexes, node);
+
+    delta = *value;
+
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    lua_pushnumber(L, delta);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_shrbtree_delete(lua_State *L)
+{
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_http_lua_shrbtree_cmp_t    cmp;
+    ngx_int_t                      rc;
+    int                            n;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 elements");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &cmp);
+    luaL_argcheck(L, 1 == n, 2, "expected key");
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &cmp);
+    ctx = ngx_http_lua_shrbtree_luaL_route(L, ctx, &cmp);
+
+    rc = ngx_http_lua_shrbtree_delete_key(L, ctx, &cmp);
+    if (NGX_ERROR == rc) {
+        return lua_error(L);
+    }
+
+    if (NGX_DECLINED == rc) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "no exists");
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+ * deletes the key from the routed shard; NGX_DECLINED if it doesn't exist,
+ * NGX_ERROR if the lua compare failed
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_delete_key(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp)
+{
+    ngx_uint_t          expired;
+    ngx_rbtree_node_t  *node;
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    ctx->sh->counters.writes++;
+
+    node = ngx_http_lua_shrbtree_get_node(L, &ctx->sh->rbtree, cmp);
+    if (NGX_OK != cmp->rc) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return NGX_ERROR;
+    }
+
+    if (NULL == node) {
+        ctx->sh->counters.write_misses++;
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return NGX_DECLINED;
+    }
+
+    expired = ngx_http_lua_shrbtree_expired(node);
+
+    if (expired) {
+        ctx->sh->counters.write_misses++;
+    }
+
+    ngx_http_lua_shrbtree_unlink(ctx, node);
+    ngx_http_lua_shrbtree_reclaim(ctx);
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    return expired ? NGX_DECLINED : NGX_OK;
+}
+
+
+/*
+ * bulk_load(items, [opts]):
+ *   items is an array of {key, value} or an iterator returning key, value,
+ *   in ascending order of keys; opts are {cmp = compare, swap = boolean}.
+ *
+ * All nodes are made in one lock hold and linked as a balanced tree, which
+ * replaces the current tree if opts.swap, or else the tree must be empty.
+ */
+static int
+ngx_http_lua_shrbtree_bulk_load(lua_State *L)
+{
+    int                          kv, cmpf, top;
+    ngx_uint_t                   i, n, swap, ascending, *shards;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_rbtree_node_t            **nodes;
+    ngx_http_lua_shrbtree_cmp_t  cmp, probes[2], *prev, *cur, *probe;
+
+    char *err;
+
+    top = lua_gettop(L);
+    luaL_argcheck(L, 2 == top || 3 == top, top, "expected 1 or 2 arguments");
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    cmp.type = ctx->cmp;
+    cmp.index = 0;
+    cmp.rc = NGX_OK;
+    cmpf = 0;
+    swap = 0;
+
+    if (3 == top && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "swap");
+        swap = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "cmp");
+        if (lua_isfunction(L, -1)) {
+            cmp.type = NGX_HTTP_LUA_SHRBTREE_CMP_LUA;
+            cmpf = lua_gettop(L);
+
+        } else if (lua_islightuserdata(L, -1)) {
+            cmp.type = ngx_http_lua_shrbtree_cmp_tag(L, -1);
+            luaL_argcheck(L, NGX_HTTP_LUA_SHRBTREE_CMP_MAX != cmp.type, 3,
+                          "bad builtin compare");
+        }
+    }
+
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_LUA == cmp.type && 0 == cmpf) {
+        return luaL_argerror(L, 3, "excpected compare function");
+    }
+
+    /* flatten items to {k1, v1, k2, v2, ...} and check them unlocked */
+    kv = ngx_http_lua_shrbtree_luaL_flatten(L, 2, &n);
+
+    probes[0] = cmp;
+    probes[1] = cmp;
+    prev = &probes[0];
+    cur = &probes[1];
+
+    /* the nodes by item, then scratch for the nodes of a shard */
+    nodes = lua_newuserdata(L, (n ? n : 1) * (2 * sizeof(ngx_rbtree_node_t *)
+                                              + sizeof(ngx_uint_t)));
+    shards = (ngx_uint_t *) &nodes[2 * n];
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, kv, 2 * i + 1);
+        ngx_http_lua_shrbtree_luaL_checkkey(L, -1, cur);
+        ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+        lua_rawgeti(L, kv, 2 * i + 2);
+        ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+        lua_pop(L, 1);
+
+        ascending = 1;
+
+        if (cmpf && i > 0) {
+            lua_pushvalue(L, cmpf);
+            lua_pushvalue(L, -2);
+            lua_rawgeti(L, kv, 2 * i - 1);
+            lua_call(L, 2, 1);
+
+            ascending = 0 < lua_tonumber(L, -1);
+            lua_pop(L, 1);
+
+        } else if (i > 0) {
+            /* as cmp_node orders them, intervals must not overlap */
+            if (NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL == cmp.type) {
+                ascending = prev->key[prev->nkey - 1] < cur->key[0];
+
+            } else {
+                ascending = 0 > ngx_http_lua_shrbtree_cmp_probes(&prev, &cur);
+            }
+        }
+
+        if (!ascending) {
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "keys are not in ascending order");
+            return 2;
+        }
+
+        if (ngx_http_lua_shrbtree_crosses(ctx, cur)) {
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "the interval crosses shards");
+            return 2;
+        }
+
+        shards[i] = ngx_http_lua_shrbtree_luaL_route(L, ctx, cur) - ctx->shards;
+
+        lua_pop(L, 1);
+
+        probe = prev;
+        prev = cur;
+        cur = probe;
+    }
+
+    if (ctx->packed) {
+        for (i = 0; i < 2 * n; i++) {
+            lua_rawgeti(L, kv, i + 1);
+
+            if (lua_istable(L, -1)) {
+                ngx_http_lua_shrbtree_luaL_pack(L, ctx, -1);
+                lua_rawseti(L, kv, i + 1);
+            }
+
+            lua_pop(L, 1);
+        }
+    }
+
+    /*
+     * the nodes of all shards are made before a tree is swapped, so that a
+     * failure leaves the zone as it was
+     */
+    err = NULL;
+    ngx_memzero(nodes, n * sizeof(ngx_rbtree_node_t *));
+
+    for (i = 0; i < ctx->nshards && NULL == err; i++) {
+        err = ngx_http_lua_shrbtree_bulk_alloc(L, &ctx->shards[i], kv, nodes,
+                                               shards, i, n);
+    }
+
+    if (NULL == err) {
+        err = ngx_http_lua_shrbtree_bulk_swap(ctx, nodes, &nodes[n], shards, n,
+                                              swap);
+    }
+
+    if (NULL != err) {
+        for (i = 0; i < ctx->nshards; i++) {
+            ngx_http_lua_shrbtree_bulk_free(&ctx->shards[i], nodes, shards, i,
+                                            n);
+        }
+
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnumber(L, (lua_Number) n);
+    return 2;
+}
+
+/*
+ * pushes the {key, value} items at index, or those returned by the iterator
+ * function there, flattened to {k1, v1, k2, v2, ...}; returns its index
+ */
+static int
+ngx_http_lua_shrbtree_luaL_flatten(lua_State *L, int index, ngx_uint_t *n)
+{
+    int         kv;
+    ngx_uint_t  i;
+
+    if (lua_isfunction(L, index)) {
+        lua_newtable(L);
+        kv = lua_gettop(L);
+
+        for (i = 0; /* void */; i++) {
+            lua_pushvalue(L, index);
+            lua_call(L, 0, 2);
+
+            if (lua_isnil(L, -2)) {
+                lua_pop(L, 2);
+                break;
+            }
+
+            lua_rawseti(L, kv, 2 * i + 2);
+            lua_rawseti(L, kv, 2 * i + 1);
+        }
+
+        *n = i;
+        return kv;
+    }
+
+    luaL_checktype(L, index, LUA_TTABLE);
+    *n = lua_objlen(L, index);
+
+    lua_createtable(L, 2 * *n, 0);
+    kv = lua_gettop(L);
+
+    for (i = 0; i < *n; i++) {
+        lua_rawgeti(L, index, i + 1);
+        if (!lua_istable(L, -1)) {
+            return luaL_argerror(L, index, "excpected {key, value} items");
+        }
+
+        lua_rawgeti(L, -1, 1);
+        lua_rawseti(L, kv, 2 * i + 1);
+        lua_rawgeti(L, -1, 2);
+        lua_rawseti(L, kv, 2 * i + 2);
+        lua_pop(L, 1);
+    }
+
+    return kv;
+}
+
+
+/*
+ * apply_delta(changes, [options]) merges the changes into the tree: the
+ * {key, value} items are set, the {key} ones deleted.  The keys must be in
+ * ascending order, so each is searched from the node of the former.
+ */
+static int
+ngx_http_lua_shrbtree_apply_delta(lua_State *L)
+{
+    int                          kv, cmpf, top;
+    char                        *err;
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, n, ascending, *shards;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_http_lua_shrbtree_cmp_t  cmp, probes[2], *prev, *cur, *probe;
+
+    top = lua_gettop(L);
+    luaL_argcheck(L, 2 == top || 3 == top, top, "expected 1 or 2 arguments");
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    cmp.type = ctx->cmp;
+    cmp.index = 0;
+    cmp.rc = NGX_OK;
+    cmpf = 0;
+
+    if (3 == top && !lua_isnil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "cmp");
+        if (lua_isfunction(L, -1)) {
+            cmp.type = NGX_HTTP_LUA_SHRBTREE_CMP_LUA;
+            cmpf = lua_gettop(L);
+
+        } else if (lua_islightuserdata(L, -1)) {
+            cmp.type = ngx_http_lua_shrbtree_cmp_tag(L, -1);
+            luaL_argcheck(L, NGX_HTTP_LUA_SHRBTREE_CMP_MAX != cmp.type, 3,
+                          "bad builtin compare");
+        }
+    }
+
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_LUA == cmp.type && 0 == cmpf) {
+        return luaL_argerror(L, 3, "excpected compare function");
+    }
+
+    cmp.index = cmpf;
+
+    kv = ngx_http_lua_shrbtree_luaL_flatten(L, 2, &n);
+
+    probes[0] = cmp;
+    probes[1] = cmp;
+    prev = &probes[0];
+    cur = &probes[1];
+
+    shards = lua_newuserdata(L, (n ? n : 1) * sizeof(ngx_uint_t));
+
+    for (i = 0; i < n; i++) {
+        lua_rawgeti(L, kv, 2 * i + 1);
+        ngx_http_lua_shrbtree_luaL_checkkey(L, -1, cur);
+        ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+        lua_rawgeti(L, kv, 2 * i + 2);
+        if (!lua_isnil(L, -1)) {
+            ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+        }
+        lua_pop(L, 1);
+
+        ascending = 1;
+
+        if (cmpf && i > 0) {
+            lua_pushvalue(L, cmpf);
+            lua_pushvalue(L, -2);
+            lua_rawgeti(L, kv, 2 * i - 1);
+            lua_call(L, 2, 1);
+
+            ascending = 0 < lua_tonumber(L, -1);
+            lua_pop(L, 1);
+
+        } else if (i > 0) {
+            if (NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL == cmp.type) {
+                ascending = prev->key[prev->nkey - 1] < cur->key[0];
+
+            } else {
+                ascending = 0 > ngx_http_lua_shrbtree_cmp_probes(&prev, &cur);
+            }
+        }
+
+        if (!ascending) {
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "keys are not in ascending order");
+            return 2;
+        }
+
+        if (ngx_http_lua_shrbtree_crosses(ctx, cur)) {
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "the interval crosses shards");
+            return 2;
+        }
+
+        shards[i] = ngx_http_lua_shrbtree_luaL_route(L, ctx, cur) - ctx->shards;
+
+        lua_pop(L, 1);
+
+        probe = prev;
+        prev = cur;
+        cur = probe;
+    }
+
+    if (ctx->packed) {
+        for (i = 0; i < 2 * n; i++) {
+            lua_rawgeti(L, kv, i + 1);
+
+            if (lua_istable(L, -1)) {
+                ngx_http_lua_shrbtree_luaL_pack(L, ctx, -1);
+                lua_rawseti(L, kv, i + 1);
+            }
+
+            lua_pop(L, 1);
+        }
+    }
+
+    for (i = 0; i < ctx->nshards; i++) {
+        rc = ngx_http_lua_shrbtree_apply_shard(L, &ctx->shards[i], &cmp, kv,
+                                               shards, i, n, &err);
+        if (NGX_ERROR == rc) {
+            return lua_error(L);
+        }
+
+        if (NGX_DECLINED == rc) {
+            lua_pushboolean(L, 0);
+            lua_pushstring(L, err);
+            return 2;
+        }
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnumber(L, (lua_Number) n);
+    return 2;
+}
+
+
+/*
+ * applies the changes of the shard, a batch of them per lock hold.  A
+ * change is searched from the node of the former one, or from its
+ * predecessor if it was deleted; the first of a batch from the root, as
+ * other writers may have freed that node in between.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_apply_shard(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    int kv, ngx_uint_t *shards, ngx_uint_t shard, ngx_uint_t n, char **err)
+{
+    int                           top;
+    ngx_int_t                     rc;
+    ngx_uint_t                    i, m;
+    ngx_rbtree_node_t            *node, *finger, *parent;
+    ngx_rbtree_node_t           **position;
+    ngx_http_lua_shrbtree_item_t  key, value;
+
+    u_char kbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char vbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    top = lua_gettop(L);
+
+    for (i = 0; i < n; /* void */) {
+        ngx_http_lua_shrbtree_lock(ctx);
+
+        finger = NULL;
+
+        for (m = 0; i < n && m < NGX_HTTP_LUA_SHRBTREE_DELTA_BATCH; i++) {
+            if (shards[i] != shard) {
+                continue;
+            }
+
+            m++;
+            ctx->sh->counters.writes++;
+
+            lua_settop(L, top);
+            lua_rawgeti(L, kv, 2 * i + 1);
+            lua_rawgeti(L, kv, 2 * i + 2);
+
+            /* checked by apply_delta */
+            ngx_http_lua_shrbtree_luaL_checkkey(L, top + 1, cmp);
+
+            node = ngx_http_lua_shrbtree_get_finger(L, &ctx->sh->rbtree, cmp,
+                                                    finger, &parent,
+                                                    &position);
+            if (NGX_OK != cmp->rc) {
+                ngx_http_lua_shrbtree_unlock(ctx);
+                return NGX_ERROR;
+            }
+
+            if (lua_isnil(L, top + 2)) {
+                if (NULL == node) {
+                    ctx->sh->counters.write_misses++;
+                    continue;
+                }
+
+                finger = ngx_http_lua_shrbtree_prev(&ctx->sh->rbtree, node);
+                ngx_http_lua_shrbtree_unlink(ctx, node);
+                continue;
+            }
+
+            key.data = &kbuf[0];
+            value.data = &vbuf[0];
+
+            ngx_http_lua_shrbtree_luaL_toitem(L, ctx, top + 1, &key);
+            ngx_http_lua_shrbtree_luaL_toitem(L, ctx, top + 2, &value);
+
+            if (NULL != node
+                && NGX_OK == ngx_http_lua_shrbtree_update(ctx, node, &value,
+                                                          0))
+            {
+                finger = node;
+                continue;
+            }
+
+            rc = ngx_http_lua_shrbtree_put(L, ctx, cmp, &node, parent,
+                                           position, &key, &value, 0);
+            if (NGX_ERROR == rc) {
+                ngx_http_lua_shrbtree_unlock(ctx);
+                return NGX_ERROR;
+            }
+
+            if (NGX_DECLINED == rc) {
+                ctx->sh->counters.nomem++;
+                ngx_http_lua_shrbtree_reclaim(ctx);
+                ngx_http_lua_shrbtree_unlock(ctx);
+                lua_settop(L, top);
+                *err = "no memory";
+                return NGX_DECLINED;
+            }
+
+            finger = node;
+        }
+
+        ngx_http_lua_shrbtree_reclaim(ctx);
+        ngx_http_lua_shrbtree_unlock(ctx);
+    }
+
+    lua_settop(L, top);
+
+    return NGX_OK;
+}
+
+
+/*
+ * makes the nodes of the items of the shard, nodes[i] for the ith item;
+ * the nodes not made are left NULL
+ */
+static char *
+ngx_http_lua_shrbtree_bulk_alloc(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    int kv, ngx_rbtree_node_t **nodes, ngx_uint_t *shards, ngx_uint_t shard,
+    ngx_uint_t n)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i;
+    ngx_rbtree_node_t            *node;
+    ngx_http_lua_shrbtree_node_t *srbtn;
+
+    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char value[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char *kdata, *vdata;
+    size_t klen, vlen, size;
+    u_char ktype, vtype;
+
+    void *p;
+    char *err;
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    err = NULL;
+
+    for (i = 0; i < n; i++) {
+        if (shards[i] != shard) {
+            continue;
+        }
+
+        kdata = &key[0];
+        vdata = &value[0];
+
+        /* values are checked, so only a failed allocation is returned */
+        err = "no memory";
+
+        lua_rawgeti(L, kv, 2 * i + 1); /* key */
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &kdata, &ktype, &klen,
+                                            0);
+        if (NGX_OK != rc) {
+            lua_pop(L, 1);
+            break;
+        }
+
+        lua_rawgeti(L, kv, 2 * i + 2); /* value */
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &vdata, &vtype, &vlen,
+                                            0);
+        if (NGX_OK != rc) {
+            ngx_http_lua_shrbtree_destroy_lvalue(ctx, kdata, ktype);
+            lua_pop(L, 2);
+            break;
+        }
+
+        size = offsetof(ngx_http_lua_shrbtree_node_t, data) + klen + vlen;
+
+        /* the tree is being replaced, nothing is evicted for it */
+        node = ngx_http_lua_shrbtree_alloc_node(ctx, size, 0, 0);
+        if (node == NULL) {
+            ngx_http_lua_shrbtree_destroy_lvalue(ctx, kdata, ktype);
+            ngx_http_lua_shrbtree_destroy_lvalue(ctx, vdata, vtype);
+            lua_pop(L, 2);
+            break;
+        }
+
+        srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+        srbtn->ktype = ktype;
+        srbtn->vtype = vtype;
+        srbtn->klen = klen;
+        srbtn->vlen = vlen;
+        p = ngx_copy(&srbtn->data, kdata, klen);
+        ngx_memcpy(p, vdata, vlen);
+
+        nodes[i] = node;
+        err = NULL;
+
+        lua_pop(L, 2); /* pop key, value */
+    }
+
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    return err;
+}
+
+
+/* frees the nodes made for the shard, which aren't linked */
+static void
+ngx_http_lua_shrbtree_bulk_free(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_uint_t *shards, ngx_uint_t shard,
+    ngx_uint_t n)
+{
+    ngx_uint_t          i;
+    ngx_rbtree_node_t  *freed;
+
+    freed = NULL;
+
+    for (i = 0; i < n; i++) {
+        if (shards[i] == shard && NULL != nodes[i]) {
+            nodes[i]->parent = freed;
+            freed = nodes[i];
+        }
+    }
+
+    if (NULL == freed) {
+        return;
+    }
+
+    ngx_http_lua_shrbtree_lock(ctx);
+    ngx_http_lua_shrbtree_free_nodes(ctx, freed);
+    ngx_http_lua_shrbtree_unlock(ctx);
+}
+
+
+/*
+ * swaps the trees of the made nodes in, with the locks of all shards taken
+ * in order first, so that no shard is left to fail; this is the only place
+ * which holds more than one lock
+ */
+static char *
+ngx_http_lua_shrbtree_bulk_swap(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_rbtree_node_t **scratch,
+    ngx_uint_t *shards, ngx_uint_t n, ngx_uint_t swap)
+{
+    ngx_uint_t                    i, m, shard;
+    ngx_http_lua_shrbtree_ctx_t  *sctx;
+
+    for (shard = 0; shard < ctx->nshards; shard++) {
+        ngx_http_lua_shrbtree_lock(&ctx->shards[shard]);
+    }
+
+    for (shard = 0; !swap && shard < ctx->nshards; shard++) {
+        sctx = &ctx->shards[shard];
+
+        if (sctx->sh->rbtree.root != sctx->sh->rbtree.sentinel) {
+            for (shard = 0; shard < ctx->nshards; shard++) {
+                ngx_http_lua_shrbtree_unlock(&ctx->shards[shard]);
+            }
+
+            return "the tree isn't empty";
+        }
+    }
+
+    for (shard = 0; shard < ctx->nshards; shard++) {
+        for (i = 0, m = 0; i < n; i++) {
+            if (shards[i] == shard) {
+                scratch[m++] = nodes[i];
+            }
+        }
+
+        sctx = &ctx->shards[shard];
+
+        ngx_http_lua_shrbtree_bulk_build(sctx, scratch, m);
+        ngx_http_lua_shrbtree_unlock(sctx);
+    }
+
+    return NULL;
+}
+
+
+/* builds the tree of the sorted nodes in the locked shard, and swaps it in */
+static void
+ngx_http_lua_shrbtree_bulk_build(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **nodes, ngx_uint_t m)
+{
+    ngx_uint_t                   i, h;
+    ngx_rbtree_node_t            *node, *root, *sentinel, *btree;
+
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    /* the deepest level is red, unless it's the root */
+    for (h = 0, i = m; i > 1; i >>= 1) {
+        h++;
+    }
+
+    root = ngx_http_lua_shrbtree_build(nodes, m, sentinel, 0, h);
+    if (root != sentinel) {
+        root->parent = NULL;
+    }
+
+    if (ctx->rank) {
+        (void) ngx_http_lua_shrbtree_size_tree(root, sentinel);
+    }
+
+    btree = ngx_http_lua_shrbtree_btree_build(ctx, nodes, m);
+
+    /* the former tree is left intact for the snapshots of it */
+    ngx_http_lua_shrbtree_freeze(ctx->sh);
+
+    ngx_memory_barrier();
+
+    node = ctx->sh->rbtree.root;
+
+    ngx_http_lua_shrbtree_write_begin(ctx->sh);
+    ngx_http_lua_shrbtree_btree_drop(ctx);
+    ctx->sh->rbtree.root = root;
+    ctx->sh->btree = btree;
+    ngx_http_lua_shrbtree_write_end(ctx->sh);
+
+    ctx->sh->counters.nodes = m;
+
+    /* the timers, the clock and the indexes are of the former nodes */
+    ngx_rbtree_init(&ctx->sh->expiry, &ctx->sh->expiry_sentinel,
+                    ngx_rbtree_insert_timer_value);
+    ngx_queue_init(&ctx->sh->clock);
+    ngx_http_lua_shrbtree_index_init(ctx, ctx->sh->indexes);
+
+    for (i = 0; i < m; i++) {
+        ngx_http_lua_shrbtree_link(ctx, nodes[i]);
+    }
+
+    ngx_http_lua_shrbtree_retire_tree(ctx, node, sentinel);
+    ngx_http_lua_shrbtree_reclaim(ctx);
+}
+
+/*
+ * begin_reload() starts a tree of each shard to be filled by stage and
+ * swapped in by commit, while the zone is read and written as before
+ */
+static int
+ngx_http_lua_shrbtree_begin_reload(lua_State *L)
+{
+    ngx_uint_t                      i;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx, *shard;
+    ngx_http_lua_shrbtree_stage_t  *stage;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    /* the first shard decides between the workers which begin at once */
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shrbtree_lock(shard);
+
+        if (shard->sh->reloading) {
+            ngx_http_lua_shrbtree_unlock(shard);
+
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "a reload is in progress");
+            return 2;
+        }
+
+        stage = &shard->sh->stage;
+
+        ngx_rbtree_init(&stage->rbtree, &shard->sh->sentinel,
+                        ngx_http_lua_shrbtree_insert_value);
+        ngx_rbtree_init(&stage->expiry, &shard->sh->expiry_sentinel,
+                        ngx_rbtree_insert_timer_value);
+        ngx_queue_init(&stage->clock);
+        ngx_http_lua_shrbtree_index_init(shard, stage->indexes);
+        stage->nodes = 0;
+
+        shard->sh->reloading = 1;
+
+        ngx_http_lua_shrbtree_unlock(shard);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+ * stage{key, value, [cmpf], [ttl = seconds]} adds a node to the staged
+ * tree, in one short lock hold of its shard; fails if the key is staged
+ */
+static int
+ngx_http_lua_shrbtree_stage(lua_State *L)
+{
+    int                           kindex, vindex;
+    char                         *err;
+    ngx_int_t                     n, rc;
+    ngx_msec_t                    expires;
+    lua_Number                    ttl;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_http_lua_shrbtree_cmp_t   cmp;
+    ngx_http_lua_shrbtree_item_t  key, value;
+
+    u_char kbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+    u_char vbuf[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+
+    ctx = zone->data;
+
+    n = ngx_http_lua_shrbtree_luaL_checkcmp(L, 2, lua_objlen(L, 2), ctx,
+                                            &cmp);
+    luaL_argcheck(L, 2 == n, 2, "expected key and value");
+
+    expires = 0;
+
+    lua_getfield(L, 2, "ttl");
+    if (!lua_isnil(L, -1)) {
+        ttl = lua_tonumber(L, -1);
+        luaL_argcheck(L, lua_isnumber(L, -1) && ttl >= 0
+                         && ttl <= NGX_HTTP_LUA_SHRBTREE_MAX_TTL, 2,
+                      "bad ttl");
+
+        if (ttl > 0) {
+            expires = ngx_http_lua_shrbtree_expires((ngx_msec_t) (ttl * 1000));
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, 2, 1);
+    ngx_http_lua_shrbtree_luaL_checkkey(L, -1, &cmp);
+    ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+    lua_rawgeti(L, 2, 2);
+    ngx_http_lua_shrbtree_luaL_checklvalue(L, -1, 0);
+
+    if (ngx_http_lua_shrbtree_crosses(ctx, &cmp)) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "the interval crosses shards");
+        return 2;
+    }
+
+    ctx = ngx_http_lua_shrbtree_luaL_route(L, ctx, &cmp);
+
+    kindex = ngx_http_lua_shrbtree_luaL_pack(L, ctx, cmp.probe);
+    vindex = ngx_http_lua_shrbtree_luaL_pack(L, ctx, cmp.probe + 1);
+
+    key.data = &kbuf[0];
+    value.data = &vbuf[0];
+
+    ngx_http_lua_shrbtree_luaL_toitem(L, ctx, kindex, &key);
+    ngx_http_lua_shrbtree_luaL_toitem(L, ctx, vindex, &value);
+
+    rc = ngx_http_lua_shrbtree_stage_item(L, ctx, &cmp, &key, &value, expires,
+                                          &err);
+    if (NGX_ERROR == rc) {
+        return lua_error(L);
+    }
+
+    if (NGX_DECLINED == rc) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/*
+ * as store_item, into the stage of the routed shard.  Readers don't see the
+ * stage, so the node is linked without marking the change, and nothing is
+ * evicted from the current tree for it.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_stage_item(lua_State *L,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_http_lua_shrbtree_item_t *key, ngx_http_lua_shrbtree_item_t *value,
+    ngx_msec_t expires, char **err)
+{
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_rbtree_node_t              *node, *old, *parent;
+    ngx_rbtree_node_t             **position;
+    ngx_http_lua_shrbtree_node_t   *srbtn;
+    ngx_http_lua_shrbtree_stage_t  *stage;
+
+    void *p;
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    stage = &ctx->sh->stage;
+
+    if (!ctx->sh->reloading) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        *err = "no reload in progress";
+        return NGX_DECLINED;
+    }
+
+    old = ngx_http_lua_shrbtree_get_rawnode(L, &stage->rbtree, cmp, &parent,
+                                            &position);
+
+    if (NGX_OK != cmp->rc) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return NGX_ERROR;
+    }
+
+    if (NULL != old) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        *err = "the node exists";
+        return NGX_DECLINED;
+    }
+
+    if (key->index) {
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, key->index, &key->data,
+                                            &key->type, &key->len, 0);
+        if (NGX_OK != rc) {
+            goto nomem;
+        }
+    }
+
+    if (value->index) {
+        rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, value->index,
+                                            &value->data, &value->type,
+                                            &value->len, 0);
+        if (NGX_OK != rc) {
+            ngx_http_lua_shrbtree_destroy_lvalue(ctx, key->data, key->type);
+            goto nomem;
+        }
+    }
+
+    size = offsetof(ngx_http_lua_shrbtree_node_t, data) + key->len
+           + value->len;
+
+    node = ngx_http_lua_shrbtree_alloc_node(ctx, size, expires, 0);
+
+    if (node == NULL) {
+        ngx_http_lua_shrbtree_destroy_lvalue(ctx, key->data, key->type);
+        ngx_http_lua_shrbtree_destroy_lvalue(ctx, value->data, value->type);
+        goto nomem;
+    }
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    srbtn->ktype = key->type;
+    srbtn->vtype = value->type;
+    srbtn->klen = key->len;
+    srbtn->vlen = value->len;
+    p = ngx_copy(&srbtn->data, key->data, key->len);
+    ngx_memcpy(p, value->data, value->len);
+
+    node->left = stage->rbtree.sentinel;
+    node->right = stage->rbtree.sentinel;
+
+    if (NULL != parent) {
+        node->parent = parent;
+        ngx_rbt_red(node);
+        *position = node;
+    }
+
+    /* the stage shares the sentinel, which is all resize takes of the tree */
+    ngx_rbtree_insert(&stage->rbtree, node);
+    ngx_http_lua_shrbtree_resize(ctx, node);
+
+    stage->nodes++;
+
+    ngx_http_lua_shrbtree_stage_link(ctx, node);
+
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    return NGX_OK;
+
+nomem:
+
+    ctx->sh->counters.nomem++;
+    ngx_http_lua_shrbtree_unlock(ctx);
+    *err = "no memory";
+    return NGX_DECLINED;
+}
+
+
+/* as link, to the timers, the clock and the indexes of the stage */
+static void
+ngx_http_lua_shrbtree_stage_link(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *node)
+{
+    ngx_http_lua_shrbtree_clock_t  *clock;
+    ngx_http_lua_shrbtree_stage_t  *stage;
+
+    stage = &ctx->sh->stage;
+
+    if (node->key) {
+        ngx_rbtree_insert(&stage->expiry, node - 1);
+    }
+
+    if (ctx->evict) {
+        clock = (ngx_http_lua_shrbtree_clock_t *)
+                ngx_http_lua_shrbtree_node_head(ctx, node);
+        ngx_queue_insert_tail(&stage->clock, &clock->queue);
+    }
+
+    ngx_http_lua_shrbtree_index_link(ctx, stage->indexes, node);
+}
+
+
+/*
+ * commit() swaps the staged trees in, shard by shard, each by a root
+ * pointer; returns the number of staged nodes.  The former trees are left
+ * to the sweeps.
+ */
+static int
+ngx_http_lua_shrbtree_commit(lua_State *L)
+{
+    ngx_uint_t                    i, n;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    /* reloading is cleared last in the first shard, see begin_reload */
+    if (!ctx->shards[0].sh->reloading) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "no reload in progress");
+        return 2;
+    }
+
+    n = 0;
+
+    for (i = ctx->nshards; i--; /* void */) {
+        n += ngx_http_lua_shrbtree_commit_shard(&ctx->shards[i]);
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnumber(L, (lua_Number) n);
+    return 2;
+}
+
+
+/* returns the number of nodes swapped in */
+static ngx_uint_t
+ngx_http_lua_shrbtree_commit_shard(ngx_http_lua_shrbtree_ctx_t *ctx)
+{
+    ngx_uint_t                      i;
+    ngx_rbtree_node_t              *root;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+    ngx_http_lua_shrbtree_stage_t  *stage;
+
+    sh = ctx->sh;
+    stage = &sh->stage;
+
+    ngx_http_lua_shrbtree_lock(ctx);
+
+    if (!sh->reloading) {
+        ngx_http_lua_shrbtree_unlock(ctx);
+        return 0;
+    }
+
+    /* the former tree is left intact for the snapshots of it, see drain */
+    ngx_http_lua_shrbtree_freeze(sh);
+
+    ngx_memory_barrier();
+
+    root = sh->rbtree.root;
+
+    ngx_http_lua_shrbtree_write_begin(sh);
+    ngx_http_lua_shrbtree_btree_drop(ctx);
+    sh->rbtree.root = stage->rbtree.root;
+    ngx_http_lua_shrbtree_write_end(sh);
+
+    sh->counters.nodes = stage->nodes;
+
+    /* the timers, the clock and the indexes are of the staged nodes */
+    sh->expiry.root = stage->expiry.root;
+
+    if (ngx_queue_empty(&stage->clock)) {
+        ngx_queue_init(&sh->clock);
+
+    } else {
+        sh->clock = stage->clock;
+        sh->clock.next->prev = &sh->clock;
+        sh->clock.prev->next = &sh->clock;
+    }
+
+    if (NULL != ctx->indexes) {
+        for (i = 0; i < ctx->indexes->nelts; i++) {
+            sh->indexes[i].root = stage->indexes[i].root;
+        }
+    }
+
+    sh->reloading = 0;
+
+    ngx_http_lua_shrbtree_drain_tree(ctx, root);
+    (void) ngx_http_lua_shrbtree_drain(ctx,
+                                       NGX_HTTP_LUA_SHRBTREE_DRAIN_BATCH);
+    ngx_http_lua_shrbtree_reclaim(ctx);
+
+    ngx_http_lua_shrbtree_unlock(ctx);
+
+    return stage->nodes;
+}
+
+
+/* abort_reload() drops the staged trees, which are freed by the sweeps */
+static int
+ngx_http_lua_shrbtree_abort_reload(lua_State *L)
+{
+    ngx_uint_t                    i;
+    ngx_shm_zone_t               *zone;
+    ngx_http_lua_shrbtree_ctx_t  *ctx, *shard;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    if (!ctx->shards[0].sh->reloading) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "no reload in progress");
+        return 2;
+    }
+
+    for (i = ctx->nshards; i--; /* void */) {
+        shard = &ctx->shards[i];
+
+        ngx_http_lua_shrbtree_lock(shard);
+
+        if (shard->sh->reloading) {
+            ngx_http_lua_shrbtree_drain_tree(shard,
+                                             shard->sh->stage.rbtree.root);
+            shard->sh->stage.nodes = 0;
+            shard->sh->reloading = 0;
+        }
+
+        ngx_http_lua_shrbtree_unlock(shard);
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/* queues an unlinked tree to be retired by drain */
+static void
+ngx_http_lua_shrbtree_drain_tree(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t *root)
+{
+    if (root == ctx->sh->rbtree.sentinel) {
+        return;
+    }
+
+    root->parent = ctx->sh->drain;
+    ctx->sh->drain = root;
+}
+
+
+/*
+ * retires at most n nodes of the queued trees, in the locked shard, unless
+ * snapshots are held.  A tree is walked in post-order by the parent links,
+ * without a stack, and only the parent links are changed by retire: the
+ * gets of a snapshot of a frozen tree still read it, and keep reclaim from
+ * freeing it.  Returns NGX_AGAIN if nodes are left to retire now.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_drain(ngx_http_lua_shrbtree_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_rbtree_node_t              *node, *parent, *next, *sentinel;
+    ngx_http_lua_shrbtree_shctx_t  *sh;
+
+    sh = ctx->sh;
+    sentinel = sh->rbtree.sentinel;
+
+    /* the root replaced is seen by a snapshot which is held first */
+    ngx_memory_barrier();
+
+    if (0 != sh->snapshots) {
+        return NGX_OK;
+    }
+
+    while (n) {
+        node = sh->draining;
+
+        if (NULL == node) {
+            if (NULL == sh->drain) {
+                return NGX_OK;
+            }
+
+            node = sh->drain;
+            sh->drain = node->parent;
+            node->parent = NULL;
+
+            node = ngx_http_lua_shrbtree_drain_first(node, sentinel);
+        }
+
+        parent = node->parent;
+
+        if (NULL == parent) {
+            next = NULL;
+
+        } else if (node == parent->right || parent->right == sentinel) {
+            next = parent;
+
+        } else {
+            next = ngx_http_lua_shrbtree_drain_first(parent->right, sentinel);
+        }
+
+        ngx_http_lua_shrbtree_retire(ctx, node);
+        sh->draining = next;
+        n--;
+    }
+
+    if (NULL == sh->draining && NULL == sh->drain) {
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+/* the first node of the subtree in post-order */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_drain_first(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel)
+{
+    for ( ;; ) {
+        if (node->left != sentinel) {
+            node = node->left;
+
+        } else if (node->right != sentinel) {
+            node = node->right;
+
+        } else {
+            return node;
+        }
+    }
+}
+
+
+/*
+ * writes the zone to a temporary file, which replaces the snapshot when
+ * it's complete.  A shard is locked while a batch of its nodes is copied to
+ * a buffer, not while the buffer is written.
+ */
+static int
+ngx_http_lua_shrbtree_save(lua_State *L)
+{
+    off_t                              offset;
+    uint64_t                           count;
+    ngx_fd_t                           fd;
+    ngx_int_t                          rc;
+    ngx_uint_t                         i;
+    const char                        *temp;
+    ngx_shm_zone_t                    *zone;
+    ngx_http_lua_shrbtree_ctx_t       *ctx;
+    ngx_http_lua_shrbtree_snapshot_t   snapshot;
+    ngx_http_lua_shrbtree_section_t    section;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    if (0 == ctx->snapshot.len) {
+        lua_pushboolean(L, 0);
+        lua_pushliteral(L, "no snapshot file");
+        return 2;
+    }
+
+    temp = lua_pushfstring(L, "%s.%d", ctx->snapshot.data, (int) ngx_pid);
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
         lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no memory");
+        lua_pushfstring(L, "failed to open \"%s\": %s", temp,
+                        strerror(ngx_errno));
         return 2;
     }
 
-    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+    ngx_memzero(&snapshot, sizeof(ngx_http_lua_shrbtree_snapshot_t));
+    ngx_memcpy(snapshot.magic, NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_MAGIC, 8);
+    snapshot.version = NGX_HTTP_LUA_SHRBTREE_SNAPSHOT_VERSION;
+    snapshot.word = sizeof(size_t);
+    snapshot.nshards = ctx->nshards;
+
+    if (ngx_http_lua_shrbtree_write(fd, &snapshot, sizeof(snapshot), 0)
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    offset = sizeof(snapshot);
+    count = 0;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        rc = ngx_http_lua_shrbtree_save_section(&ctx->shards[i], fd, &offset,
+                                                &section);
+        if (rc == NGX_ABORT) {
+            ngx_close_file(fd);
+            ngx_delete_file(temp);
+
+            lua_pushboolean(L, 0);
+            lua_pushliteral(L, "no memory");
+            return 2;
+        }
+
+        if (rc != NGX_OK) {
+            goto failed;
+        }
+
+        count += section.count;
+    }
+
+    /* a section rewritten shorter may have left records past the end */
+    if (ftruncate(fd, offset) == -1) {
+        goto failed;
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        fd = NGX_INVALID_FILE;
+        goto failed;
+    }
+
+    fd = NGX_INVALID_FILE;
+
+    if (ngx_rename_file(temp, ctx->snapshot.data) == NGX_FILE_ERROR) {
+        goto failed;
+    }
+
+    lua_pushboolean(L, 1);
+    lua_pushnumber(L, (lua_Number) count);
+    return 2;
+
+failed:
+
+    lua_pushboolean(L, 0);
+    lua_pushfstring(L, "failed to write \"%s\": %s", temp,
+                    strerror(ngx_errno));
+
+    if (fd != NGX_INVALID_FILE) {
+        ngx_close_file(fd);
+    }
+
+    ngx_delete_file(temp);
+
+    return 2;
+}
+
+
+/*
+ * stats(): the counters of the zone summed over the shards, and those of
+ * each shard in "shards" if sharded
+ */
+static int
+ngx_http_lua_shrbtree_stats(lua_State *L)
+{
+    ngx_uint_t                      i;
+    ngx_shm_zone_t                 *zone;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_stats_t   st;
+
+    ngx_http_lua_shrbtree_luaL_checknarg(L, 1);
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 element");
+
+    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
+    ctx = zone->data;
+
+    ngx_memzero(&st, sizeof(ngx_http_lua_shrbtree_stats_t));
+    ngx_http_lua_shrbtree_get_stats(ctx, &st);
+    ngx_http_lua_shrbtree_pushstats(L, &st);
+
+    if (1 == ctx->nshards) {
+        return 1;
+    }
+
+    lua_createtable(L, ctx->nshards /* narr */, 0 /* nrec */);
+
+    for (i = 0; i < ctx->nshards; i++) {
+        ngx_memzero(&st, sizeof(ngx_http_lua_shrbtree_stats_t));
+        ngx_http_lua_shrbtree_get_stats(&ctx->shards[i], &st);
+        ngx_http_lua_shrbtree_pushstats(L, &st);
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    lua_setfield(L, -2, "shards");
+
+    return 1;
+}
+
+
+static void
+ngx_http_lua_shrbtree_pushstats(lua_State *L,
+    ngx_http_lua_shrbtree_stats_t *st)
+{
+    ngx_uint_t  i;
+
+    lua_createtable(L, 0 /* narr */, 17 /* nrec */);
+
+#define ngx_http_lua_shrbtree_pushstat(name)                                  \
+    lua_pushnumber(L, (lua_Number) st->name);                                 \
+    lua_setfield(L, -2, #name)
+
+    ngx_http_lua_shrbtree_pushstat(nodes);
+    ngx_http_lua_shrbtree_pushstat(size);
+    ngx_http_lua_shrbtree_pushstat(free);
+    ngx_http_lua_shrbtree_pushstat(fragmented);
+    ngx_http_lua_shrbtree_pushstat(reads);
+    ngx_http_lua_shrbtree_pushstat(read_misses);
+    ngx_http_lua_shrbtree_pushstat(max_compares);
+    ngx_http_lua_shrbtree_pushstat(writes);
+    ngx_http_lua_shrbtree_pushstat(write_misses);
+    ngx_http_lua_shrbtree_pushstat(nomem);
+    ngx_http_lua_shrbtree_pushstat(evicted);
+    ngx_http_lua_shrbtree_pushstat(expired);
+    ngx_http_lua_shrbtree_pushstat(pinned);
+
+#undef ngx_http_lua_shrbtree_pushstat
+
+    lua_pushnumber(L, st->reads ? (lua_Number) st->compares / st->reads : 0);
+    lua_setfield(L, -2, "avg_compares");
+
+    lua_createtable(L, NGX_HTTP_LUA_SHRBTREE_HIST /* narr */, 0 /* nrec */);
+    for (i = 0; i < NGX_HTTP_LUA_SHRBTREE_HIST; i++) {
+        lua_pushnumber(L, (lua_Number) st->lock_wait[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "lock_wait");
+
+    lua_createtable(L, NGX_HTTP_LUA_SHRBTREE_HIST /* narr */, 0 /* nrec */);
+    for (i = 0; i < NGX_HTTP_LUA_SHRBTREE_HIST; i++) {
+        lua_pushnumber(L, (lua_Number) st->lock_hold[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "lock_hold");
+}
+
+
+/*
+ * adds the counters of the shards of the zone to st.  The slab stats are
+ * read under the lock, which is not timed itself.
+ */
+void
+ngx_http_lua_shrbtree_get_stats(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_stats_t *st)
+{
+    ngx_uint_t                         i, n, slots;
+    ngx_slab_pool_t                   *pool;
+    ngx_http_lua_shrbtree_ctx_t       *shard;
+    ngx_http_lua_shrbtree_counters_t  *c;
+
+    for (n = 0; n < ctx->nshards; n++) {
+        shard = &ctx->shards[n];
+        pool = shard->shpool;
+        c = &shard->sh->counters;
+
+        ngx_shmtx_lock(&pool->mutex);
+
+        st->size += pool->end - pool->start;
+        st->free += pool->pfree << ngx_pagesize_shift;
+
+        slots = ngx_pagesize_shift - pool->min_shift;
+
+        for (i = 0; i < slots; i++) {
+            st->fragmented += (pool->stats[i].total - pool->stats[i].used)
+                              << (i + pool->min_shift);
+        }
+
+        st->nodes += c->nodes;
+        st->reads += c->reads;
+        st->read_misses += c->read_misses;
+        st->compares += c->compares;
+        st->max_compares = ngx_max(st->max_compares, c->max_compares);
+        st->writes += c->writes;
+        st->write_misses += c->write_misses;
+        st->nomem += c->nomem;
+        st->evicted += c->evicted;
+        st->expired += c->expired;
+        st->pinned += shard->sh->pinned;
+
+        for (i = 0; i < NGX_HTTP_LUA_SHRBTREE_HIST; i++) {
+            st->lock_wait[i] += c->lock_wait[i];
+            st->lock_hold[i] += c->lock_hold[i];
+        }
+
+        ngx_shmtx_unlock(&pool->mutex);
+    }
+}
+
+
+#ifndef NGX_LUA_NO_FFI_API
+
+/*
+ * the shard of a key of an ffi call, which takes the builtin number or
+ * string compare of the zone only, or with point set, a number point of
+ * an interval zone
+ */
+static ngx_http_lua_shrbtree_ctx_t *
+ngx_http_lua_shrbtree_ffi_route(ngx_shm_zone_t *zone, int key_type,
+    const u_char *key, size_t key_len, double num_key, ngx_uint_t point,
+    ngx_http_lua_shrbtree_cmp_t *cmp, char **errmsg)
+{
+    ngx_http_lua_shrbtree_ctx_t  *ctx;
+
+    ctx = zone->data;
+
+    cmp->type = ctx->cmp;
+    cmp->index = 0;
+    cmp->probe = 0;
+    cmp->rc = NGX_OK;
+    cmp->compares = 0;
+
+    switch (ctx->cmp) {
+    case NGX_HTTP_LUA_SHRBTREE_CMP_STRING:
+        if (LUA_TSTRING != key_type || key_len > NGX_MAX_UINT32_VALUE) {
+            *errmsg = "bad key, excpected string";
+            return NULL;
+        }
+
+        cmp->kdata = (u_char *) key;
+        cmp->klen = key_len;
+        break;
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER:
+        if (LUA_TNUMBER != key_type) {
+            *errmsg = "bad key, excpected number";
+            return NULL;
+        }
+
+        if (num_key != num_key) {
+            *errmsg = "bad key, NaN";
+            return NULL;
+        }
+
+        cmp->key[0] = num_key;
+        cmp->nkey = 1;
+        break;
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL:
+        if (!point) {
+            *errmsg = "the writes of a cmp=interval zone take the table api";
+            return NULL;
+        }
+
+        if (LUA_TNUMBER != key_type) {
+            *errmsg = "bad key, excpected number";
+            return NULL;
+        }
+
+        if (num_key != num_key) {
+            *errmsg = "bad key, NaN";
+            return NULL;
+        }
+
+        cmp->key[0] = num_key;
+        cmp->nkey = 1;
+        break;
+
+    default:
+        *errmsg = "the zone has no cmp=number, cmp=string or cmp=interval";
+        return NULL;
+    }
+
+    if (1 == ctx->nshards) {
+        return ctx;
+    }
+
+    return &ctx->shards[ngx_http_lua_shrbtree_shard(ctx, cmp)];
+}
+
+
+/*
+ * copies the value of the node out; a string longer than the buffer goes
+ * to a new one from malloc(), which the caller frees by free()
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_ffi_copy(ngx_rbtree_node_t *node, u_char *buf,
+    size_t size, int *value_type, u_char **str_value_buf,
+    size_t *str_value_len, double *num_value, char **errmsg)
+{
+    u_char                        *p;
+    ngx_http_lua_shrbtree_node_t  *srbtn;
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *) &node->data;
+    p = &srbtn->data + srbtn->klen;
+
+    *value_type = srbtn->vtype;
+
+    switch (srbtn->vtype) {
+    case LUA_TBOOLEAN:
+        *num_value = *p;
+        return NGX_OK;
+
+    case LUA_TNUMBER:
+        *num_value = *(lua_Number *) p;
+        return NGX_OK;
+
+    case LUA_TSTRING:
+        if (srbtn->vlen > size) {
+            if (*str_value_buf != buf) {
+                ngx_free(*str_value_buf);
+            }
+
+            *str_value_buf = ngx_alloc(srbtn->vlen, ngx_cycle->log);
+            if (NULL == *str_value_buf) {
+                *str_value_buf = buf;
+                *errmsg = "no memory";
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_memcpy(*str_value_buf, p, srbtn->vlen);
+        *str_value_len = srbtn->vlen;
+        return NGX_OK;
+
+    default: /* a table, left to rbtree:get */
+        return NGX_OK;
+    }
+}
+
+
+/*
+ * rbtree:get{key} for ffi, read without the lock as by
+ * ngx_http_lua_shrbtree_read().  On input, *str_value_len is the size of
+ * *str_value_buf.  NGX_DECLINED if no the key.
+ */
+int
+ngx_http_lua_ffi_shrbtree_get(ngx_shm_zone_t *zone, int key_type,
+    const u_char *key, size_t key_len, double num_key, int *value_type,
+    u_char **str_value_buf, size_t *str_value_len, double *num_value,
+    char **errmsg)
+{
+    u_char                         *buf;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_uint_t                      tries, slot;
+    ngx_atomic_uint_t               seq;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_cmp_t     cmp;
+
+    ctx = ngx_http_lua_shrbtree_ffi_route(zone, key_type, key, key_len,
+                                          num_key, 1, &cmp, errmsg);
+    if (NULL == ctx) {
+        return NGX_ERROR;
+    }
+
+    buf = *str_value_buf;
+    size = *str_value_len;
+
+    for (tries = 0; tries <= NGX_HTTP_LUA_SHRBTREE_READ_TRIES; tries++) {
+
+        /* the last try is under the lock */
+        if (NGX_HTTP_LUA_SHRBTREE_READ_TRIES == tries) {
+            ngx_http_lua_shrbtree_lock(ctx);
+            slot = 0;
+            seq = 0;
+
+        } else {
+            slot = ngx_http_lua_shrbtree_read_begin(ctx->sh, &seq);
+
+            if (seq & 1) {
+                (void) ngx_http_lua_shrbtree_read_end(ctx->sh, slot, seq);
+                ngx_cpu_pause();
+                continue;
+            }
+        }
+
+        cmp.compares = 0;
+
+        node = ngx_http_lua_shrbtree_find(NULL, ctx, &cmp);
+
+        if (NULL != node && ngx_http_lua_shrbtree_expired(node)) {
+            node = NULL;
+        }
+
+        rc = NGX_DECLINED;
+
+        if (NULL != node) {
+            rc = ngx_http_lua_shrbtree_ffi_copy(node, buf, size, value_type,
+                                                str_value_buf, str_value_len,
+                                                num_value, errmsg);
+        }
+
+        if (NGX_HTTP_LUA_SHRBTREE_READ_TRIES == tries) {
+            ngx_http_lua_shrbtree_unlock(ctx);
+
+        } else if (NGX_OK != ngx_http_lua_shrbtree_read_end(ctx->sh, slot,
+                                                             seq))
+        {
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_http_lua_shrbtree_stat_read(ctx, &cmp, node);
+
+        if (NULL != node) {
+            ngx_http_lua_shrbtree_touch(ctx, node);
+        }
+
+        return rc;
+    }
+
+    /* unreachable, the last try is locked */
+    return NGX_ERROR;
+}
+
+
+/*
+ * rbtree:insert/set/replace{key, value, ttl = ttl} for ffi, op is 0, 1 or 2
+ * respectively.  NGX_DECLINED with errmsg as the message of the table api.
+ */
+int
+ngx_http_lua_ffi_shrbtree_store(ngx_shm_zone_t *zone, int op, int key_type,
+    const u_char *key, size_t key_len, double num_key, int value_type,
+    const u_char *str_value, size_t str_value_len, double num_value,
+    double ttl, char **errmsg)
+{
+    u_char                          b;
+    lua_Number                      kn, vn;
+    ngx_msec_t                      expires;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_cmp_t     cmp;
+    ngx_http_lua_shrbtree_item_t    k, v;
+
+    if (NGX_HTTP_LUA_SHRBTREE_INSERT > op
+        || NGX_HTTP_LUA_SHRBTREE_REPLACE < op)
+    {
+        *errmsg = "bad op";
+        return NGX_ERROR;
+    }
+
+    /* and NaN */
+    if (!(ttl >= 0 && ttl <= NGX_HTTP_LUA_SHRBTREE_MAX_TTL)) {
+        *errmsg = "bad ttl";
+        return NGX_ERROR;
+    }
+
+    ctx = ngx_http_lua_shrbtree_ffi_route(zone, key_type, key, key_len,
+                                          num_key, 0, &cmp, errmsg);
+    if (NULL == ctx) {
+        return NGX_ERROR;
+    }
+
+    k.index = 0;
+    k.type = (u_char) key_type;
+
+    if (LUA_TSTRING == key_type) {
+        k.data = (u_char *) key;
+        k.len = key_len;
+
+    } else {
+        kn = num_key;
+        k.data = (u_char *) &kn;
+        k.len = sizeof(lua_Number);
+    }
+
+    v.index = 0;
+    v.type = (u_char) value_type;
+
+    switch (value_type) {
+    case LUA_TBOOLEAN:
+        b = (0 != num_value);
+        v.data = &b;
+        v.len = sizeof(u_char);
+        break;
+
+    case LUA_TNUMBER:
+        vn = num_value;
+        v.data = (u_char *) &vn;
+        v.len = sizeof(lua_Number);
+        break;
+
+    case LUA_TSTRING:
+        if (str_value_len > NGX_MAX_UINT32_VALUE) {
+            *errmsg = "string too long";
+            return NGX_ERROR;
+        }
+
+        v.data = (u_char *) str_value;
+        v.len = str_value_len;
+        break;
+
+    default:
+        *errmsg = "bad type value";
+        return NGX_ERROR;
+    }
+
+    expires = 0;
+
+    if (ttl > 0) {
+        expires = ngx_http_lua_shrbtree_expires((ngx_msec_t) (ttl * 1000));
+    }
+
+    /* a builtin compare doesn't fail */
+    return ngx_http_lua_shrbtree_store_item(NULL, ctx, &cmp, op, &k, &v,
+                                            expires, errmsg);
+}
+
+
+/* rbtree:delete{key} for ffi, NGX_DECLINED if no the key */
+int
+ngx_http_lua_ffi_shrbtree_delete(ngx_shm_zone_t *zone, int key_type,
+    const u_char *key, size_t key_len, double num_key, char **errmsg)
+{
+    ngx_int_t                       rc;
+    ngx_http_lua_shrbtree_ctx_t    *ctx;
+    ngx_http_lua_shrbtree_cmp_t     cmp;
+
+    ctx = ngx_http_lua_shrbtree_ffi_route(zone, key_type, key, key_len,
+                                          num_key, 0, &cmp, errmsg);
+    if (NULL == ctx) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_lua_shrbtree_delete_key(NULL, ctx, &cmp);
+
+    if (NGX_DECLINED == rc) {
+        *errmsg = "no exists";
+    }
+
+    return rc;
+}
+
+#endif /* NGX_LUA_NO_FFI_API */
+
+
+/*
+ * writes the section of the shard at offset, and moves offset past it.  The
+ * nodes are copied SAVE_BATCH a lock hold and written between the holds;
+ * the walk goes on from the last node copied only if the shard wasn't
+ * written meanwhile, otherwise the section is rewritten, the last of
+ * SAVE_TRIES times in one hold.  Returns NGX_ABORT if there's no memory.
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_save_section(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_fd_t fd, off_t *offset, ngx_http_lua_shrbtree_section_t *section)
+{
+    off_t               start, end;
+    u_char             *buf;
+    size_t              size;
+    ngx_int_t           rc;
+    ngx_uint_t          tries, batch;
+    ngx_atomic_uint_t   seq;
+    ngx_rbtree_node_t  *node;
+
+    start = *offset;
+    buf = NULL;
+    size = 0;
+    rc = NGX_OK;
+
+    for (tries = 1; /* void */ ; tries++) {
+        batch = (NGX_HTTP_LUA_SHRBTREE_SAVE_TRIES == tries)
+                ? NGX_MAX_UINT32_VALUE : NGX_HTTP_LUA_SHRBTREE_SAVE_BATCH;
+
+        section->count = 0;
+        section->size = 0;
+        end = start + sizeof(ngx_http_lua_shrbtree_section_t);
+
+        ngx_http_lua_shrbtree_lock(ctx);
+        node = ngx_http_lua_shrbtree_first(&ctx->sh->rbtree);
+
+        for ( ;; ) {
+            buf = ngx_http_lua_shrbtree_save_batch(ctx, &node, batch, buf,
+                                                   &size, &section->count);
+            seq = ctx->sh->seq;
+            ngx_http_lua_shrbtree_unlock(ctx);
+
+            if (buf == NULL) {
+                return NGX_ABORT;
+            }
+
+            if (ngx_http_lua_shrbtree_write(fd, buf, size, end) != NGX_OK) {
+                rc = NGX_ERROR;
+                goto done;
+            }
+
+            section->size += size;
+            end += size;
+
+            if (node == NULL) {
+                goto done;
+            }
+
+            ngx_http_lua_shrbtree_lock(ctx);
+
+            /* the node may be unlinked and freed since */
+            if (ctx->sh->seq != seq) {
+                ngx_http_lua_shrbtree_unlock(ctx);
+                break;
+            }
+        }
+    }
+
+done:
+
+    ngx_free(buf);
+
+    if (rc == NGX_OK) {
+        rc = ngx_http_lua_shrbtree_write(fd, section, sizeof(*section),
+                                         start);
+        *offset = end;
+    }
+
+    return rc;
+}
+
+
+/*
+ * copies the records of up to batch nodes from node on to buf, of size
+ * bytes, and sets node to the next one, NULL at the end, and size to the
+ * bytes copied.  The shard is locked.  Returns buf, or a new buffer if buf
+ * is too small, or NULL on no memory, where buf is freed.
+ */
+static u_char *
+ngx_http_lua_shrbtree_save_batch(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_rbtree_node_t **node, ngx_uint_t batch, u_char *buf, size_t *size,
+    uint64_t *count)
+{
+    u_char                        *p;
+    size_t                         n;
+    ngx_uint_t                     i;
+    ngx_rbtree_t                  *rbtree;
+    ngx_rbtree_node_t             *last;
+    ngx_http_lua_shrbtree_node_t  *srbtn;
+
+    rbtree = &ctx->sh->rbtree;
+    n = 0;
+
+    for (i = 0, last = *node;
+         last != NULL && i < batch;
+         i++, last = ngx_http_lua_shrbtree_next(rbtree, last))
+    {
+        if (ngx_http_lua_shrbtree_expired(last)) {
+            continue;
+        }
+
+        srbtn = (ngx_http_lua_shrbtree_node_t *) &last->data;
+        n += ngx_http_lua_shrbtree_record_size(srbtn);
+    }
+
+    if (buf == NULL || n > *size) {
+        ngx_free(buf);
+
+        buf = ngx_alloc(n ? n : 1, ngx_cycle->log);
+        if (buf == NULL) {
+            return NULL;
+        }
+    }
+
+    p = buf;
+
+    for ( /* void */ ; *node != last;
+         *node = ngx_http_lua_shrbtree_next(rbtree, *node))
+    {
+        if (ngx_http_lua_shrbtree_expired(*node)) {
+            continue;
+        }
+
+        p = ngx_http_lua_shrbtree_record(p, *node);
+        (*count)++;
+    }
+
+    *size = n;
+
+    return buf;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shrbtree_write(ngx_fd_t fd, void *buf, size_t size,
+    off_t offset)
+{
+    u_char   *p;
+    ssize_t   n;
+
+    for (p = buf; size; p += n, size -= n, offset += n) {
+        n = pwrite(fd, p, size, offset);
+        if (n == -1) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_lua_shrbtree_record_size(ngx_http_lua_shrbtree_node_t *srbtn)
+{
+    size_t  size;
+
+    size = offsetof(ngx_http_lua_shrbtree_record_t, node.data)
+           + ngx_http_lua_shrbtree_flat_size(&srbtn->data, srbtn->ktype,
+                                             srbtn->klen)
+           + ngx_http_lua_shrbtree_flat_size(&srbtn->data + srbtn->klen,
+                                             srbtn->vtype, srbtn->vlen);
+
+    return ngx_align(size, 8);
+}
+
+
+/* writes the node as a record with the tables packed, returns its end */
+static u_char *
+ngx_http_lua_shrbtree_record(u_char *p, ngx_rbtree_node_t *node)
+{
+    u_char                          *last;
+    ngx_http_lua_shrbtree_node_t    *srbtn;
+    ngx_http_lua_shrbtree_record_t  *record;
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *) &node->data;
+    record = (ngx_http_lua_shrbtree_record_t *) p;
+
+    /* the ttl left, as the clock of another run isn't the same */
+    record->ttl = node->key ? (ngx_msec_t) (node->key - ngx_current_msec) : 0;
+
+    record->node.ktype = srbtn->ktype;
+    record->node.vtype = srbtn->vtype;
+    record->node.klen = srbtn->klen;
+    record->node.vlen = srbtn->vlen;
+
+    last = ngx_http_lua_shrbtree_flatten(&record->node.data, &srbtn->data,
+                                         &record->node.ktype,
+                                         &record->node.klen);
+    last = ngx_http_lua_shrbtree_flatten(last, &srbtn->data + srbtn->klen,
+                                         &record->node.vtype,
+                                         &record->node.vlen);
+
+    p += ngx_align((size_t) (last - p), 8);
+    ngx_memzero(last, p - last);
+
+    return p;
+}
+
+
+/* the size of the value, of its packed blob if it's a table */
+static size_t
+ngx_http_lua_shrbtree_flat_size(u_char *data, u_char type, size_t len)
+{
+    uint32_t                         n;
+    ngx_http_lua_shrbtree_ltable_t  *ltable;
+
+    if (LUA_TTABLE != type) {
+        return len;
+    }
+
+    ltable = (ngx_http_lua_shrbtree_ltable_t *) data;
+    n = 0;
+
+    return sizeof(ngx_http_lua_shrbtree_packed_t)
+           + ngx_http_lua_shrbtree_flat_fields(ltable->rbtree.root,
+                                               ltable->rbtree.sentinel, &n);
+}
+
+
+static size_t
+ngx_http_lua_shrbtree_flat_fields(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel, uint32_t *nfields)
+{
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
+
+    if (node == sentinel) {
+        return 0;
+    }
+
+    (*nfields)++;
+
+    lfield = (ngx_http_lua_shrbtree_lfield_t *) &node->data;
+
+    return sizeof(ngx_http_lua_shrbtree_pentry_t)
+           + offsetof(ngx_http_lua_shrbtree_lfield_t, data)
+           + ngx_http_lua_shrbtree_flat_size(&lfield->data, lfield->ktype,
+                                             lfield->klen)
+           + ngx_http_lua_shrbtree_flat_size(&lfield->data + lfield->klen,
+                                             lfield->vtype, lfield->vlen)
+           + ngx_http_lua_shrbtree_flat_fields(node->left, sentinel, nfields)
+           + ngx_http_lua_shrbtree_flat_fields(node->right, sentinel,
+                                               nfields);
+}
+
+
+/*
+ * copies the value to p, a table as the blob pack_ltable would write, and
+ * then sets type and len to the blob's; returns the end
+ */
+static u_char *
+ngx_http_lua_shrbtree_flatten(u_char *p, u_char *data, u_char *type,
+    uint32_t *len)
+{
+    u_char                          *last;
+    uint32_t                         i, n;
+    ngx_rbtree_node_t               *root, *sentinel;
+    ngx_http_lua_shrbtree_ltable_t  *ltable;
+    ngx_http_lua_shrbtree_packed_t  *packed;
+    ngx_http_lua_shrbtree_pentry_t  *dir;
+
+    if (LUA_TTABLE != *type) {
+        return ngx_cpymem(p, data, *len);
+    }
+
+    ltable = (ngx_http_lua_shrbtree_ltable_t *) data;
+    root = ltable->rbtree.root;
+    sentinel = ltable->rbtree.sentinel;
+
+    n = 0;
+    (void) ngx_http_lua_shrbtree_flat_fields(root, sentinel, &n);
+
+    packed = (ngx_http_lua_shrbtree_packed_t *) p;
+    dir = (ngx_http_lua_shrbtree_pentry_t *) &packed[1];
+
+    i = 0;
+    last = ngx_http_lua_shrbtree_flatten_fields(p, (u_char *) &dir[n], root,
+                                                sentinel, dir, &i);
+
+    packed->nfields = n;
+    packed->size = last - p;
+
+    ngx_sort(dir, n, sizeof(ngx_http_lua_shrbtree_pentry_t),
+             ngx_http_lua_shrbtree_cmp_pentries);
+
+    *type = NGX_HTTP_LUA_SHRBTREE_TPACKED;
+    *len = last - p;
+
+    return last;
+}
+
+
+static u_char *
+ngx_http_lua_shrbtree_flatten_fields(u_char *blob, u_char *p,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel,
+    ngx_http_lua_shrbtree_pentry_t *dir, uint32_t *i)
+{
+    ngx_http_lua_shrbtree_lfield_t  *lfield, *field;
+
+    if (node == sentinel) {
+        return p;
+    }
+
+    lfield = (ngx_http_lua_shrbtree_lfield_t *) &node->data;
+    field = (ngx_http_lua_shrbtree_lfield_t *) p;
+
+    field->ktype = lfield->ktype;
+    field->vtype = lfield->vtype;
+    field->klen = lfield->klen;
+    field->vlen = lfield->vlen;
+
+    p = ngx_http_lua_shrbtree_flatten(&field->data, &lfield->data,
+                                      &field->ktype, &field->klen);
+    p = ngx_http_lua_shrbtree_flatten(p, &lfield->data + lfield->klen,
+                                      &field->vtype, &field->vlen);
+
+    dir[*i].hash = ngx_crc32_short(&field->data, field->klen);
+    dir[*i].offset = (u_char *) field - blob;
+    (*i)++;
+
+    p = ngx_http_lua_shrbtree_flatten_fields(blob, p, node->left, sentinel,
+                                             dir, i);
+    return ngx_http_lua_shrbtree_flatten_fields(blob, p, node->right,
+                                                sentinel, dir, i);
+}
+
+
+/*
+ * checks a value of a snapshot record: its length for its type, and the
+ * directory and fields of a packed table, which must be in the blob
+ */
+static ngx_int_t
+ngx_http_lua_shrbtree_check_flat(u_char *data, u_char type, uint32_t len,
+    ngx_uint_t depth)
+{
+    uint32_t                         i, rest, head;
+    ngx_http_lua_shrbtree_packed_t  *packed;
+    ngx_http_lua_shrbtree_pentry_t  *dir;
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
+
+    switch (type) {
+    case LUA_TBOOLEAN:
+        return len == sizeof(u_char) ? NGX_OK : NGX_DECLINED;
+
+    case LUA_TNUMBER:
+        return len == sizeof(lua_Number) ? NGX_OK : NGX_DECLINED;
+
+    case LUA_TSTRING:
+        return NGX_OK;
+
+    case NGX_HTTP_LUA_SHRBTREE_TPACKED:
+        break;
+
+    default:
+        return NGX_DECLINED;
+    }
+
+    packed = (ngx_http_lua_shrbtree_packed_t *) data;
+
+    if (NGX_HTTP_LUA_SHRBTREE_MAX_NESTING == depth
+        || len < sizeof(ngx_http_lua_shrbtree_packed_t)
+        || packed->size != len
+        || packed->nfields > (len - sizeof(ngx_http_lua_shrbtree_packed_t))
+                             / sizeof(ngx_http_lua_shrbtree_pentry_t))
+    {
+        return NGX_DECLINED;
+    }
+
+    dir = (ngx_http_lua_shrbtree_pentry_t *) &packed[1];
+    head = (u_char *) &dir[packed->nfields] - data;
+
+    for (i = 0; i < packed->nfields; i++) {
+        if (dir[i].offset < head
+            || dir[i].offset > len
+            || len - dir[i].offset
+               < offsetof(ngx_http_lua_shrbtree_lfield_t, data))
+        {
+            return NGX_DECLINED;
+        }
+
+        lfield = (ngx_http_lua_shrbtree_lfield_t *) (data + dir[i].offset);
+        rest = len - dir[i].offset
+               - offsetof(ngx_http_lua_shrbtree_lfield_t, data);
+
+        if (lfield->klen > rest
+            || lfield->vlen > rest - lfield->klen
+            || ngx_http_lua_shrbtree_check_flat(&lfield->data, lfield->ktype,
+                                                lfield->klen, depth + 1)
+               != NGX_OK
+            || ngx_http_lua_shrbtree_check_flat(&lfield->data + lfield->klen,
+                                                lfield->vtype, lfield->vlen,
+                                                depth + 1)
+               != NGX_OK)
+        {
+            return NGX_DECLINED;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_build(ngx_rbtree_node_t **nodes, ngx_uint_t n,
+    ngx_rbtree_node_t *sentinel, ngx_uint_t depth, ngx_uint_t red)
+{
+    ngx_uint_t         m;
+    ngx_rbtree_node_t *node;
+
+    if (0 == n) {
+        return sentinel;
+    }
+
+    m = n / 2;
+    node = nodes[m];
+
+    node->left = ngx_http_lua_shrbtree_build(nodes, m, sentinel, depth + 1,
+                                             red);
+    node->right = ngx_http_lua_shrbtree_build(nodes + m + 1, n - m - 1,
+                                              sentinel, depth + 1, red);
+
+    if (node->left != sentinel) {
+        node->left->parent = node;
+    }
+
+    if (node->right != sentinel) {
+        node->right->parent = node;
+    }
+
+    if (depth == red && depth > 0) {
+        ngx_rbt_red(node);
+
+    } else {
+        ngx_rbt_black(node);
+    }
+
+    return node;
+}
+
+
+/* looks the field up in a table, or in a packed table */
+static ngx_http_lua_shrbtree_lfield_t *
+ngx_http_lua_shrbtree_get_lfield(u_char type, u_char *data, void *kdata,
+    size_t klen)
+{
+    ngx_int_t                      rc;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_lua_shrbtree_ltable_t *ltable;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+    uint32_t  hash;
+
+    if (NGX_HTTP_LUA_SHRBTREE_TPACKED == type) {
+        return ngx_http_lua_shrbtree_get_pfield(data, kdata, klen);
+    }
+
+    ltable = (ngx_http_lua_shrbtree_ltable_t *) data;
+
+    node = ltable->rbtree.root;
+    sentinel = ltable->rbtree.sentinel;
+    hash = ngx_crc32_short(kdata, klen);
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+        lfield = (ngx_http_lua_shrbtree_lfield_t *) &node->data;
+
+        rc = ngx_memn2cmp(kdata, &lfield->data, klen, (size_t)lfield->klen);
+
+        if (rc == 0) {
+            return lfield;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/* binary search of the directory, then the fields of the same hash */
+static ngx_http_lua_shrbtree_lfield_t *
+ngx_http_lua_shrbtree_get_pfield(u_char *blob, void *kdata, size_t klen)
+{
+    uint32_t                        hash, lo, hi, mid;
+    ngx_http_lua_shrbtree_packed_t  *packed;
+    ngx_http_lua_shrbtree_pentry_t  *dir;
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
 
-    srbtn->ktype = ktype;
-    srbtn->vtype = vtype;
-    srbtn->klen = klen;
-    srbtn->vlen = vlen;
-    p = ngx_copy(&srbtn->data, kdata, klen);
-    ngx_memcpy(p, vdata, vlen);
+    packed = (ngx_http_lua_shrbtree_packed_t *) blob;
+    dir = (ngx_http_lua_shrbtree_pentry_t *) &packed[1];
+    hash = ngx_crc32_short(kdata, klen);
 
-    lua_pop(L, 2); /* pop key, value */
+    lo = 0;
+    hi = packed->nfields;
 
-    sentinel = ctx->sh->rbtree.sentinel;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
 
-    if (NULL != parent) {
-        *position = node;
-        node->parent = parent;
-        node->left = sentinel;
-        node->right = sentinel;
-        ngx_rbt_red(node);
+        if (dir[mid].hash < hash) {
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
     }
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    for ( /* void */ ; lo < packed->nfields && dir[lo].hash == hash; lo++) {
+        lfield = (ngx_http_lua_shrbtree_lfield_t *) (blob + dir[lo].offset);
 
-    lua_pushboolean(L, 1);
-    return 1;
+        if (0 == ngx_memn2cmp(kdata, &lfield->data, klen, lfield->klen)) {
+            return lfield;
+        }
+    }
+
+    return NULL;
 }
 
 
-static int
-ngx_http_lua_shrbtree_delete(lua_State *L)
+static ngx_rbtree_node_t*
+ngx_http_lua_shrbtree_get_node(lua_State *L, ngx_rbtree_t *rbtree,
+    ngx_http_lua_shrbtree_cmp_t *cmp)
 {
-    ngx_shm_zone_t               *zone;
-    ngx_http_lua_shrbtree_ctx_t  *ctx;
-    ngx_rbtree_node_t            *node;
-    ngx_http_lua_shrbtree_node_t *srbtn;
-    ngx_http_lua_shrbtree_ltable_t *ltable;
+    return ngx_http_lua_shrbtree_get_rawnode(L, rbtree, cmp, NULL, NULL);
+}
 
-    ngx_http_lua_shrbtree_luaL_checknarg(L, 2);
-    luaL_checktype(L, 1, LUA_TTABLE);
-    luaL_checktype(L, 2, LUA_TTABLE);
-    luaL_argcheck(L, 1 == lua_objlen(L, 1), 1, "expected 1 elements");
-    luaL_argcheck(L, 2 == lua_objlen(L, 2), 2, "expected 2 elements");
 
-    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
-    ctx = zone->data;
+static ngx_rbtree_node_t*
+ngx_http_lua_shrbtree_get_rawnode(lua_State *L, ngx_rbtree_t *rbtree,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t **parent,
+    ngx_rbtree_node_t ***position)
+{
+    return ngx_http_lua_shrbtree_descend(L, rbtree, cmp, &rbtree->root,
+                                         parent, position);
+}
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
-    node = ngx_http_lua_shrbtree_get_node(L, &ctx->sh->rbtree);
-    if (NULL == node) {
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
-        lua_pushboolean(L, 0);
-        lua_pushliteral(L, "no exists");
-        return 2;
+
+/*
+ * get_rawnode, starting from finger, which is a node before the key.  The
+ * search climbs to the smallest subtree of the finger that can hold the
+ * key, so the compares grow with the log of the distance from the finger,
+ * not with the size of the tree.  The caller must hold the lock.
+ */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_get_finger(lua_State *L, ngx_rbtree_t *rbtree,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t *finger,
+    ngx_rbtree_node_t **parent, ngx_rbtree_node_t ***position)
+{
+    ngx_int_t            rc;
+    ngx_rbtree_node_t   *node, *up;
+    ngx_rbtree_node_t  **p;
+
+    if (NULL == finger) {
+        return ngx_http_lua_shrbtree_get_rawnode(L, rbtree, cmp, parent,
+                                                 position);
     }
 
-    /* first free table rbtree, if the key/value is a table */
-    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
-    if (LUA_TTABLE ==  srbtn->ktype) {
-        ltable = (ngx_http_lua_shrbtree_ltable_t *)&srbtn->data;
-        ngx_http_lua_shrbtree_destroy_ltable(ctx->shpool, ltable);
+    /*
+     * a right child has the same upper bound as its parent; the first
+     * parent, reached from its left child, that comes after the key bounds
+     * the subtree of that child
+     */
+    for (node = finger; NULL != node->parent; node = up) {
+        up = node->parent;
+
+        if (node == up->right) {
+            continue;
+        }
+
+        rc = ngx_http_lua_shrbtree_compare(L, cmp, up);
+        if (NGX_OK != cmp->rc) {
+            return NULL;
+        }
+
+        if (0 > rc) {
+            break;
+        }
+
+        if (0 == rc) {
+            *parent = NULL;
+            *position = NULL;
+            return up;
+        }
     }
-    if (LUA_TTABLE ==  srbtn->vtype) {
-        ltable = (ngx_http_lua_shrbtree_ltable_t *)((&srbtn->data)
-                                                    + srbtn->klen);
-        ngx_http_lua_shrbtree_destroy_ltable(ctx->shpool, ltable);
+
+    if (NULL == node->parent) {
+        p = &rbtree->root;
+
+    } else if (node == node->parent->left) {
+        p = &node->parent->left;
+
+    } else {
+        p = &node->parent->right;
     }
 
-    ngx_rbtree_delete(&ctx->sh->rbtree, node);
-    ngx_slab_free_locked(ctx->shpool, node);
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    return ngx_http_lua_shrbtree_descend(L, rbtree, cmp, p, parent, position);
+}
 
-    lua_pushboolean(L, 1);
-    return 1;
+
+/* searches the subtree at *p, see get_rawnode */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_descend(lua_State *L, ngx_rbtree_t *rbtree,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_rbtree_node_t **p,
+    ngx_rbtree_node_t **parent, ngx_rbtree_node_t ***position)
+{
+    ngx_int_t                    rc;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_uint_t                   depth;
+
+    sentinel = rbtree->sentinel;
+    if (*p == sentinel) {
+        if (parent)   *parent = NULL;
+        if (position) *position = NULL;
+        return NULL;
+    }
+
+    node = *p;
+    for (depth = 0; /* void */; depth++) {
+        rc = ngx_http_lua_shrbtree_compare(L, cmp, node);
+        if (NGX_OK != cmp->rc) {
+            return NULL;
+        }
+
+        if (0 > rc) {
+            p = &node->left;
+
+        } else if (0 < rc) {
+            p = &node->right;
+
+        } else {
+            if (parent)   *parent = NULL;
+            if (position) *position = NULL;
+            return node;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        node = *p;
+
+        /* a lockless reader may meet a retired node or a cycle of rotation */
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            if (parent)   *parent = NULL;
+            if (position) *position = NULL;
+            return NULL;
+        }
+    }
+    if (parent)   *parent = node;
+    if (position) *position = p;
+
+    return NULL;
 }
 
 
-static ngx_http_lua_shrbtree_lfield_t *
-ngx_http_lua_shrbtree_get_lfield(ngx_http_lua_shrbtree_ltable_t *ltable,
-    void *kdata, size_t klen)
+/*
+ * the first node after the key (NGX_HTTP_LUA_SHRBTREE_GT), the first node
+ * not before it (NGX_HTTP_LUA_SHRBTREE_GE), and likewise the last node
+ * before the key (NGX_HTTP_LUA_SHRBTREE_LT) or not after it
+ * (NGX_HTTP_LUA_SHRBTREE_LE), found in one descent
+ */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_get_bound(lua_State *L, ngx_rbtree_t *rbtree,
+    ngx_http_lua_shrbtree_cmp_t *cmp, ngx_uint_t op)
 {
-    ngx_int_t                      rc;
-    ngx_rbtree_node_t              *node, *sentinel;
-    ngx_http_lua_shrbtree_lfield_t *lfield;
-    uint32_t  hash;
+    ngx_int_t          rc;
+    ngx_uint_t         depth;
+    ngx_rbtree_node_t *node, *sentinel, *found;
 
-    node = ltable->rbtree.root;
-    sentinel = ltable->rbtree.sentinel;
-    hash = ngx_crc32_short(kdata, klen);
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+    found = NULL;
 
-    while (node != sentinel) {
+    for (depth = 0; node != sentinel; depth++) {
+
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            return NULL;
+        }
+
+        rc = ngx_http_lua_shrbtree_compare(L, cmp, node);
+        if (NGX_OK != cmp->rc) {
+            return NULL;
+        }
+
+        if (NGX_HTTP_LUA_SHRBTREE_LE == op || NGX_HTTP_LUA_SHRBTREE_LT == op) {
+            if (0 < rc || (0 == rc && NGX_HTTP_LUA_SHRBTREE_LE == op)) {
+                found = node;
+                node = node->right;
+
+            } else {
+                node = node->left;
+            }
 
-        if (hash < node->key) {
-            node = node->left;
             continue;
         }
 
-        if (hash > node->key) {
+        if (0 > rc || (0 == rc && NGX_HTTP_LUA_SHRBTREE_GE == op)) {
+            found = node;
+            node = node->left;
+
+        } else {
             node = node->right;
-            continue;
         }
+    }
 
-        /* hash == node->key */
-        lfield = (ngx_http_lua_shrbtree_lfield_t *) &node->data;
+    return found;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_first(ngx_rbtree_t *rbtree)
+{
+    ngx_uint_t         depth;
+    ngx_rbtree_node_t *node, *sentinel;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    if (node == sentinel) {
+        return NULL;
+    }
+
+    for (depth = 0; node->left != sentinel; depth++) {
+        node = node->left;
+
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            return NULL;
+        }
+    }
+
+    return node;
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_last(ngx_rbtree_t *rbtree)
+{
+    ngx_uint_t         depth;
+    ngx_rbtree_node_t *node, *sentinel;
+
+    node = rbtree->root;
+    sentinel = rbtree->sentinel;
+
+    if (node == sentinel) {
+        return NULL;
+    }
+
+    for (depth = 0; node->right != sentinel; depth++) {
+        node = node->right;
+
+        if (NULL == node || NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+            return NULL;
+        }
+    }
+
+    return node;
+}
+
+
+/* in-order successor, or NULL at the end */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_next(ngx_rbtree_t *rbtree, ngx_rbtree_node_t *node)
+{
+    ngx_uint_t         depth;
+    ngx_rbtree_node_t *sentinel, *parent;
+
+    sentinel = rbtree->sentinel;
+
+    if (node->right != sentinel) {
+        node = node->right;
+
+        for (depth = 0; NULL != node && node->left != sentinel; depth++) {
+            if (NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+                return NULL;
+            }
+
+            node = node->left;
+        }
+
+        return node;
+    }
+
+    /* a lockless reader may meet retired nodes chained by parent links */
+    for (depth = 0; depth < NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH; depth++) {
+        parent = node->parent;
+
+        if (NULL == parent) {
+            return NULL;
+        }
+
+        if (node == parent->left) {
+            return parent;
+        }
+
+        node = parent;
+    }
+
+    return NULL;
+}
+
+
+/* in-order predecessor, or NULL at the beginning */
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_prev(ngx_rbtree_t *rbtree, ngx_rbtree_node_t *node)
+{
+    ngx_uint_t         depth;
+    ngx_rbtree_node_t *sentinel, *parent;
+
+    sentinel = rbtree->sentinel;
+
+    if (node->left != sentinel) {
+        node = node->left;
+
+        for (depth = 0; NULL != node && node->right != sentinel; depth++) {
+            if (NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH == depth) {
+                return NULL;
+            }
+
+            node = node->right;
+        }
+
+        return node;
+    }
+
+    for (depth = 0; depth < NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH; depth++) {
+        parent = node->parent;
+
+        if (NULL == parent) {
+            return NULL;
+        }
+
+        if (node == parent->right) {
+            return parent;
+        }
+
+        node = parent;
+    }
+
+    return NULL;
+}
+
+/* compare the key to the node's, in C or by calling the lua function */
+static ngx_int_t
+ngx_http_lua_shrbtree_compare(lua_State *L, ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_rbtree_node_t *node)
+{
+    ngx_int_t                    rc;
+    ngx_http_lua_shrbtree_node_t *srbtn;
+
+    srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
+
+    cmp->compares++;
+
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_LUA != cmp->type) {
+        return ngx_http_lua_shrbtree_cmp_node(cmp, srbtn);
+    }
+
+    lua_pushvalue(L, cmp->index);
+    lua_pushvalue(L, cmp->probe);
+    ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
+                                     srbtn->klen);
+    if (0 != lua_pcall(L, 2, 1, 0)) {
+        /* the error message is left to the caller */
+        cmp->rc = NGX_ERROR;
+        return 0;
+    }
+
+    rc = (ngx_int_t)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_lua_shrbtree_cmp_node(ngx_http_lua_shrbtree_cmp_t *cmp,
+    ngx_http_lua_shrbtree_node_t *srbtn)
+{
+    ngx_uint_t i, n;
+    lua_Number key[NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE];
+
+    switch (cmp->type) {
+    case NGX_HTTP_LUA_SHRBTREE_CMP_STRING:
+        if (LUA_TSTRING != srbtn->ktype) {
+            return LUA_TSTRING < srbtn->ktype ? -1 : 1;
+        }
+
+        return ngx_memn2cmp(cmp->kdata, &srbtn->data, cmp->klen,
+                            srbtn->klen);
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER:
+        if (LUA_TNUMBER != srbtn->ktype) {
+            return LUA_TNUMBER < srbtn->ktype ? -1 : 1;
+        }
+
+        ngx_memcpy(&key[0], &srbtn->data, sizeof(lua_Number));
+
+        return (cmp->key[0] > key[0]) - (cmp->key[0] < key[0]);
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_TUPLE:
+        n = ngx_http_lua_shrbtree_tuple(srbtn, key, cmp->nkey);
+        if (0 == n) {
+            return LUA_TNUMBER < srbtn->ktype ? -1 : 1;
+        }
+
+        for (i = 0; i < n && i < cmp->nkey; i++) {
+            if (cmp->key[i] != key[i]) {
+                return cmp->key[i] < key[i] ? -1 : 1;
+            }
+        }
+
+        return (cmp->nkey > n) - (cmp->nkey < n);
+
+    case NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL:
+        n = ngx_http_lua_shrbtree_tuple(srbtn, key, 2);
+        if (0 == n) {
+            return LUA_TNUMBER < srbtn->ktype ? -1 : 1;
+        }
 
-        rc = ngx_memn2cmp(kdata, &lfield->data, klen, (size_t)lfield->klen);
+        if (1 == n) {
+            key[1] = key[0];
+        }
 
-        if (rc == 0) {
-            return lfield;
+        /* a point inside, or a range overlapping, the node is equal */
+        if (cmp->key[cmp->nkey - 1] < key[0]) {
+            return -1;
         }
 
-        node = (rc < 0) ? node->left : node->right;
+        if (cmp->key[0] > key[1]) {
+            return 1;
+        }
+
+        return 0;
     }
 
-    return NULL;
+    return 0;
 }
 
 
-static ngx_rbtree_node_t*
-ngx_http_lua_shrbtree_get_node(lua_State *L, ngx_rbtree_t *rbtree)
+/* orders two probes of a builtin compare */
+static ngx_int_t
+ngx_http_lua_shrbtree_cmp_probes(const void *one, const void *two)
 {
-    return ngx_http_lua_shrbtree_get_rawnode(L, rbtree, NULL, NULL);
-}
+    ngx_uint_t                   i;
+    ngx_http_lua_shrbtree_cmp_t  *a, *b;
 
+    a = *(ngx_http_lua_shrbtree_cmp_t **) one;
+    b = *(ngx_http_lua_shrbtree_cmp_t **) two;
 
-static ngx_rbtree_node_t*
-ngx_http_lua_shrbtree_get_rawnode(lua_State *L, ngx_rbtree_t *rbtree,
-    ngx_rbtree_node_t **parent, ngx_rbtree_node_t ***position)
-{
-    ngx_int_t                    rc;
-    ngx_rbtree_node_t            *node, *sentinel;
-    ngx_rbtree_node_t            **p;
-    ngx_http_lua_shrbtree_node_t *srbtn;
-    ngx_int_t cmpf_index;
+    if (NGX_HTTP_LUA_SHRBTREE_CMP_STRING == a->type) {
+        return ngx_memn2cmp(a->kdata, b->kdata, a->klen, b->klen);
+    }
 
-    p = &rbtree->root;
-    sentinel = rbtree->sentinel;
-    if (*p == sentinel) {
-        if (parent)   *parent = NULL;
-        if (position) *position = NULL;
-        return NULL;
+    for (i = 0; i < a->nkey && i < b->nkey; i++) {
+        if (a->key[i] != b->key[i]) {
+            return a->key[i] < b->key[i] ? -1 : 1;
+        }
     }
 
-    node = *p;
-    cmpf_index = lua_objlen(L, 2);
-    for (;;) {
-        lua_rawgeti(L, 2, cmpf_index);
-        lua_rawgeti(L, 2, 1);
-        srbtn = (ngx_http_lua_shrbtree_node_t *)&node->data;
-        ngx_http_lua_shrbtree_pushlvalue(L, &srbtn->data, srbtn->ktype,
-                                         srbtn->klen);
-        lua_call(L, 2, 1);
+    return (a->nkey > b->nkey) - (a->nkey < b->nkey);
+}
 
-        rc = (ngx_int_t)lua_tonumber(L, -1);
-        lua_pop(L, 1);
-        if (0 > rc) {
-            p = &node->left;
 
-        } else if (0 < rc) {
-            p = &node->right;
+/*
+ * fill key[] with up to n leading numbers of a number or a table key,
+ * returns how many numbers are found
+ */
+static ngx_uint_t
+ngx_http_lua_shrbtree_tuple(ngx_http_lua_shrbtree_node_t *srbtn,
+    lua_Number *key, ngx_uint_t n)
+{
+    ngx_uint_t                     i;
+    lua_Number                     index;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
 
-        } else {
-            if (parent)   *parent = NULL;
-            if (position) *position = NULL;
-            return node;
-        }
+    if (LUA_TNUMBER == srbtn->ktype) {
+        ngx_memcpy(&key[0], &srbtn->data, sizeof(lua_Number));
+        return 1;
+    }
 
-        if (*p == sentinel) {
+    if (LUA_TTABLE != srbtn->ktype
+        && NGX_HTTP_LUA_SHRBTREE_TPACKED != srbtn->ktype)
+    {
+        return 0;
+    }
+
+    /* one more than asked, so that a longer key compares greater */
+    for (i = 0; i <= n && i < NGX_HTTP_LUA_SHRBTREE_TUPLE_SIZE; i++) {
+        index = (lua_Number)(i + 1);
+        lfield = ngx_http_lua_shrbtree_get_lfield(srbtn->ktype, &srbtn->data,
+                                                  &index, sizeof(lua_Number));
+        if (NULL == lfield || LUA_TNUMBER != lfield->vtype) {
             break;
         }
 
-        node = *p;
+        ngx_memcpy(&key[i], &lfield->data + lfield->klen,
+                   sizeof(lua_Number));
     }
-    if (parent)   *parent = node;
-    if (position) *position = p;
 
-    return NULL;
+    return i;
 }
 
 
@@ -577,7 +8397,7 @@ ngx_http_lua_shrbtree_pushlvalue(lua_State *L, u_char *data, u_char type,
 {
     switch (type) {
     case LUA_TBOOLEAN:
-        lua_pushboolean(L, *(int *)data);
+        lua_pushboolean(L, *data);
         break;
     case LUA_TNUMBER:
         lua_pushnumber(L, *(lua_Number *)data);
@@ -589,46 +8409,279 @@ ngx_http_lua_shrbtree_pushlvalue(lua_State *L, u_char *data, u_char type,
         ngx_http_lua_shrbtree_pushltable(L, (ngx_http_lua_shrbtree_ltable_t *)
                                          data);
         break;
+    case NGX_HTTP_LUA_SHRBTREE_TPACKED:
+        ngx_http_lua_shrbtree_pushpacked(L, data);
+        break;
     default:
         luaL_error(L, "bad type of value");
     }
 }
 
 
+/*
+ * the fields are walked with a stack of the nodes; a nested table is pushed
+ * in turn, its nesting is bounded by luaL_checklvalue
+ */
 static void
 ngx_http_lua_shrbtree_pushltable(lua_State *L,
     ngx_http_lua_shrbtree_ltable_t *ltable)
 {
-    ngx_rbtree_node_t *root = ltable->rbtree.root;
-    ngx_rbtree_node_t *sentinel = ltable->rbtree.sentinel;
-    lua_newtable(L);
-    ngx_http_lua_shrbtree_pushlfield(L, root, sentinel);
+    ngx_uint_t                      n;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    ngx_rbtree_node_t *stack[NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH];
+
+    /* the table, a key and a value */
+    luaL_checkstack(L, 3, "table nested too deep");
+
+    lua_createtable(L, 0 /* narr */, ltable->nfields /* nrec */);
+
+    sentinel = ltable->rbtree.sentinel;
+    node = ltable->rbtree.root;
+    n = 0;
+
+    if (node != sentinel && NULL != node) {
+        stack[n++] = node;
+    }
+
+    while (n) {
+        node = stack[--n];
+
+        lfield = (ngx_http_lua_shrbtree_lfield_t *)&node->data;
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data, lfield->ktype,
+                                         lfield->klen);
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
+                                         lfield->vtype, lfield->vlen);
+        lua_rawset(L, -3);
+
+        /*
+         * the stack only overflows if a writer changed the tree under a
+         * lockless read, which is then retried
+         */
+        if (NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH - n < 2) {
+            luaL_error(L, "table changed while read");
+            return;
+        }
+
+        if (node->right != sentinel && NULL != node->right) {
+            stack[n++] = node->right;
+        }
+
+        if (node->left != sentinel && NULL != node->left) {
+            stack[n++] = node->left;
+        }
+    }
 }
 
 
 static void
-ngx_http_lua_shrbtree_pushlfield(lua_State *L, ngx_rbtree_node_t *node,
-    ngx_rbtree_node_t *sentinel)
+ngx_http_lua_shrbtree_pushpacked(lua_State *L, u_char *blob)
 {
-    ngx_http_lua_shrbtree_lfield_t *lfield;
+    uint32_t                        i;
+    ngx_http_lua_shrbtree_packed_t  *packed;
+    ngx_http_lua_shrbtree_pentry_t  *dir;
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
+
+    packed = (ngx_http_lua_shrbtree_packed_t *) blob;
+    dir = (ngx_http_lua_shrbtree_pentry_t *) &packed[1];
+
+    lua_createtable(L, 0 /* narr */, packed->nfields /* nrec */);
+
+    for (i = 0; i < packed->nfields; i++) {
+        lfield = (ngx_http_lua_shrbtree_lfield_t *) (blob + dir[i].offset);
+
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data, lfield->ktype,
+                                         lfield->klen);
+        ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
+                                         lfield->vtype, lfield->vlen);
+        lua_rawset(L, -3);
+    }
+}
+
+
+/*
+ * with the packed encoding, pushes the blob of the table at index and
+ * returns its index, otherwise returns index.  Tables are packed before
+ * the zone is locked and copied by tolvalue with the node.
+ */
+static int
+ngx_http_lua_shrbtree_luaL_pack(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    int index)
+{
+    size_t  size;
+    u_char  *blob;
+
+    if (!ctx->packed || LUA_TTABLE != lua_type(L, index)) {
+        return index;
+    }
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    size = ngx_http_lua_shrbtree_packed_size(L, index);
+    if (size > NGX_MAX_UINT32_VALUE) {
+        return luaL_error(L, "too large table");
+    }
+
+    blob = lua_newuserdata(L, size);
+    ngx_http_lua_shrbtree_pack_ltable(L, index, blob);
+
+    return lua_gettop(L);
+}
+
+
+static size_t
+ngx_http_lua_shrbtree_packed_size(lua_State *L, int index)
+{
+    int     i;
+    size_t  size, len;
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    size = sizeof(ngx_http_lua_shrbtree_packed_t);
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        size += sizeof(ngx_http_lua_shrbtree_pentry_t)
+                + offsetof(ngx_http_lua_shrbtree_lfield_t, data);
+
+        for (i = -2; i < 0; i++) {
+            switch (lua_type(L, i)) {
+            case LUA_TBOOLEAN:
+                size += sizeof(u_char);
+                break;
+
+            case LUA_TNUMBER:
+                size += sizeof(lua_Number);
+                break;
+
+            case LUA_TSTRING:
+                lua_tolstring(L, i, &len);
+                size += len;
+                break;
+
+            default: /* LUA_TTABLE, checked by luaL_checklvalue */
+                size += ngx_http_lua_shrbtree_packed_size(L, i);
+            }
+        }
+
+        lua_pop(L, 1);
+    }
+
+    return size;
+}
+
+
+/* writes the blob of the table at index, returns the end of the blob */
+static u_char *
+ngx_http_lua_shrbtree_pack_ltable(lua_State *L, int index, u_char *blob)
+{
+    u_char                          *p;
+    uint32_t                        i, n;
+    ngx_http_lua_shrbtree_packed_t  *packed;
+    ngx_http_lua_shrbtree_pentry_t  *dir;
+    ngx_http_lua_shrbtree_lfield_t  *lfield;
+
+    if (index < 0) {
+        index = lua_gettop(L) + index + 1;
+    }
+
+    n = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        n++;
+        lua_pop(L, 1);
+    }
+
+    packed = (ngx_http_lua_shrbtree_packed_t *) blob;
+    dir = (ngx_http_lua_shrbtree_pentry_t *) &packed[1];
+    p = (u_char *) &dir[n];
+
+    i = 0;
+
+    lua_pushnil(L);
+    while (lua_next(L, index)) {
+        lfield = (ngx_http_lua_shrbtree_lfield_t *) p;
+
+        p = ngx_http_lua_shrbtree_pack_lvalue(L, -2, &lfield->data,
+                                              &lfield->ktype, &lfield->klen);
+        p = ngx_http_lua_shrbtree_pack_lvalue(L, -1, p, &lfield->vtype,
+                                              &lfield->vlen);
+
+        dir[i].hash = ngx_crc32_short(&lfield->data, lfield->klen);
+        dir[i].offset = (u_char *) lfield - blob;
+        i++;
+
+        lua_pop(L, 1);
+    }
+
+    packed->nfields = n;
+    packed->size = p - blob;
+
+    ngx_sort(dir, n, sizeof(ngx_http_lua_shrbtree_pentry_t),
+             ngx_http_lua_shrbtree_cmp_pentries);
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_lua_shrbtree_pack_lvalue(lua_State *L, int index, u_char *p,
+    u_char *type, uint32_t *len)
+{
+    size_t       size;
+    u_char      *last;
+    lua_Number   n;
+    const char  *str;
+
+    switch (lua_type(L, index)) {
+    case LUA_TBOOLEAN:
+        *p = (u_char) lua_toboolean(L, index);
+        *type = LUA_TBOOLEAN;
+        *len = sizeof(u_char);
+        return p + 1;
+
+    case LUA_TNUMBER:
+        n = lua_tonumber(L, index);
+        *type = LUA_TNUMBER;
+        *len = sizeof(lua_Number);
+        return ngx_cpymem(p, &n, sizeof(lua_Number));
+
+    case LUA_TSTRING:
+        str = lua_tolstring(L, index, &size);
+        *type = LUA_TSTRING;
+        *len = (uint32_t) size;
+        return ngx_cpymem(p, str, size);
+
+    default: /* LUA_TTABLE */
+        last = ngx_http_lua_shrbtree_pack_ltable(L, index, p);
+        *type = NGX_HTTP_LUA_SHRBTREE_TPACKED;
+        *len = last - p;
+        return last;
+    }
+}
+
 
-    if (node == sentinel) return;
+static ngx_int_t
+ngx_http_lua_shrbtree_cmp_pentries(const void *one, const void *two)
+{
+    ngx_http_lua_shrbtree_pentry_t  *a, *b;
 
-    lfield = (ngx_http_lua_shrbtree_lfield_t *)&node->data;
-    ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data, lfield->ktype,
-                                     lfield->klen);
-    ngx_http_lua_shrbtree_pushlvalue(L, &lfield->data + lfield->klen,
-                                     lfield->vtype, lfield->vlen);
-    lua_settable(L, -3);
+    a = (ngx_http_lua_shrbtree_pentry_t *) one;
+    b = (ngx_http_lua_shrbtree_pentry_t *) two;
 
-    ngx_http_lua_shrbtree_pushlfield(L, node->left, sentinel);
-    ngx_http_lua_shrbtree_pushlfield(L, node->right, sentinel);
+    return (a->hash > b->hash) - (a->hash < b->hash);
 }
 
 
 static ngx_int_t
-ngx_http_lua_shrbtree_tolvalue(lua_State *L, int index, u_char **data,
-    u_char *type, size_t *len)
+ngx_http_lua_shrbtree_tolvalue(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    int index, u_char **data, u_char *type, size_t *len, ngx_uint_t evict)
 {
 
     ngx_http_lua_shrbtree_ltable_t *ltable;
@@ -636,8 +8689,8 @@ ngx_http_lua_shrbtree_tolvalue(lua_State *L, int index, u_char **data,
     switch (lua_type(L, index)) {
     case LUA_TBOOLEAN:
         *type = LUA_TBOOLEAN;
-        *(int *)(*data) = lua_toboolean(L, index);
-        *len = sizeof(int);
+        **data = (u_char) lua_toboolean(L, index);
+        *len = sizeof(u_char);
         break;
 
     case LUA_TNUMBER:
@@ -651,14 +8704,17 @@ ngx_http_lua_shrbtree_tolvalue(lua_State *L, int index, u_char **data,
         *data = (u_char *)lua_tolstring(L, index, len);
         break;
 
+    case LUA_TUSERDATA: /* packed by luaL_pack */
+        *type = NGX_HTTP_LUA_SHRBTREE_TPACKED;
+        *data = lua_touserdata(L, index);
+        *len = lua_objlen(L, index);
+        break;
+
     case LUA_TTABLE:
         *type = LUA_TTABLE;
         ltable = (ngx_http_lua_shrbtree_ltable_t *)(*data);
-        ngx_rbtree_init(&ltable->rbtree, &ltable->sentinel,
-                        ngx_rbtree_insert_value);
-
         *len = sizeof(ngx_http_lua_shrbtree_ltable_t);
-        return ngx_http_lua_shrbtree_toltable(L, index, ltable);
+        return ngx_http_lua_shrbtree_toltable(L, ctx, index, ltable, evict);
 
     default:
         return luaL_error(L, "bad type value");
@@ -667,77 +8723,268 @@ ngx_http_lua_shrbtree_tolvalue(lua_State *L, int index, u_char **data,
 }
 
 
+/*
+ * builds the fields of the table at index in the locked shard, evicting for
+ * room only if evict is set like alloc_node.  The nested tables are walked
+ * with a stack of frames, two lua slots each, as luaL_checklvalue bounds
+ * the nesting; on failure, what is built is freed.
+ */
 static ngx_int_t
-ngx_http_lua_shrbtree_toltable(lua_State *L, int index,
-    ngx_http_lua_shrbtree_ltable_t *ltable)
+ngx_http_lua_shrbtree_toltable(lua_State *L, ngx_http_lua_shrbtree_ctx_t *ctx,
+    int index, ngx_http_lua_shrbtree_ltable_t *ltable, ngx_uint_t evict)
 {
-    ngx_shm_zone_t              *zone;
-    ngx_http_lua_shrbtree_ctx_t *ctx;
-    ngx_rbtree_node_t           *node;
+    int                             top;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_uint_t                      n;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_lframe_t *f;
     ngx_http_lua_shrbtree_lfield_t *lfield;
     void *p;
 
-    u_char key[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
-    u_char value[NGX_HTTP_LUA_SHRBTREE_LVALUE_SIZE];
-    u_char *kdata = &key[0];
-    u_char *vdata = &value[0];
-    int rc, n;
-    size_t klen, vlen;
-    u_char ktype, vtype;
+    ngx_http_lua_shrbtree_lframe_t stack[NGX_HTTP_LUA_SHRBTREE_MAX_NESTING];
 
-    zone = ngx_http_lua_shrbtree_luaL_checkzone(L, 1);
-    ctx = zone->data;
+    top = lua_gettop(L);
 
-    lua_pushnil(L);
     if (index < 0) {
-        index -= 1;
+        index = top + index + 1;
     }
-    while (lua_next(L, index)) {
-        rc = ngx_http_lua_shrbtree_tolvalue(L, -2, &kdata, &ktype, &klen);
-        if (0 != rc) {return rc;}
-        rc = ngx_http_lua_shrbtree_tolvalue(L, -1, &vdata, &vtype, &vlen);
-        if (0 != rc) {return rc;}
 
-        n = offsetof(ngx_rbtree_node_t, data)
-          + offsetof(ngx_http_lua_shrbtree_lfield_t, data)
-          + klen
-          + vlen;
+    /* not luaL_checkstack, the shard is locked */
+    if (!lua_checkstack(L, 2 * NGX_HTTP_LUA_SHRBTREE_MAX_NESTING)) {
+        return NGX_ERROR;
+    }
 
-        node = (ngx_rbtree_node_t *)ngx_slab_alloc_locked(ctx->shpool, n);
+    ngx_http_lua_shrbtree_init_ltable(ctx, ltable);
 
-        if (node == NULL) {
+    stack[0].ltable = ltable;
+    stack[0].index = index;
+    stack[0].state = NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT;
+    lua_pushnil(L);
+    n = 1;
+
+    while (n) {
+        f = &stack[n - 1];
+
+        switch (f->state) {
+        case NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT:
+            if (!lua_next(L, f->index)) {
+                n--;
+                break;
+            }
+
+            f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_KEY;
+            break;
+
+        case NGX_HTTP_LUA_SHRBTREE_LFRAME_KEY:
+            /* a string is pointed to, not copied to the buffer */
+            f->kdata = (u_char *) &f->key;
+
+            if (LUA_TTABLE != lua_type(L, -2)) {
+                rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, -2, &f->kdata,
+                                                    &f->ktype, &f->klen, 0);
+                if (NGX_OK != rc) {
+                    goto failed;
+                }
+
+                f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_VALUE;
+                break;
+            }
+
+            if (NGX_HTTP_LUA_SHRBTREE_MAX_NESTING == n) {
+                goto failed;
+            }
+
+            ngx_http_lua_shrbtree_init_ltable(ctx, &f->key.t);
+            f->ktype = LUA_TTABLE;
+            f->klen = sizeof(ngx_http_lua_shrbtree_ltable_t);
+            f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_VALUE;
+
+            stack[n].ltable = &f->key.t;
+            stack[n].index = lua_gettop(L) - 1;
+            stack[n].state = NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT;
             lua_pushnil(L);
-            lua_pushliteral(L, "no memory");
-            return 2;
+            n++;
+            break;
+
+        case NGX_HTTP_LUA_SHRBTREE_LFRAME_VALUE:
+            f->vdata = (u_char *) &f->value;
+
+            if (LUA_TTABLE != lua_type(L, -1)) {
+                rc = ngx_http_lua_shrbtree_tolvalue(L, ctx, -1, &f->vdata,
+                                                    &f->vtype, &f->vlen, 0);
+                if (NGX_OK != rc) {
+                    goto failed;
+                }
+
+                f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_FIELD;
+                break;
+            }
+
+            if (NGX_HTTP_LUA_SHRBTREE_MAX_NESTING == n) {
+                goto failed;
+            }
+
+            ngx_http_lua_shrbtree_init_ltable(ctx, &f->value.t);
+            f->vtype = LUA_TTABLE;
+            f->vlen = sizeof(ngx_http_lua_shrbtree_ltable_t);
+            f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_FIELD;
+
+            stack[n].ltable = &f->value.t;
+            stack[n].index = lua_gettop(L);
+            stack[n].state = NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT;
+            lua_pushnil(L);
+            n++;
+            break;
+
+        default: /* NGX_HTTP_LUA_SHRBTREE_LFRAME_FIELD */
+            size = offsetof(ngx_rbtree_node_t, data)
+                 + offsetof(ngx_http_lua_shrbtree_lfield_t, data)
+                 + f->klen
+                 + f->vlen;
+
+            node = ngx_http_lua_shrbtree_alloc_lfield(ctx, size, evict);
+            if (node == NULL) {
+                goto failed;
+            }
+
+            lfield = (ngx_http_lua_shrbtree_lfield_t *) &node->data;
+
+            lfield->ktype = f->ktype;
+            lfield->vtype = f->vtype;
+            lfield->klen = f->klen;
+            lfield->vlen = f->vlen;
+            p = ngx_copy(&lfield->data, f->kdata, f->klen);
+            ngx_memcpy(p, f->vdata, f->vlen);
+            node->key = ngx_crc32_short(f->kdata, f->klen);
+
+            ngx_rbtree_insert(&f->ltable->rbtree, node);
+            f->ltable->nfields++;
+
+            lua_pop(L, 1);
+            f->state = NGX_HTTP_LUA_SHRBTREE_LFRAME_NEXT;
         }
+    }
 
-        lfield = (ngx_http_lua_shrbtree_lfield_t *)&node->data;
+    return NGX_OK;
 
-        lfield->ktype = ktype;
-        lfield->vtype = vtype;
-        lfield->klen = klen;
-        lfield->vlen = vlen;
-        p = ngx_copy(&lfield->data, kdata, klen);
-        ngx_memcpy(p, vdata, vlen);
-        node->key = ngx_crc32_short((u_char *)kdata, klen);
+failed:
 
-        ngx_rbtree_insert(&ltable->rbtree, node);
-        lua_pop(L, 1);
+    /*
+     * the frames are freed from the top, a table being built by a frame is
+     * emptied so that its owner frees it only once
+     */
+    while (n) {
+        f = &stack[--n];
+
+        ngx_http_lua_shrbtree_free_ltable(ctx, f->ltable);
+
+        if (f->state >= NGX_HTTP_LUA_SHRBTREE_LFRAME_VALUE
+            && LUA_TTABLE == f->ktype)
+        {
+            ngx_http_lua_shrbtree_free_ltable(ctx, &f->key.t);
+        }
+
+        if (f->state == NGX_HTTP_LUA_SHRBTREE_LFRAME_FIELD
+            && LUA_TTABLE == f->vtype)
+        {
+            ngx_http_lua_shrbtree_free_ltable(ctx, &f->value.t);
+        }
     }
 
-    return 0;
+    lua_settop(L, top);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_lua_shrbtree_init_ltable(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_ltable_t *ltable)
+{
+    ltable->nfields = 0;
+    ngx_rbtree_init(&ltable->rbtree, &ctx->sh->field_sentinel,
+                    ngx_rbtree_insert_value);
+}
+
+
+static void
+ngx_http_lua_shrbtree_free_ltable(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_ltable_t *ltable)
+{
+    ngx_http_lua_shrbtree_destroy_ltable(ctx->shpool, ltable);
+    ngx_http_lua_shrbtree_init_ltable(ctx, ltable);
+}
+
+
+static ngx_rbtree_node_t *
+ngx_http_lua_shrbtree_alloc_lfield(ngx_http_lua_shrbtree_ctx_t *ctx,
+    size_t size, ngx_uint_t evict)
+{
+    if (evict) {
+        return ngx_http_lua_shrbtree_alloc(ctx, size);
+    }
+
+    return ngx_slab_alloc_locked(ctx->shpool, size);
 }
 
 
+/*
+ * frees the field nodes, walked with a stack of them; the children of a
+ * node are taken before it's freed
+ */
 static void
 ngx_http_lua_shrbtree_rdestroy_lfield(ngx_slab_pool_t *shpool,
     ngx_rbtree_node_t *root, ngx_rbtree_node_t *sentinel)
 {
-    if (root == sentinel) return;
+    ngx_uint_t                      n;
+    ngx_rbtree_node_t              *node;
+    ngx_http_lua_shrbtree_lfield_t *lfield;
+
+    ngx_rbtree_node_t *stack[NGX_HTTP_LUA_SHRBTREE_MAX_DEPTH];
+
+    n = 0;
+
+    if (root != sentinel) {
+        stack[n++] = root;
+    }
 
-    ngx_http_lua_shrbtree_rdestroy_lfield(shpool, root->left, sentinel);
-    ngx_http_lua_shrbtree_rdestroy_lfield(shpool, root->right, sentinel);
-    ngx_slab_free_locked(shpool, root);
+    while (n) {
+        node = stack[--n];
+
+        if (node->right != sentinel) {
+            stack[n++] = node->right;
+        }
+
+        if (node->left != sentinel) {
+            stack[n++] = node->left;
+        }
+
+        /* and the nested tables */
+        lfield = (ngx_http_lua_shrbtree_lfield_t *)&node->data;
+        if (LUA_TTABLE == lfield->ktype) {
+            ngx_http_lua_shrbtree_destroy_ltable(shpool,
+                (ngx_http_lua_shrbtree_ltable_t *)&lfield->data);
+        }
+        if (LUA_TTABLE == lfield->vtype) {
+            ngx_http_lua_shrbtree_destroy_ltable(shpool,
+                (ngx_http_lua_shrbtree_ltable_t *)(&lfield->data
+                                                   + lfield->klen));
+        }
+
+        ngx_slab_free_locked(shpool, node);
+    }
+}
+
+
+static void
+ngx_http_lua_shrbtree_destroy_lvalue(ngx_http_lua_shrbtree_ctx_t *ctx,
+    u_char *data, u_char type)
+{
+    if (LUA_TTABLE == type) {
+        ngx_http_lua_shrbtree_destroy_ltable(ctx->shpool,
+            (ngx_http_lua_shrbtree_ltable_t *) data);
+    }
 }
 
 
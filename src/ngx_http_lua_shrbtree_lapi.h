@@ -15,22 +15,202 @@
 #include <lauxlib.h>
 
 
+#define NGX_HTTP_LUA_SHRBTREE_CMP_LUA       0
+#define NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER    1
+#define NGX_HTTP_LUA_SHRBTREE_CMP_STRING    2
+#define NGX_HTTP_LUA_SHRBTREE_CMP_TUPLE     3
+#define NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL  4
+#define NGX_HTTP_LUA_SHRBTREE_CMP_MAX       5
+
+#define NGX_HTTP_LUA_SHRBTREE_MAX_SHARDS    64
+#define NGX_HTTP_LUA_SHRBTREE_MAX_INDEXES   8
+
+/* the trees replaced by bulk_load which are remembered for snapshots */
+#define NGX_HTTP_LUA_SHRBTREE_FROZEN        4
+
+/* buckets of the lock histograms, the ith is under 2^i microseconds */
+#define NGX_HTTP_LUA_SHRBTREE_HIST          16
+
+
+/*
+ * the counters of a shard; the reads and the lock times are counted with
+ * stats=on only, the reads atomically and the rest under the lock
+ */
+typedef struct {
+    ngx_uint_t                    nodes;
+    ngx_atomic_t                  reads;
+    ngx_atomic_t                  read_misses;
+    ngx_atomic_t                  compares;     /* of the reads */
+    ngx_atomic_t                  max_compares;
+    ngx_uint_t                    writes;
+    ngx_uint_t                    write_misses; /* exists, or no exists */
+    ngx_uint_t                    nomem;
+    ngx_uint_t                    evicted;
+    ngx_uint_t                    expired;
+    uint64_t                      locked;       /* usec, by the holder */
+    ngx_uint_t                    lock_wait[NGX_HTTP_LUA_SHRBTREE_HIST];
+    ngx_uint_t                    lock_hold[NGX_HTTP_LUA_SHRBTREE_HIST];
+} ngx_http_lua_shrbtree_counters_t;
+
+/* what stats() reports, summed over the shards */
+typedef struct {
+    ngx_uint_t                    nodes;
+    size_t                        size;       /* of the pages */
+    size_t                        free;       /* free pages */
+    size_t                        fragmented; /* free chunks in used pages */
+    ngx_uint_t                    reads;
+    ngx_uint_t                    read_misses;
+    ngx_uint_t                    compares;
+    ngx_uint_t                    max_compares;
+    ngx_uint_t                    writes;
+    ngx_uint_t                    write_misses;
+    ngx_uint_t                    nomem;
+    ngx_uint_t                    evicted;
+    ngx_uint_t                    expired;
+    ngx_uint_t                    pinned;
+    ngx_uint_t                    lock_wait[NGX_HTTP_LUA_SHRBTREE_HIST];
+    ngx_uint_t                    lock_hold[NGX_HTTP_LUA_SHRBTREE_HIST];
+} ngx_http_lua_shrbtree_stats_t;
+
+
+/* a replaced tree, intact since the seq when it was replaced */
+typedef struct {
+    ngx_rbtree_node_t            *root;
+    ngx_atomic_uint_t             seq;
+} ngx_http_lua_shrbtree_frozen_t;
+
+
+/*
+ * the tree staged by begin_reload and stage, with the timers, the clock and
+ * the indexes of its nodes, which commit moves to the shard
+ */
+typedef struct {
+    ngx_rbtree_t                  rbtree;
+    ngx_rbtree_t                  expiry;
+    ngx_queue_t                   clock;
+    ngx_rbtree_t                  indexes[NGX_HTTP_LUA_SHRBTREE_MAX_INDEXES];
+    ngx_uint_t                    nodes;
+} ngx_http_lua_shrbtree_stage_t;
+
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
+
+    /*
+     * the timers of the nodes with a ttl, ordered by the expiry time.  A
+     * timer is allocated just before its node, and node->key is the expiry
+     * time too, or 0.
+     */
+    ngx_rbtree_t                  expiry;
+    ngx_rbtree_node_t             expiry_sentinel;
+
+    /* of the field trees of the tables, which are never deleted from */
+    ngx_rbtree_node_t             field_sentinel;
+
+    /* the nodes of an evicting zone, the clock hand is at the head */
+    ngx_queue_t                   clock;
+
+    /* odd while a writer is changing the tree */
+    ngx_atomic_t                  seq;
+
+    /* lockless readers, counted by the epoch they began in */
+    ngx_atomic_t                  epoch;
+    ngx_atomic_t                  readers[2];
+
+    /* the views holding a reader slot, and the snapshots */
+    ngx_atomic_t                  pinned;
+
+    /* the snapshots, which keep the trees replaced from drain */
+    ngx_atomic_t                  snapshots;
+
+    /* index=: by the fields of the table values, see ientry_t */
+    ngx_rbtree_t                  indexes[NGX_HTTP_LUA_SHRBTREE_MAX_INDEXES];
+    ngx_rbtree_node_t             index_sentinel;
+
+    /*
+     * engine=btree: the index of the tree as loaded, dropped by writes and
+     * rebuilt by the sweep; the seq it last saw, and last tried to build at
+     */
+    ngx_rbtree_node_t            *btree;
+    ngx_atomic_uint_t             btree_seen;
+    ngx_atomic_uint_t             btree_tried;
+
+    ngx_http_lua_shrbtree_frozen_t  frozen[NGX_HTTP_LUA_SHRBTREE_FROZEN];
+    ngx_uint_t                    nfrozen;
+
+    /* the stage shares the sentinels of the shard */
+    ngx_uint_t                    reloading;
+    ngx_http_lua_shrbtree_stage_t stage;
+
+    /*
+     * the trees replaced by commit or dropped by abort_reload, which the
+     * sweeps retire a batch at a time: the next node of the one being
+     * walked, and the roots of the rest chained by the parent links
+     */
+    ngx_rbtree_node_t            *draining;
+    ngx_rbtree_node_t            *drain;
+
+    ngx_rbtree_node_t            *retired; /* unlinked in this epoch */
+    ngx_rbtree_node_t            *reclaim; /* waiting for former readers */
+
+    /* in the first shard, the pools of all shards */
+    ngx_uint_t                    nshards;
+    ngx_slab_pool_t             **pools;
+
+    /* in the first shard, the layout flags and cmp the zone was made with */
+    ngx_uint_t                    layout;
+    ngx_uint_t                    cmp;
+
+    ngx_http_lua_shrbtree_counters_t  counters;
 } ngx_http_lua_shrbtree_shctx_t;
 
-typedef struct {
+typedef struct ngx_http_lua_shrbtree_ctx_s ngx_http_lua_shrbtree_ctx_t;
+
+struct ngx_http_lua_shrbtree_ctx_s {
     ngx_http_lua_shrbtree_main_conf_t *main_conf;
     ngx_http_lua_shrbtree_shctx_t  *sh;
     ngx_slab_pool_t                *shpool;
     ngx_str_t                      name;
     ngx_log_t                      *log;
-} ngx_http_lua_shrbtree_ctx_t;
+    ngx_uint_t                     cmp; /* default builtin comparator */
+    unsigned                       packed:1; /* tables as one blob */
+    unsigned                       evict:1;  /* cold nodes for memory */
+    unsigned                       rank:1;   /* subtree sizes */
+    unsigned                       stats:1;  /* reads and lock times */
+    unsigned                       btree:1;  /* engine=btree */
+    ngx_uint_t                     l1;       /* entries of a worker cache */
+    ngx_str_t                      snapshot; /* file of save(), or empty */
+    ngx_array_t                   *indexes;  /* of ngx_str_t, the fields */
+
+    /*
+     * a shard is a tree in a slab pool of its own, with its own lock.  Keys
+     * are routed by hash, or by the split keys so that shards are ordered.
+     */
+    ngx_uint_t                     nshards;
+    ngx_http_lua_shrbtree_ctx_t   *shards; /* itself if not sharded */
+    ngx_array_t                   *split;  /* of lua_Number or ngx_str_t */
+};
 
 
 ngx_int_t ngx_http_lua_shrbtree_init_zone(ngx_shm_zone_t *shm_zone, void *data);
 int ngx_http_lua_shrbtree_preload(lua_State *L);
+ngx_int_t ngx_http_lua_shrbtree_init_process(ngx_cycle_t *cycle);
+void ngx_http_lua_shrbtree_get_stats(ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_http_lua_shrbtree_stats_t *st);
+
+#ifndef NGX_LUA_NO_FFI_API
+int ngx_http_lua_ffi_shrbtree_get(ngx_shm_zone_t *zone, int key_type,
+    const u_char *key, size_t key_len, double num_key, int *value_type,
+    u_char **str_value_buf, size_t *str_value_len, double *num_value,
+    char **errmsg);
+int ngx_http_lua_ffi_shrbtree_store(ngx_shm_zone_t *zone, int op, int key_type,
+    const u_char *key, size_t key_len, double num_key, int value_type,
+    const u_char *str_value, size_t str_value_len, double num_value,
+    double ttl, char **errmsg);
+int ngx_http_lua_ffi_shrbtree_delete(ngx_shm_zone_t *zone, int key_type,
+    const u_char *key, size_t key_len, double num_key, char **errmsg);
+#endif
 
 
 #endif /* _NGX_HTTP_LUA_SHRBTREE_LAPI_H_INCLUDED_ */
@@ -14,17 +14,40 @@ static void *ngx_http_lua_shrbtree_create_main_conf(ngx_conf_t *cf);
 static ngx_int_t ngx_http_lua_shrbtree_init(ngx_conf_t *cf);
 static char *ngx_http_lua_shared_rbtree(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_lua_shrbtree_index(ngx_conf_t *cf,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_str_t *value);
+static char *ngx_http_lua_shrbtree_split(ngx_conf_t *cf,
+    ngx_http_lua_shrbtree_ctx_t *ctx, ngx_str_t *value);
+static char *ngx_http_lua_shrbtree_status(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_lua_shrbtree_status_handler(ngx_http_request_t *r);
+
+
+static ngx_conf_enum_t ngx_http_lua_shrbtree_cmps[] = {
+    { ngx_string("number"),   NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER },
+    { ngx_string("string"),   NGX_HTTP_LUA_SHRBTREE_CMP_STRING },
+    { ngx_string("tuple"),    NGX_HTTP_LUA_SHRBTREE_CMP_TUPLE },
+    { ngx_string("interval"), NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t ngx_http_lua_shrbtree_cmds[] = {
 
     { ngx_string("lua_shared_rbtree"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_shared_rbtree,
       0,
       0,
       NULL },
 
+    { ngx_string("lua_shared_rbtree_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_lua_shrbtree_status,
+      0,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -43,16 +66,16 @@ static ngx_http_module_t  ngx_http_lua_shrbtree_module_ctx = {
 
 ngx_module_t  ngx_http_lua_shrbtree_module = {
     NGX_MODULE_V1,
-    &ngx_http_lua_shrbtree_module_ctx, /* module context */
-    ngx_http_lua_shrbtree_cmds,        /* module directives */
-    NGX_HTTP_MODULE,                   /* module type */
-    NULL,                              /* init master */
-    NULL,                              /* init module */
-    NULL,                              /* init process */
-    NULL,                              /* init thread */
-    NULL,                              /* exit thread */
-    NULL,                              /* exit process */
-    NULL,                              /* exit master */
+    &ngx_http_lua_shrbtree_module_ctx,  /* module context */
+    ngx_http_lua_shrbtree_cmds,         /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    ngx_http_lua_shrbtree_init_process, /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
     NGX_MODULE_V1_PADDING
 };
 
@@ -102,6 +125,10 @@ ngx_http_lua_shared_rbtree(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_shm_zone_t             *zone;
     ngx_shm_zone_t            **zp;
     ngx_http_lua_shrbtree_ctx_t  *ctx;
+    ngx_conf_enum_t            *e;
+    ngx_uint_t                  i;
+    ngx_int_t                   n;
+    ngx_str_t                   split, index;
     ssize_t                     size;
 
     if (lsmcf->shm_zones == NULL) {
@@ -146,6 +173,224 @@ ngx_http_lua_shared_rbtree(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ctx->name = name;
     ctx->main_conf = lsmcf;
     ctx->log = &cf->cycle->new_log;
+    ctx->nshards = 1;
+
+    ngx_str_null(&split);
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "cmp=", 4) == 0) {
+
+            for (e = ngx_http_lua_shrbtree_cmps; e->name.len; e++) {
+                if (e->name.len == value[i].len - 4
+                    && ngx_strncmp(e->name.data, value[i].data + 4,
+                                   e->name.len) == 0)
+                {
+                    ctx->cmp = e->value;
+                    break;
+                }
+            }
+
+            if (e->name.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared rbtree comparator "
+                                   "\"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "encoding=packed") == 0) {
+            ctx->packed = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "encoding=rbtree") == 0) {
+            ctx->packed = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "evict=clock") == 0) {
+            ctx->evict = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "evict=none") == 0) {
+            ctx->evict = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "rank=on") == 0) {
+            ctx->rank = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "rank=off") == 0) {
+            ctx->rank = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "engine=btree") == 0) {
+            ctx->btree = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "engine=rbtree") == 0) {
+            ctx->btree = 0;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "stats=on") == 0) {
+            ctx->stats = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "stats=off") == 0) {
+            ctx->stats = 0;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+            ctx->snapshot.data = value[i].data + 9;
+            ctx->snapshot.len = value[i].len - 9;
+
+            if (ctx->snapshot.len == 0
+                || ngx_conf_full_name(cf->cycle, &ctx->snapshot, 0)
+                   != NGX_OK)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared rbtree snapshot "
+                                   "\"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+            n = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (n < 1 || n > NGX_HTTP_LUA_SHRBTREE_MAX_SHARDS) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared rbtree shards "
+                                   "\"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->nshards = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "l1=", 3) == 0) {
+            n = ngx_atoi(value[i].data + 3, value[i].len - 3);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared rbtree l1 "
+                                   "\"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->l1 = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "split=", 6) == 0) {
+            split.data = value[i].data + 6;
+            split.len = value[i].len - 6;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+            index.data = value[i].data + 6;
+            index.len = value[i].len - 6;
+
+            if (ngx_http_lua_shrbtree_index(cf, ctx, &index) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid lua shared rbtree parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the btree keys are numbers, the lows of the intervals */
+    if (ctx->btree
+        && ctx->cmp != NGX_HTTP_LUA_SHRBTREE_CMP_NUMBER
+        && ctx->cmp != NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua shared rbtree \"%V\" with \"engine=btree\" "
+                           "needs \"cmp=number\" or \"cmp=interval\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* an eviction drops the btree, so the zone would hardly ever have one */
+    if (ctx->btree && ctx->evict) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua shared rbtree \"%V\" with \"engine=btree\" "
+                           "can't have \"evict=clock\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    /* the hits of l1 don't reach the nodes, which would look cold */
+    if (ctx->l1 && ctx->evict) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "lua shared rbtree \"%V\" with \"l1=\" "
+                           "can't have \"evict=clock\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (split.len) {
+        if (ngx_http_lua_shrbtree_split(cf, ctx, &split) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ctx->nshards > 1) {
+        /* keys are routed by the builtin compare's idea of them */
+        if (ctx->cmp == NGX_HTTP_LUA_SHRBTREE_CMP_LUA) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared rbtree \"%V\" with shards needs "
+                               "\"cmp=\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        /* a point must go to the shard of the interval which contains it */
+        if (ctx->cmp == NGX_HTTP_LUA_SHRBTREE_CMP_INTERVAL
+            && ctx->split == NULL)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared rbtree \"%V\" of intervals with "
+                               "shards needs \"split=\"", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        if ((size_t) size / ctx->nshards < 8 * ngx_pagesize) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared rbtree \"%V\" is too small for "
+                               "%i shards", &name, ctx->nshards);
+            return NGX_CONF_ERROR;
+        }
+
+        ctx->shards = ngx_pcalloc(cf->pool, ctx->nshards * sizeof(*ctx));
+        if (ctx->shards == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        /* each shard caches its share of the l1 entries */
+        ctx->l1 = (ctx->l1 + ctx->nshards - 1) / ctx->nshards;
+
+        for (i = 0; i < ctx->nshards; i++) {
+            ctx->shards[i] = *ctx;
+        }
+
+    } else {
+        ctx->shards = ctx;
+    }
 
     /* zone = ngx_http_lua_shared_memory_add(cf, &name, (size_t) size, */
                                           /* &ngx_http_lua_shrbtree_module); */
@@ -176,3 +421,290 @@ ngx_http_lua_shared_rbtree(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+/* index=f1,f2,... gives the string fields of the table values to index */
+static char *
+ngx_http_lua_shrbtree_index(ngx_conf_t *cf, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_str_t *value)
+{
+    u_char      *p, *last, *next;
+    ngx_uint_t   i;
+    ngx_str_t   *name;
+
+    if (ctx->indexes == NULL) {
+        ctx->indexes = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+        if (ctx->indexes == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    last = value->data + value->len;
+
+    for (p = value->data; p <= last; p = next + 1) {
+        next = ngx_strlchr(p, last, ',');
+        if (next == NULL) {
+            next = last;
+        }
+
+        if (next == p
+            || ctx->indexes->nelts == NGX_HTTP_LUA_SHRBTREE_MAX_INDEXES)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid lua shared rbtree index \"%V\"",
+                               value);
+            return NGX_CONF_ERROR;
+        }
+
+        name = ctx->indexes->elts;
+
+        for (i = 0; i < ctx->indexes->nelts; i++) {
+            if (name[i].len == (size_t) (next - p)
+                && ngx_strncmp(name[i].data, p, name[i].len) == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "duplicate lua shared rbtree index "
+                                   "\"%*s\"", (size_t) (next - p), p);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        name = ngx_array_push(ctx->indexes);
+        if (name == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        name->data = p;
+        name->len = next - p;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * split=k1,k2,... gives the least keys of the 2nd, 3rd, ... shards, numbers
+ * or strings as the compare
+ */
+static char *
+ngx_http_lua_shrbtree_split(ngx_conf_t *cf, ngx_http_lua_shrbtree_ctx_t *ctx,
+    ngx_str_t *value)
+{
+    u_char      *p, *last, *next;
+    ngx_int_t    n;
+    ngx_uint_t   i, count, minus;
+    ngx_str_t   *str;
+    lua_Number  *num;
+
+    last = value->data + value->len;
+
+    for (count = 1, p = value->data; p < last; p++) {
+        if (*p == ',') {
+            count++;
+        }
+    }
+
+    if (ctx->nshards == 1) {
+        ctx->nshards = count + 1;
+    }
+
+    if (ctx->nshards != count + 1
+        || ctx->nshards > NGX_HTTP_LUA_SHRBTREE_MAX_SHARDS)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"split=\" needs one key less than shards");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx->cmp == NGX_HTTP_LUA_SHRBTREE_CMP_STRING) {
+        ctx->split = ngx_array_create(cf->pool, count, sizeof(ngx_str_t));
+
+    } else {
+        ctx->split = ngx_array_create(cf->pool, count, sizeof(lua_Number));
+    }
+
+    if (ctx->split == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0, p = value->data; i < count; i++, p = next + 1) {
+        next = ngx_strlchr(p, last, ',');
+        if (next == NULL) {
+            next = last;
+        }
+
+        if (ctx->cmp == NGX_HTTP_LUA_SHRBTREE_CMP_STRING) {
+            str = ngx_array_push(ctx->split);
+            if (str == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            str->data = p;
+            str->len = next - p;
+
+            if (i > 0 && ngx_memn2cmp(str[-1].data, str->data, str[-1].len,
+                                      str->len) >= 0)
+            {
+                goto unordered;
+            }
+
+            continue;
+        }
+
+        minus = (p < next && *p == '-');
+
+        n = ngx_atoi(p + minus, next - p - minus);
+        if (n == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid split key \"%*s\"", next - p, p);
+            return NGX_CONF_ERROR;
+        }
+
+        num = ngx_array_push(ctx->split);
+        if (num == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *num = minus ? - (lua_Number) n : (lua_Number) n;
+
+        if (i > 0 && num[-1] >= *num) {
+            goto unordered;
+        }
+    }
+
+    return NGX_CONF_OK;
+
+unordered:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "split keys \"%V\" are not in ascending order",
+                       value);
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_lua_shrbtree_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_lua_shrbtree_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+/* the stats of all zones as a json object, keyed by the zone names */
+static ngx_int_t
+ngx_http_lua_shrbtree_status_handler(ngx_http_request_t *r)
+{
+    size_t                              size;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          i, j, n;
+    ngx_chain_t                         out;
+    ngx_shm_zone_t                    **zones;
+    ngx_http_lua_shrbtree_ctx_t        *ctx;
+    ngx_http_lua_shrbtree_stats_t       st;
+    ngx_http_lua_shrbtree_main_conf_t  *lsmcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    lsmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_shrbtree_module);
+
+    if (lsmcf->shm_zones == NULL) {
+        n = 0;
+        zones = NULL;
+
+    } else {
+        n = lsmcf->shm_zones->nelts;
+        zones = lsmcf->shm_zones->elts;
+    }
+
+    size = sizeof("{}" CRLF);
+
+    for (i = 0; i < n; i++) {
+        ctx = zones[i]->data;
+        size += ctx->name.len + sizeof("\"\":{},") - 1
+                + 16 * (sizeof(", \"max_compares\":") - 1 + NGX_ATOMIC_T_LEN)
+                + 2 * (sizeof(", \"lock_wait\":[]") - 1
+                       + NGX_HTTP_LUA_SHRBTREE_HIST * (NGX_ATOMIC_T_LEN + 1));
+    }
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    *b->last++ = '{';
+
+    for (i = 0; i < n; i++) {
+        ctx = zones[i]->data;
+
+        ngx_memzero(&st, sizeof(ngx_http_lua_shrbtree_stats_t));
+        ngx_http_lua_shrbtree_get_stats(ctx, &st);
+
+        b->last = ngx_sprintf(b->last,
+                              "%s\"%V\":{\"nodes\":%ui, \"size\":%uz, "
+                              "\"free\":%uz, \"fragmented\":%uz, "
+                              "\"reads\":%ui, \"read_misses\":%ui, "
+                              "\"compares\":%ui, \"max_compares\":%ui, "
+                              "\"writes\":%ui, \"write_misses\":%ui, "
+                              "\"nomem\":%ui, \"evicted\":%ui, "
+                              "\"expired\":%ui, \"pinned\":%ui",
+                              i ? "," : "", &ctx->name, st.nodes, st.size,
+                              st.free, st.fragmented, st.reads,
+                              st.read_misses, st.compares, st.max_compares,
+                              st.writes, st.write_misses, st.nomem,
+                              st.evicted, st.expired, st.pinned);
+
+        b->last = ngx_cpymem(b->last, ", \"lock_wait\":[",
+                             sizeof(", \"lock_wait\":[") - 1);
+
+        for (j = 0; j < NGX_HTTP_LUA_SHRBTREE_HIST; j++) {
+            b->last = ngx_sprintf(b->last, "%s%ui", j ? "," : "",
+                                  st.lock_wait[j]);
+        }
+
+        b->last = ngx_cpymem(b->last, "], \"lock_hold\":[",
+                             sizeof("], \"lock_hold\":[") - 1);
+
+        for (j = 0; j < NGX_HTTP_LUA_SHRBTREE_HIST; j++) {
+            b->last = ngx_sprintf(b->last, "%s%ui", j ? "," : "",
+                                  st.lock_hold[j]);
+        }
+
+        b->last = ngx_cpymem(b->last, "]}", 2);
+    }
+
+    b->last = ngx_cpymem(b->last, "}" CRLF, sizeof("}" CRLF) - 1);
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+/* vi:set ft=c ts=4 sw=4 et fdm=marker: */
@@ -753,3 +753,1466 @@ nil nil
 nil nil
 --- no_error_log
 [error]
+
+
+
+=== TEST 12: builtin compare
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+    lua_shared_rbtree rbtree2 1m;
+    lua_shared_rbtree rbtree3 1m;
+    lua_shared_rbtree rbtree4 1m cmp=tuple;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree1 = shrbtree.rbtree1
+            local rbtree2 = shrbtree.rbtree2
+            local rbtree3 = shrbtree.rbtree3
+            local rbtree4 = shrbtree.rbtree4
+
+            for i = 1, 100, 1 do
+                rbtree1:insert{i, i * 10}
+            end
+
+            local val
+            val = rbtree1:get{42}
+            ngx.say(val, " ", type(val))
+            rbtree1:delete{42}
+            val = rbtree1:get{42}
+            ngx.say(val, " ", type(val))
+
+            local str = rbtree2.CMP_STRING
+            rbtree2:insert{"b", "bb", str}
+            rbtree2:insert{"a", "aa", str}
+            val = rbtree2:get{"a", str}
+            ngx.say(val, " ", type(val))
+
+            local interval = rbtree3.CMP_INTERVAL
+            rbtree3:insert{{1, 3}, {k1 = "v1"}, interval}
+            rbtree3:insert{{4, 6}, {k1 = "v4"}, interval}
+            ngx.say(rbtree3:insert{{5, 9}, 1, interval})
+            val = rbtree3:get{5, "k1", interval}
+            ngx.say(val, " ", type(val))
+
+            rbtree4:insert{{1, 2}, "t12"}
+            rbtree4:insert{{1, 2, 3}, "t123"}
+            rbtree4:insert{{1, 3}, "t13"}
+            val = rbtree4:get{{1, 2, 3}}
+            ngx.say(val, " ", type(val))
+            val = rbtree4:get{{1, 2}}
+            ngx.say(val, " ", type(val))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+420 number
+nil nil
+aa string
+falsethe node exists
+v4 string
+t123 string
+t12 string
+--- no_error_log
+[error]
+
+
+
+=== TEST 13: error of compare function releases the zone
+--- http_config
+    lua_shared_rbtree rbtree 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local cmp = function(a, b)
+                if a == "bad" then
+                    error("bad key")
+                end
+
+                if a > b then
+                    return 1
+
+                elseif a < b then
+                    return -1
+
+                else
+                    return 0
+                end
+            end
+
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            rbtree:insert{"a", 1, cmp}
+
+            local ok = pcall(rbtree.insert, rbtree, {"bad", 2, cmp})
+            ngx.say(ok)
+            ok = pcall(rbtree.get, rbtree, {"bad", cmp})
+            ngx.say(ok)
+
+            rbtree:insert{"b", 2, cmp}
+            local val = rbtree:get{"b", cmp}
+            ngx.say(val, " ", type(val))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+false
+false
+2 number
+--- no_error_log
+[error]
+
+
+
+=== TEST 14: bulk load
+--- http_config
+    lua_shared_rbtree rbtree 10m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            local items = {}
+            for i = 1, 1000, 1 do
+                items[i] = {i, {k1 = i * 10}}
+            end
+
+            ngx.say(rbtree:bulk_load(items))
+            ngx.say(rbtree:bulk_load(items))
+
+            local val
+            val = rbtree:get{500, "k1"}
+            ngx.say(val, " ", type(val))
+
+            local i = 0
+            local iter = function()
+                i = i + 1
+                if i <= 10 then
+                    return i * 2, "v" .. i
+                end
+            end
+
+            ngx.say(rbtree:bulk_load(iter, {swap = true}))
+            val = rbtree:get{500}
+            ngx.say(val, " ", type(val))
+            val = rbtree:get{20}
+            ngx.say(val, " ", type(val))
+
+            ngx.say(rbtree:bulk_load({{2, 1}, {1, 2}}, {swap = true}))
+            val = rbtree:get{4}
+            ngx.say(val, " ", type(val))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true1000
+falsethe tree isn't empty
+5000 number
+true10
+nil nil
+v10 string
+falsekeys are not in ascending order
+v2 string
+--- no_error_log
+[error]
+
+
+
+=== TEST 15: range and iter
+--- http_config
+    lua_shared_rbtree rbtree 10m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            for i = 1, 100, 1 do
+                rbtree:insert{i, "v" .. i}
+            end
+
+            local keys, vals = rbtree:range{10, 14}
+            ngx.say(table.concat(keys, ","), " ", table.concat(vals, ","))
+
+            keys, vals = rbtree:range{10.5, 20, 3}
+            ngx.say(table.concat(keys, ","), " ", table.concat(vals, ","))
+
+            keys = rbtree:range{200, 300}
+            ngx.say(#keys)
+
+            local cursor = rbtree:iter{95}
+            keys = cursor:next(4)
+            ngx.say(table.concat(keys, ","))
+            rbtree:delete{99}
+            keys = cursor:next(4)
+            ngx.say(table.concat(keys, ","))
+            ngx.say(cursor:next(4))
+
+            local n = 0
+            cursor = rbtree:iter{}
+            while true do
+                keys = cursor:next(30)
+                if not keys then
+                    break
+                end
+                n = n + #keys
+            end
+            ngx.say(n)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+10,11,12,13,14 v10,v11,v12,v13,v14
+11,12,13 v11,v12,v13
+0
+95,96,97,98
+100
+nil
+99
+--- no_error_log
+[error]
+
+
+
+=== TEST 16: floor, ceil, lower_bound and upper_bound
+--- http_config
+    lua_shared_rbtree rbtree 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            local ranges = {{0, 99, "a"}, {100, 199, "b"}, {300, 399, "c"}}
+            for _, r in ipairs(ranges) do
+                rbtree:insert{r[1], {r[2], r[3]}}
+            end
+
+            for _, ip in ipairs({0, 150, 250, 399}) do
+                local s, info = rbtree:floor{ip}
+                if s and ip <= info[1] then
+                    ngx.say(ip, " ", info[2])
+                else
+                    ngx.say(ip, " none")
+                end
+            end
+
+            ngx.say(rbtree:floor{-1})
+            ngx.say((rbtree:ceil{100}))
+            ngx.say((rbtree:ceil{101}))
+            ngx.say((rbtree:lower_bound{100}))
+            ngx.say((rbtree:upper_bound{100}))
+            ngx.say(rbtree:upper_bound{300})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+0 a
+150 b
+250 none
+399 c
+nilno exists
+100
+300
+100
+300
+nilno exists
+--- no_error_log
+[error]
+
+
+
+=== TEST 17: mget
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=string;
+    lua_shared_rbtree rbtree2 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree1 = shrbtree.rbtree1
+            local rbtree2 = shrbtree.rbtree2
+
+            local cmp = function(a, b)
+                return a > b and 1 or (a < b and -1 or 0)
+            end
+
+            for _, ip in ipairs({"10.0.0.1", "10.0.0.3", "192.168.1.1"}) do
+                rbtree1:insert{ip, "v" .. ip}
+                rbtree2:insert{ip, "v" .. ip, cmp}
+            end
+
+            local keys = {"192.168.1.1", "10.0.0.2", "10.0.0.1", "10.0.0.3"}
+            local vals = rbtree1:mget{keys}
+            for i = 1, #keys do
+                ngx.say(vals[i])
+            end
+
+            vals = rbtree2:mget{keys, cmp}
+            for i = 1, #keys do
+                ngx.say(vals[i])
+            end
+
+            ngx.say(#rbtree1:mget{{}})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+v192.168.1.1
+nil
+v10.0.0.1
+v10.0.0.3
+v192.168.1.1
+nil
+v10.0.0.1
+v10.0.0.3
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 18: packed encoding
+--- http_config
+    lua_shared_rbtree rbtree 1m cmp=tuple encoding=packed;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            ngx.say(rbtree:insert{{1, 2}, {c = "AU", C = "Australia",
+                                           geo = {lat = 1.5, lon = 2.5},
+                                           "x", "y", ok = true}})
+            ngx.say(rbtree:insert{{1, 3}, "v13"})
+            ngx.say(rbtree:insert{{1, 2}, "dup"})
+
+            ngx.say(rbtree:get{{1, 2}, "C"})
+            ngx.say(rbtree:get{{1, 2}, 2})
+            ngx.say(rbtree:get{{1, 2}, "none"})
+
+            local v = rbtree:get{{1, 2}}
+            ngx.say(v.c, " ", v.geo.lat, " ", v.geo.lon, " ", v[1], " ",
+                    tostring(v.ok))
+
+            local keys = rbtree:range{{1}, {2}}
+            ngx.say(#keys, " ", keys[1][2], " ", keys[2][2])
+
+            ngx.say(rbtree:delete{{1, 2}})
+            ngx.say(rbtree:get{{1, 2}})
+
+            ngx.say(rbtree:bulk_load({{{2, 1}, {a = 1}}, {{2, 2}, {a = 2}}},
+                                     {swap = true}))
+            ngx.say(rbtree:get{{2, 2}, "a"})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true
+true
+falsethe node exists
+Australia
+y
+nilno exists this field
+AU 1.5 2.5 x true
+2 2 3
+true
+nilno exists
+true2
+2
+--- no_error_log
+[error]
+
+
+
+=== TEST 19: projection and view
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+    lua_shared_rbtree rbtree2 1m cmp=number encoding=packed;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+
+            for _, rbtree in ipairs({shrbtree.rbtree1, shrbtree.rbtree2}) do
+                rbtree:insert{1, {country = "AU", city = "Sydney", n = 2}}
+                rbtree:insert{2, "plain"}
+
+                ngx.say(rbtree:get{1, {"city", "none", "country", "n"}})
+                ngx.say(rbtree:get{2, {"city"}})
+
+                local view = rbtree:view{1, "city"}
+                ngx.say(tostring(view), " ", view:len(), " ",
+                        type(view:ptr()))
+                rbtree:delete{1}
+                ngx.say(tostring(view))
+                view:release()
+                ngx.say(view:len(), " ", tostring(view:ptr()))
+
+                view = rbtree:view{2}
+                ngx.say(tostring(view))
+                view:release()
+
+                ngx.say(rbtree:view{1})
+                ngx.say(rbtree:view{2, "x"})
+            end
+        ';
+    }
+--- request
+GET /test
+--- response_body
+SydneynilAU2
+nilthe value type isn't a table
+Sydney 6 userdata
+Sydney
+0 nil
+plain
+nilno exists
+nilthe value type isn't a table
+SydneynilAU2
+nilthe value type isn't a table
+Sydney 6 userdata
+Sydney
+0 nil
+plain
+nilno exists
+nilthe value type isn't a table
+--- no_error_log
+[error]
+
+
+
+=== TEST 20: sharded zones
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number shards=4;
+    lua_shared_rbtree rbtree2 1m cmp=number split=100,200;
+    lua_shared_rbtree rbtree3 1m cmp=interval split=100;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            for i = 1, 20 do
+                rbtree:insert{i, i * 10}
+            end
+            rbtree:delete{5}
+            ngx.say(rbtree:get{7}, " ", rbtree:get{5})
+            local values = rbtree:mget{{3, 5, 20}}
+            ngx.say(values[1], ",", values[2], ",", values[3])
+            ngx.say(pcall(rbtree.range, rbtree, {1, 20}))
+
+            rbtree = shrbtree.rbtree2
+            ngx.say(rbtree:bulk_load({{50, "a"}, {150, "b"}, {250, "c"}}))
+            ngx.say(table.concat(rbtree:range{0, 300}, ","))
+            ngx.say(rbtree:floor{120}, " ", rbtree:ceil{160})
+            ngx.say(rbtree:lower_bound{260})
+
+            local keys = rbtree:iter{}:next(2)
+            ngx.say(table.concat(keys, ","))
+
+            rbtree = shrbtree.rbtree3
+            ngx.say(rbtree:insert{{10, 90}, "x"})
+            ngx.say(rbtree:insert{{90, 110}, "y"})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+70 nilno exists
+30,nil,200
+falseordered lookups need the zone split by keys
+true3
+50,150,250
+50a 250c
+nilno exists
+50,150
+true
+falsethe interval crosses shards
+--- no_error_log
+[error]
+
+
+
+=== TEST 21: save a snapshot
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number snapshot=/tmp/shrbtree_test.snapshot;
+    lua_shared_rbtree rbtree2 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:bulk_load({{1, "a"}, {2, {x = 1, y = {"z"}}}}, {swap = true})
+            ngx.say(rbtree:save())
+
+            local file = io.open("/tmp/shrbtree_test.snapshot")
+            ngx.say(file:read(8))
+            file:close()
+
+            ngx.say(shrbtree.rbtree2:save())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true2
+SHRBTREE
+falseno snapshot file
+--- no_error_log
+[error]
+
+
+
+=== TEST 22: expiration
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{1, "a", ttl = 0.001}
+            rbtree:insert{2, "b", ttl = 100}
+            rbtree:insert{3, "c"}
+            ngx.say(rbtree:get{1})
+            ngx.say(pcall(rbtree.insert, rbtree, {4, "d", ttl = -1}))
+            ngx.say(pcall(rbtree.insert, rbtree, {4, "d", ttl = 1e300}))
+
+            ngx.sleep(0.01)
+
+            ngx.say(rbtree:get{1})
+            ngx.say(table.concat(rbtree:range{1, 3}, ","))
+            ngx.say(rbtree:ceil{0})
+            ngx.say(rbtree:insert{1, "e"})
+            ngx.say(rbtree:get{1}, rbtree:get{2})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+a
+falsebad argument #2 to '?' (bad ttl)
+falsebad argument #2 to '?' (bad ttl)
+nilno exists
+2,3
+2b
+true
+eb
+--- no_error_log
+[error]
+
+
+
+=== TEST 23: eviction
+--- http_config
+    lua_shared_rbtree rbtree1 64k cmp=number evict=clock;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            local value = string.rep("x", 1000)
+            local n = 0
+
+            for i = 1, 200 do
+                if rbtree:insert{i, value} then
+                    n = n + 1
+                end
+                rbtree:get{1}
+            end
+
+            ngx.say(n)
+            ngx.say(#rbtree:get{1})
+            ngx.say(rbtree:get{2})
+            ngx.say(#rbtree:get{200})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+200
+1000
+nilno exists
+1000
+--- no_error_log
+[error]
+
+
+
+=== TEST 24: set, replace and incr
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            ngx.say(rbtree:replace{1, "a"})
+            ngx.say(rbtree:set{1, "a"})
+            ngx.say(rbtree:set{1, "bb"})
+            ngx.say(rbtree:replace{1, 10})
+            ngx.say(rbtree:get{1})
+
+            ngx.say(rbtree:incr{1, 5})
+            ngx.say(rbtree:incr{1, -1.5})
+            ngx.say(rbtree:incr{2, 1})
+
+            rbtree:insert{2, {hits = 1, name = "x"}}
+            ngx.say(rbtree:incr{2, 2, "hits"})
+            ngx.say(rbtree:incr{2, 2, "name"})
+            ngx.say(rbtree:get{2, "hits"})
+
+            rbtree:set{3, "old"}
+            local view = rbtree:view{3}
+            rbtree:set{3, "new"}
+            ngx.say(tostring(view), " ", rbtree:get{3})
+            view:release()
+
+            for i = 4, 20 do
+                rbtree:set{i, i}
+            end
+            rbtree:set{10, "ten"}
+            ngx.say(table.concat(rbtree:range{9, 11}, ","))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+falseno exists
+true
+true
+true
+10
+15
+13.5
+nilno exists
+3
+nilthe value type isn't a number
+3
+old new
+9,10,11
+--- no_error_log
+[error]
+
+
+
+=== TEST 25: rank, select and count
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number rank=on;
+    lua_shared_rbtree rbtree2 1m cmp=number rank=on split=50;
+    lua_shared_rbtree rbtree3 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+
+            for _, rbtree in ipairs{shrbtree.rbtree1, shrbtree.rbtree2} do
+                for i = 1, 100 do
+                    rbtree:insert{i * 2, i}
+                end
+                for i = 1, 100, 3 do
+                    rbtree:delete{i * 2}
+                end
+                rbtree:set{100, "x"}
+
+                ngx.say(rbtree:rank{2}, " ", rbtree:rank{10}, " ",
+                        rbtree:rank{11}, " ", rbtree:rank{1000})
+
+                for _, k in ipairs{1, 33, 66, 67} do
+                    local key, value = rbtree:select{k}
+                    ngx.say(key, " ", value)
+                end
+
+                ngx.say(rbtree:count{1, 200}, " ", rbtree:count{10, 20}, " ",
+                        rbtree:count{20, 10})
+            end
+
+            ngx.say(pcall(shrbtree.rbtree3.rank, shrbtree.rbtree3, {1}))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+0 2 3 66
+4 2
+100 x
+198 99
+nil no exists
+66 4 0
+0 2 3 66
+4 2
+100 x
+198 99
+nil no exists
+66 4 0
+falserank lookups need the zone with rank=on
+--- no_error_log
+[error]
+
+
+
+=== TEST 26: large and nested tables
+--- http_config
+    lua_shared_rbtree rbtree1 4m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            local wide = {}
+            for i = 1, 5000 do
+                wide["f" .. i] = i
+            end
+
+            local deep = {level = 0}
+            for i = 1, 30 do
+                deep = {level = i, inner = deep, [{i}] = true}
+            end
+
+            ngx.say(rbtree:insert{1, wide})
+            ngx.say(rbtree:insert{2, deep})
+            ngx.say(pcall(rbtree.insert, rbtree, {3, {{deep}}}))
+
+            local value = rbtree:get{1}
+            local n, sum = 0, 0
+            for k, v in pairs(value) do
+                n = n + 1
+                sum = sum + v
+            end
+            ngx.say(n, " ", sum)
+
+            value = rbtree:get{2}
+            n = 0
+            while value.inner do
+                value = value.inner
+                n = n + 1
+            end
+            ngx.say(n, " ", value.level)
+
+            ngx.say(rbtree:delete{1}, rbtree:delete{2})
+            ngx.say(rbtree:insert{1, wide})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true
+true
+falsetable nested too deep
+5000 12502500
+30 0
+truetrue
+true
+--- no_error_log
+[error]
+
+
+
+=== TEST 27: stats and status
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number stats=on;
+    lua_shared_rbtree rbtree2 1m cmp=number shards=2;
+--- config
+    location = /status {
+        lua_shared_rbtree_status;
+    }
+
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+
+            for _, rbtree in ipairs{shrbtree.rbtree1, shrbtree.rbtree2} do
+                for i = 1, 10 do
+                    rbtree:insert{i, i}
+                end
+                rbtree:insert{1, 1}
+                rbtree:replace{11, 11}
+                rbtree:delete{10}
+                rbtree:get{1}
+                rbtree:get{10}
+                rbtree:mget{{2, 3, 12}}
+
+                local st = rbtree:stats()
+                ngx.say(st.nodes, " ", st.writes, " ", st.write_misses, " ",
+                        st.reads, " ", st.read_misses, " ",
+                        st.max_compares > 0, " ", #st.lock_wait, " ",
+                        st.size > 0, " ", st.free <= st.size, " ",
+                        st.shards and #st.shards)
+            end
+
+            local res = ngx.location.capture("/status")
+            local json = res.body
+            ngx.say(res.status, " ", json:sub(1, 2),
+                    json:match("\\"rbtree1\\":{\\"nodes\\":(%d+)"), " ",
+                    json:match("\\"rbtree2\\":{\\"nodes\\":(%d+)"), " ",
+                    json:match("\\"pinned\\":(%d+)"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+9 13 2 5 2 true 16 true true nil
+9 13 2 0 0 false 16 true true 2
+200 {"9 9 0
+--- no_error_log
+[error]
+
+
+
+=== TEST 28: l1 cache
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number l1=2 stats=on;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{1, {name = "a"}}
+            rbtree:insert{2, "b"}
+            rbtree:insert{3, "c"}
+            rbtree:insert{4, "d", ttl = 60}
+
+            local one = rbtree:get{1}
+            ngx.say(one.name, " ", rbtree:get{1} == one)
+            ngx.say(rbtree:get{2}, rbtree:get{3}, rbtree:get{1} == one)
+            ngx.say(rbtree:get{4}, rbtree:get{4}, rbtree:get{5})
+
+            rbtree:set{1, {name = "x"}}
+            ngx.say(rbtree:get{1}.name, " ", rbtree:get{1} == one)
+
+            rbtree:delete{2}
+            ngx.say(rbtree:get{2})
+
+            ngx.say(rbtree:stats().reads)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+a true
+bctrue
+ddnilno exists
+x false
+nilno exists
+8
+--- no_error_log
+[error]
+
+
+
+=== TEST 29: booleans and strings in the narrow header
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=string;
+    lua_shared_rbtree rbtree2 1m cmp=string encoding=packed;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+
+            for _, rbtree in ipairs{shrbtree.rbtree1, shrbtree.rbtree2} do
+                local long = string.rep("x", 70000)
+
+                rbtree:insert{"a", true}
+                rbtree:insert{"b", {ok = false, [true] = long, n = 1.5}}
+                rbtree:insert{long, "long"}
+                rbtree:set{"a", false}
+
+                local t = rbtree:get{"b"}
+                ngx.say(rbtree:get{"a"}, " ", t.ok, " ", #t[true], " ", t.n,
+                        " ", rbtree:get{"b", "ok"}, " ", rbtree:get{long})
+            end
+        ';
+    }
+--- request
+GET /test
+--- response_body
+false false 70000 1.5 false long
+false false 70000 1.5 false long
+--- no_error_log
+[error]
+
+
+
+=== TEST 30: engine=btree
+--- http_config
+    lua_shared_rbtree rbtree1 4m cmp=number engine=btree;
+    lua_shared_rbtree rbtree2 4m cmp=interval engine=btree;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            local items = {}
+            for i = 1, 1000 do
+                items[i] = {i * 2, i}
+            end
+            ngx.say(rbtree:bulk_load(items))
+
+            local ok = 0
+            for i = 0, 2001 do
+                local v = rbtree:get{i}
+                if (i % 2 == 0 and i > 0 and i <= 2000 and v == i / 2)
+                   or ((i % 2 == 1 or i == 0 or i > 2000) and v == nil)
+                then
+                    ok = ok + 1
+                end
+            end
+            ngx.say(ok, " ", rbtree:get{math.huge}, " ",
+                    rbtree:get{-math.huge})
+
+            local values = rbtree:mget{{4, 5, 2000}}
+            ngx.say(values[1], values[2], values[3])
+
+            rbtree:insert{5, "five"}
+            rbtree:delete{4}
+            ngx.say(rbtree:get{5}, rbtree:get{4}, " ", rbtree:get{6})
+
+            rbtree = shrbtree.rbtree2
+            items = {}
+            for i = 1, 100 do
+                items[i] = {{i * 10, i * 10 + 4}, i}
+            end
+            ngx.say(rbtree:bulk_load(items))
+            ngx.say(rbtree:get{10}, rbtree:get{14}, rbtree:get{15}, " ",
+                    rbtree:get{{16, 21}}, rbtree:get{1004}, rbtree:get{9})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true1000
+2002 nil nilno exists
+2nil1000
+fivenil 3
+true100
+11nil 2100nilno exists
+--- no_error_log
+[error]
+
+
+
+=== TEST 31: resty.shrbtree
+--- http_config
+    lua_package_path "$prefix/../../lib/?.lua;;";
+    lua_shared_rbtree rbtree1 1m cmp=string;
+    lua_shared_rbtree rbtree2 1m cmp=number shards=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local frbtree = require("resty.shrbtree").new(shrbtree.rbtree1)
+
+            ngx.say(frbtree:insert("a", "one"))
+            ngx.say(frbtree:insert("a", "uno"))
+            ngx.say(frbtree:replace("b", 2))
+            ngx.say(frbtree:set("b", true))
+            ngx.say(frbtree:set("c", string.rep("x", 5000)))
+            ngx.say(frbtree:set("d", {x = 1}))
+            ngx.say(frbtree:get("a"), " ", frbtree:get("b"), " ",
+                    #frbtree:get("c"), " ", frbtree:get("d").x)
+            ngx.say(shrbtree.rbtree1:get{"a"}, frbtree:get("e"))
+            ngx.say(frbtree:delete("a"))
+            ngx.say(frbtree:delete("a"))
+            ngx.say(pcall(frbtree.get, frbtree, 1))
+
+            frbtree = require("resty.shrbtree").new(shrbtree.rbtree2)
+            for i = 1, 100 do
+                frbtree:set(i, i * 2)
+            end
+
+            local ok = 0
+            for i = 1, 100 do
+                if shrbtree.rbtree2:get{i} == i * 2
+                   and frbtree:get(i) == i * 2
+                then
+                    ok = ok + 1
+                end
+            end
+            ngx.say(ok)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true
+falsethe node exists
+falseno exists
+true
+true
+true
+one true 5000 1
+onenilno exists
+true
+falseno exists
+falsebad key, excpected string
+100
+--- no_error_log
+[error]
+
+
+
+=== TEST 32: index=
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=interval index=asn,country;
+    lua_shared_rbtree rbtree2 1m cmp=number shards=2 encoding=packed index=n;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{{0, 9}, {asn = 1, country = "us"}}
+            rbtree:insert{{10, 19}, {asn = 2, country = "us"}}
+            rbtree:insert{{20, 29}, {asn = 1, country = "de"}}
+            rbtree:insert{{30, 39}, {country = "fr"}}
+            rbtree:insert{{40, 49}, "no table"}
+
+            local function lows(keys)
+                local t = {}
+                for i, k in ipairs(keys) do
+                    t[i] = k[1]
+                end
+                table.sort(t)
+                return table.concat(t, ",")
+            end
+
+            ngx.say(lows(rbtree:get_by{"asn", 1}), " ",
+                    lows(rbtree:get_by{"country", "us"}), " ",
+                    #rbtree:get_by{"asn", 3})
+
+            rbtree:delete{{0, 9}}
+            rbtree:set{{10, 19}, {asn = 1, country = "de"}}
+            rbtree:incr{{20, 29}, 5, "asn"}
+            ngx.say(lows(rbtree:get_by{"asn", 1}), " ",
+                    lows(rbtree:get_by{"asn", 6}), " ",
+                    lows(rbtree:get_by{"country", "de"}), " ",
+                    #rbtree:get_by{"country", "us"})
+
+            local keys, values = rbtree:get_by{"country", "fr"}
+            ngx.say(keys[1][1], values[1].country, values[1].asn)
+            ngx.say(pcall(rbtree.get_by, rbtree, {"city", "x"}))
+
+            rbtree = shrbtree.rbtree2
+            local items = {}
+            for i = 1, 100 do
+                items[i] = {i, {n = i % 10}}
+            end
+            rbtree:bulk_load(items)
+            ngx.say(#rbtree:get_by{"n", 3}, " ", #rbtree:get_by{"n", 3, 4})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+0,20 0,10 0
+10 20 10,20 0
+30frnil
+falsebad argument #2 to '?' (no such index)
+10 4
+--- no_error_log
+[error]
+
+
+
+=== TEST 33: snapshot
+--- http_config
+    lua_shared_rbtree rbtree 1m cmp=number shards=2;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            rbtree:bulk_load{{1, "a"}, {2, {x = "b"}}, {3, "c"}}
+
+            local snap = rbtree:snapshot()
+            ngx.say(snap:get{1}, snap:get{2, "x"}, " ", snap:get{4})
+
+            rbtree:bulk_load({{1, "A"}, {2, {x = "B"}}}, {swap = true})
+            ngx.say(snap:get{1}, snap:get{2, "x"}, snap:get{3}, " ",
+                    rbtree:get{1}, rbtree:get{3})
+
+            local fresh = rbtree:snapshot()
+            rbtree:set{1, "AA"}
+            rbtree:set{2, {x = "BB"}}
+            ngx.say(fresh:get{1}, " ", fresh:get{2})
+            ngx.say(snap:get{3})
+
+            snap:release()
+            fresh:release()
+            ngx.say(snap:get{1})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+ab nilno exists
+abc Anilno exists
+nil nilstale snapshot
+c
+nilreleased snapshot
+--- no_error_log
+[error]
+
+
+
+=== TEST 34: begin_reload, stage, commit
+--- http_config
+    lua_shared_rbtree rbtree 1m cmp=number shards=2;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            rbtree:insert{1, "a"}
+            rbtree:insert{2, "b"}
+
+            ngx.say(rbtree:stage{3, "C"})
+            ngx.say(rbtree:begin_reload())
+            ngx.say(rbtree:begin_reload())
+
+            for i = 1, 100 do
+                rbtree:stage{i, tostring(i)}
+            end
+            ngx.say(rbtree:stage{3, {x = "C"}})
+            ngx.say(rbtree:get{1}, rbtree:get{3})
+
+            local snap = rbtree:snapshot()
+            ngx.say(rbtree:commit())
+            ngx.say(snap:get{2}, " ", rbtree:get{2})
+            snap:release()
+            ngx.say(rbtree:get{1}, " ", rbtree:get{100}, " ",
+                    rbtree:stats().nodes)
+            ngx.say(rbtree:commit())
+
+            rbtree:begin_reload()
+            rbtree:stage{7, "g"}
+            ngx.say(rbtree:abort_reload())
+            ngx.say(rbtree:get{7}, rbtree:get{1})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+falseno reload in progress
+true
+falsea reload is in progress
+falsethe node exists
+anilno exists
+true100
+b 2
+1 100 100
+falseno reload in progress
+true
+nil1
+--- no_error_log
+[error]
+
+
+
+=== TEST 35: apply_delta
+--- http_config
+    lua_shared_rbtree rbtree 1m cmp=number rank=on;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree
+
+            local items = {}
+            for i = 1, 1000 do
+                items[i] = {i * 2, i}
+            end
+            rbtree:bulk_load(items)
+
+            local changes = {}
+            for i = 1, 250 do
+                local k = i * 8
+                changes[#changes + 1] = {k - 1, "odd"}
+                changes[#changes + 1] = {k}
+                changes[#changes + 1] = {k + 2, {v = k + 2}}
+            end
+            ngx.say(rbtree:apply_delta(changes))
+
+            ngx.say(rbtree:get{7}, rbtree:get{8}, " ", rbtree:get{10, "v"},
+                    " ", rbtree:get{12})
+            ngx.say(rbtree:count{1, 2001}, " ", rbtree:select{1})
+
+            ngx.say(rbtree:apply_delta{{3, 1}, {2, 1}})
+            ngx.say(rbtree:apply_delta({{3}}, {cmp = function(a, b)
+                return a - b
+            end}))
+            ngx.say(rbtree:get{3})
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true750
+oddnil 10 6
+1000 21
+falsekeys are not in ascending order
+true1
+nilno exists
+--- no_error_log
+[error]
+
+
+
+=== TEST 36: l1 cache of interval points
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=interval l1=4 stats=on;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{{10, 19}, {cc = "a"}}
+
+            local a = rbtree:get{12}
+            ngx.say(a.cc, " ", rbtree:get{12} == a, " ", rbtree:get{15} == a)
+
+            rbtree:set{{10, 19}, {cc = "b"}}
+            ngx.say(rbtree:get{12}.cc, " ", rbtree:get{20})
+
+            ngx.say(rbtree:stats().reads)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+a true false
+b nilno exists
+4
+--- no_error_log
+[error]
+
+
+
+=== TEST 37: pinned views and snapshots
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{1, "one"}
+
+            local view = rbtree:view{1}
+            local snap = rbtree:snapshot()
+            ngx.say(rbtree:stats().pinned)
+
+            view:release()
+            snap:release()
+            ngx.say(rbtree:stats().pinned)
+
+            local views = {}
+            for i = 1, 1024 do
+                views[i] = rbtree:view{1}
+            end
+
+            ngx.say(rbtree:view{1})
+            ngx.say(rbtree:snapshot())
+
+            for i = 1, 1024 do
+                views[i]:release()
+            end
+
+            ngx.say(rbtree:stats().pinned)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+2
+0
+niltoo many views held
+niltoo many snapshots held
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 38: resty.shrbtree of an interval zone
+--- http_config
+    lua_package_path "$prefix/../../lib/?.lua;;";
+    lua_shared_rbtree rbtree1 1m cmp=interval;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local frbtree = require("resty.shrbtree").new(shrbtree.rbtree1)
+
+            shrbtree.rbtree1:insert{{10, 19}, "AU"}
+            shrbtree.rbtree1:insert{{20, 29}, {cc = "NZ"}}
+
+            ngx.say(frbtree:get(12), " ", frbtree:get(25).cc, " ",
+                    frbtree:get(30))
+            ngx.say(pcall(frbtree.set, frbtree, 5, "x"))
+            ngx.say(pcall(frbtree.get, frbtree, 0/0))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+AU NZ nilno exists
+falsethe writes of a cmp=interval zone take the table api
+falsebad key, NaN
+--- no_error_log
+[error]
+
+
+
+=== TEST 39: NaN keys
+--- http_config
+    lua_shared_rbtree rbtree1 1m cmp=number;
+    lua_shared_rbtree rbtree2 1m cmp=interval;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            rbtree:insert{1, "a"}
+            rbtree:insert{2, "b"}
+
+            ngx.say(pcall(rbtree.get, rbtree, {0/0}))
+            ngx.say(pcall(rbtree.set, rbtree, {0/0, "x"}))
+            ngx.say(rbtree:get{2}, " ", rbtree:get{3})
+
+            rbtree = shrbtree.rbtree2
+            ngx.say(pcall(rbtree.insert, rbtree, {{1, 0/0}, "x"}))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+falsebad key, NaN
+falsebad key, NaN
+b nilno exists
+falsebad key, NaN
+--- no_error_log
+[error]
+
+
+
+=== TEST 40: a held snapshot doesn't block eviction, and expires
+--- http_config
+    lua_shared_rbtree rbtree1 64k cmp=number evict=clock;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            local value = string.rep("x", 1000)
+
+            rbtree:insert{1, value}
+
+            local snap = rbtree:snapshot()
+            ngx.say(#snap:get{1})
+
+            local n = 0
+
+            for i = 2, 200 do
+                if rbtree:insert{i, value} then
+                    n = n + 1
+                end
+            end
+
+            ngx.say(n)
+            ngx.say(snap:get{1})
+
+            local fresh = rbtree:snapshot()
+            ngx.say(#fresh:get{200})
+
+            ngx.sleep(5.5)
+            ngx.say(fresh:get{200})
+            ngx.say(rbtree:stats().pinned)
+        ';
+    }
+--- request
+GET /test
+--- timeout: 10
+--- response_body
+1000
+199
+nilstale snapshot
+1000
+nilexpired snapshot
+0
+--- no_error_log
+[error]
+
+
+
+=== TEST 41: engine=btree is rebuilt after writes
+--- http_config
+    lua_shared_rbtree rbtree1 4m cmp=number engine=btree stats=on;
+--- config
+    location = /test {
+        content_by_lua '
+            local shrbtree = require("shrbtree")
+            local rbtree = shrbtree.rbtree1
+
+            local items = {}
+            for i = 1, 1000 do
+                items[i] = {i * 2, i}
+            end
+            rbtree:bulk_load(items)
+
+            rbtree:insert{5, "five"}
+            rbtree:delete{4}
+
+            local function compares()
+                local st = rbtree:stats()
+                local reads, total = st.reads, st.avg_compares * st.reads
+                for i = 1, 100 do
+                    rbtree:get{i * 20}
+                end
+                st = rbtree:stats()
+                return (st.avg_compares * st.reads - total)
+                       / (st.reads - reads)
+            end
+
+            ngx.say(compares() > 3)
+
+            -- quiet for a sweep interval, then rebuilt by the next sweep
+            ngx.sleep(2.5)
+
+            ngx.say(compares() <= 3)
+            ngx.say(rbtree:get{5}, rbtree:get{4}, " ", rbtree:get{6},
+                    rbtree:get{2000})
+        ';
+    }
+--- request
+GET /test
+--- timeout: 10
+--- response_body
+true
+true
+fivenilno exists 31000
+--- no_error_log
+[error]